@@ -4,11 +4,20 @@
  * Userspace helper which sends regulatory domains to Linux via nl80211
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 #include <netlink/genl/genl.h>
 #include <netlink/genl/family.h>
@@ -18,6 +27,7 @@
 #include "nl80211.h"
 
 #include "reglib.h"
+#include "probes.h"
 
 #if !defined(CONFIG_LIBNL20) && !defined(CONFIG_LIBNL30) && !defined(CONFIG_LIBNL32)
 /* libnl 2.0 compatibility code */
@@ -50,10 +60,81 @@ struct nl80211_state {
 	struct genl_family *nl80211;
 };
 
+/*
+ * Stats
+ *
+ * With --stats crda times the netlink side of a request the way reglib
+ * times its own phases, and prints both once done. The daemon prints
+ * them on SIGUSR1 as well. The same phases have USDT probes whenever
+ * CONFIG_SDT is set, with --stats or not.
+ */
+struct crda_stats {
+	uint64_t nl_init_ns;
+	uint64_t nl_cache_ns;
+	uint64_t requests;
+	uint64_t build_ns;
+	uint64_t send_ns;
+	uint64_t ack_ns;
+};
+
+static struct crda_stats crda_stats;
+static bool crda_stats_enabled;
+
+static uint64_t crda_stat_clock(void)
+{
+	struct timespec ts;
+
+	if (!crda_stats_enabled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the time since @start and adds it to @ns, if timed */
+static uint64_t crda_stat_time(uint64_t *ns, uint64_t start)
+{
+	uint64_t now;
+
+	if (!start)
+		return 0;
+
+	now = crda_stat_clock();
+	*ns += now - start;
+	return now - start;
+}
+
+static void crda_print_stats(void)
+{
+	struct reglib_stats stats;
+
+	if (!crda_stats_enabled)
+		return;
+
+	reglib_get_stats(&stats);
+	reglib_fprint_stats(stderr, &stats);
+
+	fprintf(stderr, "nl_init_ns %llu\n",
+		(unsigned long long) crda_stats.nl_init_ns);
+	fprintf(stderr, "nl_cache_ns %llu\n",
+		(unsigned long long) crda_stats.nl_cache_ns);
+	fprintf(stderr, "requests %llu\n",
+		(unsigned long long) crda_stats.requests);
+	fprintf(stderr, "build_ns %llu\n",
+		(unsigned long long) crda_stats.build_ns);
+	fprintf(stderr, "send_ns %llu\n",
+		(unsigned long long) crda_stats.send_ns);
+	fprintf(stderr, "ack_ns %llu\n",
+		(unsigned long long) crda_stats.ack_ns);
+}
+
 static int nl80211_init(struct nl80211_state *state)
 {
+	uint64_t start, cache_start, ns;
 	int err;
 
+	start = crda_stat_clock();
+
 	state->nl_sock = nl_socket_alloc();
 	if (!state->nl_sock) {
 		fprintf(stderr, "Failed to allocate netlink sock.\n");
@@ -66,11 +147,14 @@ static int nl80211_init(struct nl80211_state *state)
 		goto out_sock_destroy;
 	}
 
+	cache_start = crda_stat_clock();
 	if (genl_ctrl_alloc_cache(state->nl_sock, &state->nl_cache)) {
 		fprintf(stderr, "Failed to allocate generic netlink cache.\n");
 		err = -ENOMEM;
 		goto out_sock_destroy;
 	}
+	ns = crda_stat_time(&crda_stats.nl_cache_ns, cache_start);
+	DTRACE_PROBE2(crda, nl_cache, 0, ns);
 
 	state->nl80211 = genl_ctrl_search_by_name(state->nl_cache, "nl80211");
 	if (!state->nl80211) {
@@ -79,6 +163,9 @@ static int nl80211_init(struct nl80211_state *state)
 		goto out_cache_free;
 	}
 
+	ns = crda_stat_time(&crda_stats.nl_init_ns, start);
+	DTRACE_PROBE2(crda, nl_init, 0, ns);
+
 	return 0;
 
  out_cache_free:
@@ -140,92 +227,59 @@ nla_put_failure:
 	return -1;
 }
 
-int main(int argc, char **argv)
-{
-	int fd = -1;
-	int i = 0, j, r;
-	char alpha2[3];
-	char *env_country;
-	struct nl80211_state nlstate;
-	struct nl_cb *cb = NULL;
-	struct nl_msg *msg;
-	int finished = 0;
-
-	memset(alpha2, 0, 3);
-
-	struct nlattr *nl_reg_rules;
-	const struct ieee80211_regdomain *rd = NULL;
-
-	const char *regdb_paths[] = {
-		"/usr/local/lib/crda/regulatory.bin", /* Users/preloads can override */
-		"/usr/lib/crda/regulatory.bin", /* General distribution package usage */
-		"/lib/crda/regulatory.bin", /* alternative for distributions */
-		NULL
-	};
-	const char **regdb = regdb_paths;
-
-	if (argc != 1) {
-		fprintf(stderr, "Usage: %s\n", argv[0]);
-		return -EINVAL;
-	}
-
-	env_country = getenv("COUNTRY");
-	if (!env_country) {
-		fprintf(stderr, "COUNTRY environment variable not set.\n");
-		return -EINVAL;
-	}
-
-	if (!reglib_is_valid_regdom(env_country)) {
-		fprintf(stderr, "COUNTRY environment variable must be an "
-			"ISO ISO 3166-1-alpha-2 (uppercase) or 00\n");
-		return -EINVAL;
-	}
+static const char *const regdb_paths[] = {
+	"/usr/local/lib/crda/regulatory.bin", /* Users/preloads can override */
+	"/usr/lib/crda/regulatory.bin", /* General distribution package usage */
+	"/lib/crda/regulatory.bin", /* alternative for distributions */
+	NULL
+};
 
-	memcpy(alpha2, env_country, 2);
+static const struct reglib_regdb_ctx *crda_open_regdb(const char **path)
+{
+	const struct reglib_regdb_ctx *ctx;
+	const char *regdb = NULL;
 
-	while (*regdb != NULL) {
-		fd = open(*regdb, O_RDONLY);
-		if (fd >= 0)
-			break;
-		regdb++;
+	ctx = reglib_malloc_regdb_ctx_search(regdb_paths, &regdb);
+#ifdef CONFIG_REGDB_BUILTIN
+	/* A valid regulatory.bin on disk overrides the one built in */
+	if (!ctx) {
+		if (regdb)
+			fprintf(stderr, "Invalid regulatory database %s, "
+				"using the builtin one\n", regdb);
+		regdb = NULL;
+		ctx = reglib_malloc_regdb_ctx_builtin(&reglib_builtin_regdb);
+		if (!ctx)
+			fprintf(stderr, "Failed to set up the builtin "
+				"regulatory database\n");
 	}
-	if (fd < 0) {
-		perror("failed to open db file");
-		return -ENOENT;
-	}
-
-	close(fd);
-
-	rd = reglib_get_rd_alpha2(alpha2, *regdb);
-	if (!rd) {
-		fprintf(stderr, "No country match in regulatory database.\n");
-		return -1;
+#else
+	if (!ctx) {
+		if (!regdb)
+			perror("failed to open db file");
+		else
+			fprintf(stderr, "Invalid regulatory database %s\n",
+				regdb);
 	}
+#endif
 
-	r = nl80211_init(&nlstate);
-	if (r) {
-		free((struct ieee80211_regdomain *) rd);
-		return -EIO;
-	}
+	if (path)
+		*path = regdb;
 
-	msg = nlmsg_alloc();
-	if (!msg) {
-		fprintf(stderr, "Failed to allocate netlink message.\n");
-		r = -1;
-		goto out;
-	}
+	return ctx;
+}
 
-	genlmsg_put(msg, 0, 0, genl_family_get_id(nlstate.nl80211), 0,
-		0, NL80211_CMD_SET_REG, 0);
+static int crda_put_regdom(struct nl_msg *msg, const char *alpha2,
+			   const struct ieee80211_regdomain *rd)
+{
+	struct nlattr *nl_reg_rules;
+	int i = 0, j;
 
 	NLA_PUT_STRING(msg, NL80211_ATTR_REG_ALPHA2, alpha2);
 	NLA_PUT_U8(msg, NL80211_ATTR_DFS_REGION, rd->dfs_region);
 
 	nl_reg_rules = nla_nest_start(msg, NL80211_ATTR_REG_RULES);
-	if (!nl_reg_rules) {
-		r = -1;
+	if (!nl_reg_rules)
 		goto nla_put_failure;
-	}
 
 	for (j = 0; j < rd->n_reg_rules; j++) {
 		struct nlattr *nl_reg_rule;
@@ -233,8 +287,7 @@ int main(int argc, char **argv)
 		if (!nl_reg_rule)
 			goto nla_put_failure;
 
-		r = put_reg_rule(&rd->reg_rules[j], msg);
-		if (r)
+		if (put_reg_rule(&rd->reg_rules[j], msg))
 			goto nla_put_failure;
 
 		nla_nest_end(msg, nl_reg_rule);
@@ -242,11 +295,50 @@ int main(int argc, char **argv)
 
 	nla_nest_end(msg, nl_reg_rules);
 
+	return 0;
+
+nla_put_failure:
+	return -1;
+}
+
+static struct nl_msg *crda_alloc_set_reg(struct nl80211_state *nlstate,
+					 size_t payload)
+{
+	struct nl_msg *msg;
+
+	if (payload)
+		msg = nlmsg_alloc_size(NLMSG_HDRLEN + GENL_HDRLEN + payload);
+	else
+		msg = nlmsg_alloc();
+	if (!msg) {
+		fprintf(stderr, "Failed to allocate netlink message.\n");
+		return NULL;
+	}
+
+	genlmsg_put(msg, 0, 0, genl_family_get_id(nlstate->nl80211), 0,
+		0, NL80211_CMD_SET_REG, 0);
+
+	return msg;
+}
+
+static int crda_send_set_reg(struct nl80211_state *nlstate,
+			     struct nl_msg *msg)
+{
+	struct nl_cb *cb;
+	uint64_t start, ns;
+	int finished = 0;
+	int r;
+
 	cb = nl_cb_alloc(NL_CB_CUSTOM);
 	if (!cb)
-		goto cb_out;
+		return -ENOMEM;
 
-	r = nl_send_auto_complete(nlstate.nl_sock, msg);
+	if (crda_stats_enabled)
+		crda_stats.requests++;
+	start = crda_stat_clock();
+	r = nl_send_auto_complete(nlstate->nl_sock, msg);
+	ns = crda_stat_time(&crda_stats.send_ns, start);
+	DTRACE_PROBE2(crda, send, r, ns);
 
 	if (r < 0) {
 		fprintf(stderr, "Failed to send regulatory request: %d\n", r);
@@ -258,7 +350,10 @@ int main(int argc, char **argv)
 	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, NULL);
 
 	if (!finished) {
-		r = nl_wait_for_ack(nlstate.nl_sock);
+		start = crda_stat_clock();
+		r = nl_wait_for_ack(nlstate->nl_sock);
+		ns = crda_stat_time(&crda_stats.ack_ns, start);
+		DTRACE_PROBE2(crda, ack, r, ns);
 		if (r < 0) {
 			fprintf(stderr, "Failed to set regulatory domain: "
 				"%d\n", r);
@@ -268,11 +363,1051 @@ int main(int argc, char **argv)
 
 cb_out:
 	nl_cb_put(cb);
+	return r;
+}
+
+static int crda_set_regdom(struct nl80211_state *nlstate, const char *alpha2,
+			   const struct ieee80211_regdomain *rd)
+{
+	struct nl_msg *msg;
+	uint64_t start;
+	int r;
+
+	start = crda_stat_clock();
+
+	msg = crda_alloc_set_reg(nlstate, 0);
+	if (!msg)
+		return -1;
+
+	if (crda_put_regdom(msg, alpha2, rd)) {
+		nlmsg_free(msg);
+		return -1;
+	}
+
+	crda_stat_time(&crda_stats.build_ns, start);
+
+	r = crda_send_set_reg(nlstate, msg);
+	nlmsg_free(msg);
+
+	return r;
+}
+
+/*
+ * Message cache
+ *
+ * The attributes of the NL80211_CMD_SET_REG message for a country are a
+ * function of the regdb alone. With --precompute the daemon serializes
+ * them for every country of the regdb once at start up, a request is then
+ * answered by copying them behind a new genetlink header and sending that.
+ */
+struct crda_msg_attrs {
+	char alpha2[2];
+	uint32_t len;
+	void *data;
+};
+
+struct crda_msg_cache {
+	unsigned int n_attrs;
+	struct crda_msg_attrs *attrs;
+};
+
+static int crda_msg_attrs_cmp(const void *a, const void *b)
+{
+	const struct crda_msg_attrs *attrs_a = a, *attrs_b = b;
+
+	return memcmp(attrs_a->alpha2, attrs_b->alpha2, 2);
+}
+
+static void crda_free_msg_cache(struct crda_msg_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->n_attrs; i++)
+		free(cache->attrs[i].data);
+	free(cache->attrs);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static int crda_build_msg_cache(struct nl80211_state *nlstate,
+				const struct reglib_regdb_ctx *ctx,
+				struct crda_msg_cache *cache)
+{
+	const struct ieee80211_regdomain *rd;
+	struct crda_msg_attrs *attrs;
+	struct genlmsghdr *gnlh;
+	struct nl_msg *msg;
+	unsigned int idx = 0;
+	char alpha2[3];
+
+	memset(cache, 0, sizeof(*cache));
+	memset(alpha2, 0, 3);
+
+	cache->attrs = calloc(ctx->num_countries, sizeof(*cache->attrs));
+	if (!cache->attrs)
+		return -ENOMEM;
+
+	reglib_for_each_country(rd, idx, ctx) {
+		attrs = &cache->attrs[cache->n_attrs];
+		memcpy(alpha2, rd->alpha2, 2);
+
+		msg = crda_alloc_set_reg(nlstate, 0);
+		if (!msg || crda_put_regdom(msg, alpha2, rd)) {
+			if (msg)
+				nlmsg_free(msg);
+			free((struct ieee80211_regdomain *) rd);
+			goto err;
+		}
+		free((struct ieee80211_regdomain *) rd);
+
+		gnlh = nlmsg_data(nlmsg_hdr(msg));
+		attrs->len = genlmsg_attrlen(gnlh, 0);
+		attrs->data = malloc(attrs->len);
+		if (!attrs->data) {
+			nlmsg_free(msg);
+			goto err;
+		}
+		memcpy(attrs->data, genlmsg_attrdata(gnlh, 0), attrs->len);
+		memcpy(attrs->alpha2, alpha2, 2);
+		nlmsg_free(msg);
+
+		cache->n_attrs++;
+	}
+
+	qsort(cache->attrs, cache->n_attrs, sizeof(*cache->attrs),
+	      crda_msg_attrs_cmp);
+
+	return 0;
+err:
+	fprintf(stderr, "Failed to serialize country %s\n", alpha2);
+	crda_free_msg_cache(cache);
+	return -ENOMEM;
+}
+
+static const struct crda_msg_attrs *
+crda_msg_cache_find(const struct crda_msg_cache *cache, const char *alpha2)
+{
+	struct crda_msg_attrs key;
+
+	memcpy(key.alpha2, alpha2, 2);
+
+	return bsearch(&key, cache->attrs, cache->n_attrs,
+		       sizeof(*cache->attrs), crda_msg_attrs_cmp);
+}
+
+/*
+ * Batches
+ *
+ * A batch answers several requests in one go, say one for each radio of
+ * a system with per-radio regulatory domains. The messages are built
+ * first and then sent back to back on the one socket, their ACKs being
+ * matched up by sequence number as they come in, so that a batch waits
+ * on the kernel once instead of once per request. At most
+ * CRDA_BATCH_WINDOW requests are in flight at a time so the ACKs, which
+ * carry the whole request back on errors, fit the socket buffer.
+ *
+ * A request may name a wiphy, which is passed along as NL80211_ATTR_WIPHY.
+ */
+#define CRDA_BATCH_WINDOW	32
+
+struct crda_request {
+	char alpha2[3];
+	bool has_wiphy;
+	uint32_t wiphy;
+	uint32_t seq;
+	bool pending;
+	int err;
+};
+
+struct crda_batch {
+	unsigned int n_reqs;
+	unsigned int size;
+	struct crda_request *reqs;
+	unsigned int pending;
+};
+
+static void crda_free_batch(struct crda_batch *batch)
+{
+	free(batch->reqs);
+	memset(batch, 0, sizeof(*batch));
+}
+
+/* Asking for the same thing twice in one batch only costs a round trip */
+static int crda_batch_add(struct crda_batch *batch, const char *alpha2,
+			  bool has_wiphy, uint32_t wiphy)
+{
+	struct crda_request *req;
+	unsigned int i;
+
+	for (i = 0; i < batch->n_reqs; i++) {
+		req = &batch->reqs[i];
+		if (!memcmp(req->alpha2, alpha2, 2) &&
+		    req->has_wiphy == has_wiphy &&
+		    (!has_wiphy || req->wiphy == wiphy))
+			return 0;
+	}
+
+	if (batch->n_reqs == batch->size) {
+		req = realloc(batch->reqs, (batch->size ? batch->size * 2 : 8) *
+			      sizeof(*batch->reqs));
+		if (!req)
+			return -ENOMEM;
+		batch->reqs = req;
+		batch->size = batch->size ? batch->size * 2 : 8;
+	}
+
+	req = &batch->reqs[batch->n_reqs++];
+	memset(req, 0, sizeof(*req));
+	memcpy(req->alpha2, alpha2, 2);
+	req->has_wiphy = has_wiphy;
+	req->wiphy = wiphy;
+
+	return 0;
+}
+
+/* Adds a request given as <alpha2>[@<wiphy index>] */
+static int crda_batch_add_arg(struct crda_batch *batch, const char *arg)
+{
+	unsigned long wiphy = 0;
+	bool has_wiphy = false;
+	char *end;
+
+	if (strlen(arg) < 2 || (arg[2] && arg[2] != '@'))
+		goto invalid;
+
+	if (arg[2] == '@') {
+		errno = 0;
+		wiphy = strtoul(arg + 3, &end, 10);
+		if (!arg[3] || *end || errno || wiphy > UINT32_MAX)
+			goto invalid;
+		has_wiphy = true;
+	}
+
+	if (!reglib_is_valid_regdom(arg))
+		goto invalid;
+
+	return crda_batch_add(batch, arg, has_wiphy, wiphy);
+
+invalid:
+	fprintf(stderr, "Invalid request %s, expected an ISO 3166-1-alpha-2 "
+		"(uppercase) or 00, optionally followed by @<wiphy>\n", arg);
+	return -EINVAL;
+}
+
+static int crda_batch_build(struct nl80211_state *nlstate,
+			    const struct reglib_regdb_ctx *ctx,
+			    const struct crda_msg_cache *cache,
+			    const struct crda_request *req,
+			    struct nl_msg **msgp)
+{
+	const struct ieee80211_regdomain *rd;
+	const struct crda_msg_attrs *attrs;
+	struct nl_msg *msg;
+	size_t wiphy_len;
+	int r;
+
+	wiphy_len = req->has_wiphy ? nla_total_size(sizeof(uint32_t)) : 0;
+
+	if (cache) {
+		attrs = crda_msg_cache_find(cache, req->alpha2);
+		if (!attrs)
+			goto no_match;
+
+		msg = crda_alloc_set_reg(nlstate, attrs->len + wiphy_len);
+		if (!msg)
+			return -ENOMEM;
+
+		if (nlmsg_append(msg, attrs->data, attrs->len, NLMSG_ALIGNTO))
+			goto nla_put_failure;
+	} else {
+		rd = reglib_get_rd_alpha2_ctx(ctx, req->alpha2);
+		if (!rd)
+			goto no_match;
+
+		msg = crda_alloc_set_reg(nlstate, 0);
+		if (!msg) {
+			free((struct ieee80211_regdomain *) rd);
+			return -ENOMEM;
+		}
+
+		r = crda_put_regdom(msg, req->alpha2, rd);
+		free((struct ieee80211_regdomain *) rd);
+		if (r)
+			goto nla_put_failure;
+	}
+
+	if (req->has_wiphy)
+		NLA_PUT_U32(msg, NL80211_ATTR_WIPHY, req->wiphy);
+
+	*msgp = msg;
+	return 0;
+
 nla_put_failure:
+	fprintf(stderr, "Failed to build the request for %s\n", req->alpha2);
 	nlmsg_free(msg);
+	return -ENOMEM;
+no_match:
+	fprintf(stderr, "No country match for %s in regulatory database.\n",
+		req->alpha2);
+	return -ENOENT;
+}
+
+static void crda_batch_complete(struct crda_batch *batch, uint32_t seq,
+				int err)
+{
+	struct crda_request *req;
+	unsigned int i;
+
+	for (i = 0; i < batch->n_reqs; i++) {
+		req = &batch->reqs[i];
+		if (!req->pending || req->seq != seq)
+			continue;
+		req->pending = false;
+		req->err = err;
+		batch->pending--;
+		return;
+	}
+}
+
+static int crda_batch_ack_handler(struct nl_msg *msg, void *arg)
+{
+	crda_batch_complete(arg, nlmsg_hdr(msg)->nlmsg_seq, 0);
+	return NL_SKIP;
+}
+
+static int crda_batch_error_handler(struct sockaddr_nl __attribute__((unused)) *nla,
+				    struct nlmsgerr *err, void *arg)
+{
+	crda_batch_complete(arg, err->msg.nlmsg_seq, err->error);
+	return NL_SKIP;
+}
+
+/* Several requests are in flight, the ACK handlers match them up instead */
+static int crda_batch_seq_check(struct nl_msg __attribute__((unused)) *msg,
+				void __attribute__((unused)) *arg)
+{
+	return NL_OK;
+}
+
+/* Receives ACKs until at most @max_pending requests are left without one */
+static int crda_batch_wait(struct nl80211_state *nlstate, struct nl_cb *cb,
+			   struct crda_batch *batch, unsigned int max_pending)
+{
+	uint64_t start, ns;
+	unsigned int i;
+	int r = 0;
+
+	start = crda_stat_clock();
+	while (batch->pending > max_pending) {
+		r = nl_recvmsgs(nlstate->nl_sock, cb);
+		if (r < 0)
+			break;
+	}
+	ns = crda_stat_time(&crda_stats.ack_ns, start);
+	DTRACE_PROBE2(crda, ack, r, ns);
+
+	if (r >= 0)
+		return 0;
+
+	fprintf(stderr, "Failed to receive regulatory ACKs: %d\n", r);
+	for (i = 0; i < batch->n_reqs; i++)
+		if (batch->reqs[i].pending)
+			crda_batch_complete(batch, batch->reqs[i].seq, r);
+
+	return r;
+}
+
+/*
+ * Sends every request of @batch, from the message @cache if there is one
+ * and else from @ctx, and returns 0 if all of them were acknowledged or
+ * the error of the first one that failed.
+ */
+static int crda_send_batch(struct nl80211_state *nlstate,
+			   const struct reglib_regdb_ctx *ctx,
+			   const struct crda_msg_cache *cache,
+			   struct crda_batch *batch)
+{
+	struct crda_request *req;
+	struct nl_msg *msg;
+	struct nl_cb *cb;
+	uint64_t start, ns;
+	unsigned int i;
+	int r = 0;
+
+	cb = nl_cb_alloc(NL_CB_CUSTOM);
+	if (!cb)
+		return -ENOMEM;
+
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, reg_handler, NULL);
+	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, crda_batch_seq_check,
+		  NULL);
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, crda_batch_ack_handler, batch);
+	nl_cb_err(cb, NL_CB_CUSTOM, crda_batch_error_handler, batch);
+
+	for (i = 0; i < batch->n_reqs; i++) {
+		req = &batch->reqs[i];
+
+		if (batch->pending >= CRDA_BATCH_WINDOW) {
+			r = crda_batch_wait(nlstate, cb, batch,
+					    CRDA_BATCH_WINDOW - 1);
+			if (r)
+				break;
+		}
+
+		start = crda_stat_clock();
+		req->err = crda_batch_build(nlstate, ctx, cache, req, &msg);
+		if (req->err)
+			continue;
+		crda_stat_time(&crda_stats.build_ns, start);
+
+		if (crda_stats_enabled)
+			crda_stats.requests++;
+		start = crda_stat_clock();
+		req->err = nl_send_auto_complete(nlstate->nl_sock, msg);
+		ns = crda_stat_time(&crda_stats.send_ns, start);
+		DTRACE_PROBE2(crda, send, req->err, ns);
+
+		if (req->err >= 0) {
+			req->err = 0;
+			req->seq = nlmsg_hdr(msg)->nlmsg_seq;
+			req->pending = true;
+			batch->pending++;
+		} else
+			fprintf(stderr, "Failed to send regulatory request "
+				"for %s: %d\n", req->alpha2, req->err);
+		nlmsg_free(msg);
+	}
+
+	if (!r)
+		r = crda_batch_wait(nlstate, cb, batch, 0);
+
+	/* Whatever was not sent because receiving failed fails with it */
+	for (; i < batch->n_reqs; i++)
+		batch->reqs[i].err = r;
+
+	nl_cb_put(cb);
+
+	r = 0;
+
+	for (i = 0; i < batch->n_reqs; i++) {
+		req = &batch->reqs[i];
+		if (!req->err)
+			continue;
+		if (req->has_wiphy)
+			fprintf(stderr, "Failed to set regulatory domain %s "
+				"on wiphy %u: %d\n", req->alpha2, req->wiphy,
+				req->err);
+		else
+			fprintf(stderr, "Failed to set regulatory domain %s: "
+				"%d\n", req->alpha2, req->err);
+		if (!r)
+			r = req->err;
+	}
+
+	return r;
+}
+
+/*
+ * Daemon mode
+ *
+ * The kernel asks for a regulatory domain by sending a uevent for the
+ * regulatory platform device with the requested alpha2 in COUNTRY, this
+ * is what the udev rule matches on to run crda. In daemon mode we listen
+ * to those kernel uevents ourselves and answer them from a regdb context
+ * and an nl80211 socket we keep around for the lifetime of the process.
+ *
+ * The daemon holds an exclusive lock on CRDA_PIDFILE. The one-shot crda
+ * run by udev checks for it and leaves the request to the daemon, which
+ * has received the same uevent, so the udev rule can stay in place as a
+ * fallback for when the daemon is not running.
+ *
+ * Any process can send to the uevent multicast group, so only messages
+ * from the kernel itself are taken. As the one-shot crda leaves requests
+ * to us, one lost to an overrun socket would never be answered, so then
+ * the pending request is read back from the regulatory device instead.
+ */
+#define CRDA_PIDFILE		"/var/run/crda.pid"
+#define CRDA_UEVENT_BUFSIZE	4096
+#define CRDA_REGULATORY_UEVENT	"/sys/devices/platform/regulatory.0/uevent"
+
+static volatile sig_atomic_t crda_daemon_exit;
+static volatile sig_atomic_t crda_daemon_stats;
+
+static void crda_daemon_sig_handler(int sig)
+{
+	crda_daemon_exit = 1;
+}
+
+static void crda_daemon_stats_handler(int sig)
+{
+	crda_daemon_stats = 1;
+}
+
+static int crda_daemon_running(void)
+{
+	int fd, r;
+
+	fd = open(CRDA_PIDFILE, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	r = flock(fd, LOCK_SH | LOCK_NB) ? errno : 0;
+	close(fd);
+
+	return r == EWOULDBLOCK;
+}
+
+static int crda_daemon_lock(void)
+{
+	char pid[16];
+	int fd, len;
+
+	fd = open(CRDA_PIDFILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("failed to open " CRDA_PIDFILE);
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		fprintf(stderr, "crda daemon already running\n");
+		close(fd);
+		return -1;
+	}
+
+	len = snprintf(pid, sizeof(pid), "%d\n", getpid());
+	if (ftruncate(fd, 0) || write(fd, pid, len) != len) {
+		perror("failed to write " CRDA_PIDFILE);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int crda_uevent_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd, one = 1;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		perror("failed to open uevent socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;
+	/* kernel uevents, as opposed to the ones rebroadcast by udev */
+	addr.nl_groups = 1;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		perror("failed to bind uevent socket");
+		close(fd);
+		return -1;
+	}
+
+	/* For the credentials of the sender of each uevent */
+	if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one))) {
+		perror("failed to enable uevent credentials");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Receives one uevent into @buf, NUL terminated. Returns its length, 0
+ * for a message that did not come from the kernel, which is dropped, or
+ * a negative errno.
+ */
+static ssize_t crda_uevent_recv(int fd, char *buf, size_t size)
+{
+	char control[CMSG_SPACE(sizeof(struct ucred))];
+	const struct ucred *cred = NULL;
+	struct sockaddr_nl addr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t len;
+
+	iov.iov_base = buf;
+	iov.iov_len = size - 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	len = recvmsg(fd, &msg, MSG_DONTWAIT);
+	if (len < 0)
+		return -errno;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_CREDENTIALS)
+			cred = (const struct ucred *) CMSG_DATA(cmsg);
+
+	if (msg.msg_namelen != sizeof(addr) || addr.nl_pid || !cred ||
+	    cred->uid || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		fprintf(stderr, "Ignoring uevent not sent by the kernel\n");
+		return 0;
+	}
+
+	buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Reads the request the kernel has pending, if any, from the regulatory
+ * device. Its uevent attribute has the same KEY=value pairs as the uevents,
+ * one per line, and only has COUNTRY while a request is not processed.
+ */
+static int crda_uevent_pending(char *alpha2)
+{
+	char buf[CRDA_UEVENT_BUFSIZE];
+	const char *p;
+	ssize_t len;
+	int fd;
+
+	fd = open(CRDA_REGULATORY_UEVENT, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+
+	p = buf;
+	while (strncmp(p, "COUNTRY=", 8)) {
+		p = strchr(p, '\n');
+		if (!p)
+			return -ENOENT;
+		p++;
+	}
+
+	if (!reglib_is_valid_regdom(p + 8)) {
+		fprintf(stderr, "Ignoring invalid pending COUNTRY %.2s\n",
+			p + 8);
+		return -EINVAL;
+	}
+
+	memcpy(alpha2, p + 8, 2);
+	return 0;
+}
+
+/*
+ * Parses a kernel uevent, "ACTION@DEVPATH" followed by NUL separated
+ * KEY=value pairs, and copies out the COUNTRY of regulatory change
+ * events. These are the same events the udev rule matches on.
+ */
+static int crda_uevent_country(const char *buf, size_t len, char *alpha2)
+{
+	const char *p, *end = buf + len;
+	bool regulatory = false, change = false, platform = false;
+	const char *country = NULL;
+
+	for (p = buf; p < end; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			change = !strcmp(p + 7, "change");
+		else if (!strncmp(p, "DEVPATH=", 8))
+			regulatory = strstr(p + 8, "/regulatory") != NULL;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			platform = !strcmp(p + 10, "platform");
+		else if (!strncmp(p, "COUNTRY=", 8))
+			country = p + 8;
+	}
+
+	if (!regulatory || !change || !platform || !country)
+		return -ENOENT;
+
+	if (!reglib_is_valid_regdom(country)) {
+		fprintf(stderr, "Ignoring invalid COUNTRY %s in uevent\n",
+			country);
+		return -EINVAL;
+	}
+
+	memcpy(alpha2, country, 2);
+	return 0;
+}
+
+struct crda_daemon_diff {
+	const char *active;
+	bool changed;
+};
+
+static int crda_daemon_diff(const struct reglib_diff *diff, void *data)
+{
+	struct crda_daemon_diff *daemon_diff = data;
+
+	if (memcmp(diff->alpha2, daemon_diff->active, 2))
+		return 0;
+
+	daemon_diff->changed = true;
+	return 1;
+}
+
+/*
+ * Picks up a new regulatory.bin once the watch has switched to it, the
+ * old context goes away as soon as we let go of it here. The @active
+ * country, the last one the kernel took from us, can not be sent again
+ * from here: cfg80211 only takes a SET_REG that answers a request of its
+ * own and rejects one for the alpha2 it already has, so we only point
+ * out when the new rules apply with the next request of the kernel.
+ */
+static void crda_daemon_reload(struct reglib_regdb_watch *watch,
+			       const char *regdb,
+			       const struct reglib_regdb_ctx **ctx,
+			       struct nl80211_state *nlstate,
+			       bool *precompute, struct crda_msg_cache *cache,
+			       const char *active)
+{
+	struct crda_daemon_diff daemon_diff;
+	const struct reglib_regdb_ctx *new_ctx;
+	struct crda_msg_cache new_cache;
+	int r;
+
+	r = reglib_regdb_watch_process(watch);
+	if (r < 0)
+		fprintf(stderr, "Keeping the regulatory database loaded, "
+			"failed to reload %s: %d\n", regdb, r);
+	if (r <= 0)
+		return;
+
+	new_ctx = reglib_regdb_watch_get(watch);
+
+	memset(&daemon_diff, 0, sizeof(daemon_diff));
+	daemon_diff.active = active;
+	if (active[0] &&
+	    reglib_diff_ctx(*ctx, new_ctx, crda_daemon_diff, &daemon_diff) < 0)
+		daemon_diff.changed = true;
+
+	reglib_free_regdb_ctx(*ctx);
+	*ctx = new_ctx;
+
+	if (*precompute) {
+		crda_free_msg_cache(cache);
+		if (crda_build_msg_cache(nlstate, *ctx, &new_cache)) {
+			fprintf(stderr, "Building the messages of each country "
+				"as requests come in from now on\n");
+			*precompute = false;
+		} else
+			*cache = new_cache;
+	}
+
+	fprintf(stderr, "Reloaded regulatory database %s\n", regdb);
+
+	if (daemon_diff.changed)
+		fprintf(stderr, "Regulatory domain %s changed, the kernel "
+			"keeps the old rules until it requests it again\n",
+			active);
+}
+
+/* The kernel now has the last country of @batch it took */
+static void crda_daemon_track(const struct crda_batch *batch, char *active)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->n_reqs; i++)
+		if (!batch->reqs[i].err)
+			memcpy(active, batch->reqs[i].alpha2, 2);
+}
+
+static int crda_daemon(bool precompute)
+{
+	const struct reglib_regdb_ctx *ctx;
+	struct reglib_regdb_watch *watch;
+	struct crda_msg_cache cache;
+	struct crda_batch batch;
+	struct nl80211_state nlstate;
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	const char *regdb;
+	char buf[CRDA_UEVENT_BUFSIZE];
+	char alpha2[3], active[3];
+	int lock_fd, r = 0;
+	ssize_t len;
+
+	memset(alpha2, 0, 3);
+	memset(active, 0, 3);
+	memset(&cache, 0, sizeof(cache));
+	memset(&batch, 0, sizeof(batch));
+
+	lock_fd = crda_daemon_lock();
+	if (lock_fd < 0)
+		return -EBUSY;
+
+	ctx = crda_open_regdb(&regdb);
+	if (!ctx) {
+		r = -EINVAL;
+		goto out_unlock;
+	}
+
+	/* The daemon keeps running on the db it has if it can not watch it */
+	watch = NULL;
+	if (regdb) {
+		watch = reglib_malloc_regdb_watch(regdb,
+						  reglib_get_regdb_ctx(ctx));
+		if (!watch) {
+			fprintf(stderr, "Not watching %s for updates\n",
+				regdb);
+			reglib_free_regdb_ctx(ctx);
+		}
+	}
+
+	if (nl80211_init(&nlstate)) {
+		r = -EIO;
+		goto out_free_ctx;
+	}
+
+	if (precompute) {
+		r = crda_build_msg_cache(&nlstate, ctx, &cache);
+		if (r)
+			goto out_nl80211;
+	}
+
+	pfd[0].fd = crda_uevent_open();
+	if (pfd[0].fd < 0) {
+		r = -EIO;
+		goto out_free_cache;
+	}
+	pfd[0].events = POLLIN;
+	/* poll() skips negative descriptors */
+	pfd[1].fd = watch ? reglib_regdb_watch_fd(watch) : -1;
+	pfd[1].events = POLLIN;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = crda_daemon_sig_handler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	if (crda_stats_enabled) {
+		sa.sa_handler = crda_daemon_stats_handler;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	while (!crda_daemon_exit) {
+		if (crda_daemon_stats) {
+			crda_daemon_stats = 0;
+			crda_print_stats();
+		}
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			r = -errno;
+			break;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			crda_daemon_reload(watch, regdb, &ctx, &nlstate,
+					   &precompute, &cache, active);
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		/* Answer everything that queued up while we were busy at once */
+		batch.n_reqs = 0;
+		for (;;) {
+			len = crda_uevent_recv(pfd[0].fd, buf, sizeof(buf));
+			if (len == -EAGAIN || len == -EWOULDBLOCK)
+				break;
+			if (len == -ENOBUFS) {
+				fprintf(stderr, "Lost uevents, reading the "
+					"pending request instead\n");
+				if (crda_uevent_pending(alpha2))
+					continue;
+			} else if (len < 0) {
+				fprintf(stderr, "Failed to receive uevent: "
+					"%s\n", strerror(-len));
+				break;
+			} else if (!len || crda_uevent_country(buf, len, alpha2))
+				continue;
+			if (crda_batch_add(&batch, alpha2, false, 0))
+				fprintf(stderr, "Dropping request for %s\n",
+					alpha2);
+		}
+
+		if (!batch.n_reqs)
+			continue;
+
+		crda_send_batch(&nlstate, ctx, precompute ? &cache : NULL,
+				&batch);
+		crda_daemon_track(&batch, active);
+	}
+
+	close(pfd[0].fd);
+	crda_free_batch(&batch);
+out_free_cache:
+	crda_free_msg_cache(&cache);
+out_nl80211:
+	nl80211_cleanup(&nlstate);
+out_free_ctx:
+	reglib_free_regdb_watch(watch);
+	reglib_free_regdb_ctx(ctx);
+out_unlock:
+	unlink(CRDA_PIDFILE);
+	close(lock_fd);
+	return r;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s|--stats] [-d|--daemon [-p|--precompute]]\n"
+		"       %s [-s|--stats] -b|--batch [<alpha2>[@<wiphy>] ...]\n",
+		prog, prog);
+}
+
+/*
+ * Sends the requests given on the command line, or read from stdin one
+ * per whitespace separated word if there are none, as one batch.
+ */
+static int crda_batch_main(char **args, int n_args)
+{
+	const struct reglib_regdb_ctx *ctx;
+	struct nl80211_state nlstate;
+	struct crda_batch batch;
+	char word[32];
+	int i, r = 0;
+
+	memset(&batch, 0, sizeof(batch));
+
+	for (i = 0; i < n_args && !r; i++)
+		r = crda_batch_add_arg(&batch, args[i]);
+
+	if (!n_args)
+		while (!r && scanf("%31s", word) == 1)
+			r = crda_batch_add_arg(&batch, word);
+
+	if (r || !batch.n_reqs)
+		goto out;
+
+	ctx = crda_open_regdb(NULL);
+	if (!ctx) {
+		r = -ENOENT;
+		goto out;
+	}
+
+	if (nl80211_init(&nlstate)) {
+		reglib_free_regdb_ctx(ctx);
+		r = -EIO;
+		goto out;
+	}
+
+	r = crda_send_batch(&nlstate, ctx, NULL, &batch);
+
+	nl80211_cleanup(&nlstate);
+	reglib_free_regdb_ctx(ctx);
 out:
+	crda_free_batch(&batch);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	int r;
+	char alpha2[3];
+	char *env_country;
+	struct nl80211_state nlstate;
+	const struct ieee80211_regdomain *rd = NULL;
+	const struct reglib_regdb_ctx *ctx;
+	bool run_daemon = false, precompute = false, batch = false;
+	static const struct option long_options[] = {
+		{ "batch",	no_argument,	NULL,	'b' },
+		{ "daemon",	no_argument,	NULL,	'd' },
+		{ "precompute",	no_argument,	NULL,	'p' },
+		{ "stats",	no_argument,	NULL,	's' },
+		{ NULL,		0,		NULL,	0 },
+	};
+
+	memset(alpha2, 0, 3);
+
+	while ((r = getopt_long(argc, argv, "bdps", long_options, NULL)) != -1) {
+		switch (r) {
+		case 'b':
+			batch = true;
+			break;
+		case 'd':
+			run_daemon = true;
+			break;
+		case 'p':
+			precompute = true;
+			break;
+		case 's':
+			crda_stats_enabled = true;
+			reglib_enable_stats(true);
+			break;
+		default:
+			usage(argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	if ((optind != argc && !batch) || (precompute && !run_daemon) ||
+	    (batch && run_daemon)) {
+		usage(argv[0]);
+		return -EINVAL;
+	}
+
+	if (batch) {
+		r = crda_batch_main(argv + optind, argc - optind);
+		crda_print_stats();
+		return r;
+	}
+
+	if (run_daemon) {
+		r = crda_daemon(precompute);
+		crda_print_stats();
+		return r;
+	}
+
+	env_country = getenv("COUNTRY");
+	if (!env_country) {
+		fprintf(stderr, "COUNTRY environment variable not set.\n");
+		return -EINVAL;
+	}
+
+	if (!reglib_is_valid_regdom(env_country)) {
+		fprintf(stderr, "COUNTRY environment variable must be an "
+			"ISO ISO 3166-1-alpha-2 (uppercase) or 00\n");
+		return -EINVAL;
+	}
+
+	memcpy(alpha2, env_country, 2);
+
+	/* The daemon got the same uevent and will take care of it */
+	if (crda_daemon_running())
+		return 0;
+
+	ctx = crda_open_regdb(NULL);
+	if (!ctx)
+		return -ENOENT;
+
+	rd = reglib_get_rd_alpha2_ctx(ctx, alpha2);
+	reglib_free_regdb_ctx(ctx);
+	if (!rd) {
+		fprintf(stderr, "No country match in regulatory database.\n");
+		return -1;
+	}
+
+	r = nl80211_init(&nlstate);
+	if (r) {
+		free((struct ieee80211_regdomain *) rd);
+		return -EIO;
+	}
+
+	r = crda_set_regdom(&nlstate, alpha2, rd);
+
 	nl80211_cleanup(&nlstate);
 	free((struct ieee80211_regdomain *) rd);
 
+	crda_print_stats();
+
 	return r;
 }
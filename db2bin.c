@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef DB2BIN_SIGN
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#endif
+
+#include "reglib.h"
+
+static int add_country(struct ieee80211_regdomain *rd, void *data)
+{
+	struct reglib_regdb_writer *writer = data;
+	int r;
+
+	r = reglib_regdb_writer_add(writer, rd);
+	if (r == -EEXIST)
+		fprintf(stderr, "Duplicate country %c%c\n",
+			rd->alpha2[0], rd->alpha2[1]);
+	return r;
+}
+
+#ifdef DB2BIN_SIGN
+static EVP_PKEY *load_key(const char *key_file)
+{
+	EVP_PKEY *key;
+	FILE *fp;
+
+	fp = fopen(key_file, "r");
+	if (!fp) {
+		fprintf(stderr, "Unable to open %s: %s\n", key_file,
+			strerror(errno));
+		return NULL;
+	}
+
+	key = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (!key)
+		fprintf(stderr, "Unable to read private key %s\n", key_file);
+
+	return key;
+}
+
+/* RSA PKCS #1 v1.5 signature of the SHA-1 of the db, what reglib checks */
+static int sign_db(EVP_PKEY *key, uint8_t *db, size_t dblen, size_t siglen)
+{
+	EVP_MD_CTX *ctx;
+	size_t len = siglen;
+	int r = -EINVAL;
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx)
+		return -ENOMEM;
+
+	if (EVP_DigestSignInit(ctx, NULL, EVP_sha1(), NULL, key) == 1 &&
+	    EVP_DigestSignUpdate(ctx, db, dblen) == 1 &&
+	    EVP_DigestSignFinal(ctx, db + dblen, &len) == 1 &&
+	    len == siglen)
+		r = 0;
+
+	EVP_MD_CTX_free(ctx);
+	return r;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	struct reglib_regdb_writer *writer;
+	uint32_t siglen = 0;
+	uint8_t *db = NULL;
+	size_t len;
+	FILE *in, *out;
+	int r = -EINVAL;
+#ifdef DB2BIN_SIGN
+	EVP_PKEY *key = NULL;
+#endif
+
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "Usage: %s <output> <db.txt> [<private-key.pem>]\n",
+			argv[0]);
+		return -EINVAL;
+	}
+
+	if (argc == 4) {
+#ifdef DB2BIN_SIGN
+		key = load_key(argv[3]);
+		if (!key)
+			return -EINVAL;
+		siglen = EVP_PKEY_size(key);
+#else
+		fprintf(stderr, "%s was built without signing support\n",
+			argv[0]);
+		return -EOPNOTSUPP;
+#endif
+	}
+
+	writer = reglib_malloc_regdb_writer();
+	if (!writer) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	in = fopen(argv[2], "r");
+	if (!in) {
+		fprintf(stderr, "Unable to open %s: %s\n", argv[2],
+			strerror(errno));
+		goto out;
+	}
+
+	r = reglib_parse_stream(in, add_country, writer);
+	fclose(in);
+	if (r)
+		goto out;
+
+	db = reglib_regdb_writer_build(writer, siglen, &len);
+	if (!db) {
+		fprintf(stderr, "Unable to build the regulatory database\n");
+		r = -ENOMEM;
+		goto out;
+	}
+
+#ifdef DB2BIN_SIGN
+	if (key) {
+		r = sign_db(key, db, len - siglen, siglen);
+		if (r) {
+			fprintf(stderr, "Unable to sign the regulatory database\n");
+			goto out;
+		}
+	}
+#endif
+
+	out = fopen(argv[1], "wb");
+	if (!out) {
+		fprintf(stderr, "Unable to open %s: %s\n", argv[1],
+			strerror(errno));
+		r = -errno;
+		goto out;
+	}
+
+	if (fwrite(db, len, 1, out) != 1 || fclose(out)) {
+		fprintf(stderr, "Unable to write %s\n", argv[1]);
+		r = -EIO;
+		goto out;
+	}
+
+	r = 0;
+out:
+	free(db);
+	reglib_free_regdb_writer(writer);
+#ifdef DB2BIN_SIGN
+	EVP_PKEY_free(key);
+#endif
+	return r;
+}
@@ -3,30 +3,88 @@
 #include <stdio.h>
 #include <arpa/inet.h> /* ntohl */
 #include <string.h>
+#include <unistd.h>
 
 #include "nl80211.h"
 #include "reglib.h"
 
+/* Full dumps go out in large writes rather than one per line or country */
+static char out_buf[1 << 16];
+
+static int print_country(struct ieee80211_regdomain *rd, void *data)
+{
+	reglib_print_regdom(rd);
+	return 0;
+}
+
+static int print_country_pool(void *item, FILE *out, void *data)
+{
+	struct ieee80211_regdomain *rd = item;
+
+	reglib_fprint_regdom(out, rd);
+	free(rd);
+
+	return 0;
+}
+
+static int submit_country(struct ieee80211_regdomain *rd, void *data)
+{
+	struct reglib_ordered_pool *pool = data;
+	struct ieee80211_regdomain *copy;
+
+	copy = reglib_dup_regdom(rd);
+	if (!copy)
+		return -ENOMEM;
+
+	return reglib_ordered_pool_submit(pool, copy);
+}
+
 int main(int argc, char **argv)
 {
-	struct ieee80211_regdomain *rd = NULL;
-	FILE *fp;
+	struct reglib_ordered_pool *pool;
+	unsigned int nthreads = 0;
+	bool parallel = false;
+	int opt, r, r_pool;
 
-	if (argc != 1) {
-		fprintf(stderr, "Usage: cat db.txt | %s\n", argv[0]);
-		return -EINVAL;
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			if (reglib_parse_nthreads(optarg, &nthreads))
+				goto usage;
+			parallel = true;
+			break;
+		default:
+			goto usage;
+		}
 	}
 
-	fp = reglib_create_parse_stream(stdin);
-	if (!fp)
-		return -EINVAL;
+	if (optind != argc)
+		goto usage;
 
-	reglib_for_each_country_stream(fp, rd) {
-		reglib_print_regdom(rd);
-		free(rd);
-	}
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
 
-	fclose(fp);
+	if (!parallel) {
+		r = reglib_parse_stream(stdin, print_country, NULL);
+	} else {
+		pool = reglib_malloc_ordered_pool(nthreads, stdout,
+						  print_country_pool, NULL);
+		if (!pool) {
+			fprintf(stderr, "Unable to start workers\n");
+			return -ENOMEM;
+		}
+		r = reglib_parse_stream(stdin, submit_country, pool);
+		r_pool = reglib_free_ordered_pool(pool);
+		if (!r)
+			r = r_pool;
+	}
+	if (r < 0) {
+		fprintf(stderr, "Parsing failed: %s\n", strerror(-r));
+		return r;
+	}
 
 	return 0;
+
+usage:
+	fprintf(stderr, "Usage: cat db.txt | %s [-j <threads>]\n", argv[0]);
+	return -EINVAL;
 }
@@ -3,30 +3,178 @@
 #include <stdio.h>
 #include <arpa/inet.h> /* ntohl */
 #include <string.h>
+#include <unistd.h>
 
 #include "reglib.h"
 
+/* Splits a comma separated list of alpha2s in place */
+static int parse_alpha2_list(char *list, const char ***codes)
+{
+	const char **c;
+	char *tok, *save;
+	int n = 1;
+
+	for (tok = list; *tok; tok++)
+		if (*tok == ',')
+			n++;
+
+	c = calloc(n, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	n = 0;
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (strlen(tok) != 2) {
+			fprintf(stderr, "Invalid alpha2: %s\n", tok);
+			free(c);
+			return -EINVAL;
+		}
+		c[n++] = tok;
+	}
+
+	if (!n) {
+		free(c);
+		return -EINVAL;
+	}
+
+	*codes = c;
+	return n;
+}
+
+static const struct {
+	const char *name;
+	struct reglib_band band;
+} matrix_bands[] = {
+	{ "2ghz", { 2400000, 2500000 } },
+	{ "5ghz", { 5150000, 5895000 } },
+	{ "6ghz", { 5925000, 7125000 } },
+	{ "60ghz", { 57000000, 71000000 } },
+};
+
+#define N_MATRIX_BANDS (sizeof(matrix_bands) / sizeof(matrix_bands[0]))
+
+static char out_buf[64 * 1024];
+
+/*
+ * Prints what each pair of countries has in common as CSV, one line per
+ * pair with the spectrum in KHz and the max EIRP in mBm for each band.
+ */
+static int print_matrix(const struct reglib_regdb_ctx *ctx,
+			unsigned int nthreads)
+{
+	struct reglib_band bands[N_MATRIX_BANDS];
+	struct reglib_matrix_cell *cells, *cell;
+	unsigned int n = ctx->num_countries, i, j, b;
+	int r;
+
+	cells = calloc((size_t) n * n * N_MATRIX_BANDS, sizeof(*cells));
+	if (!cells && n)
+		return -ENOMEM;
+
+	for (b = 0; b < N_MATRIX_BANDS; b++)
+		bands[b] = matrix_bands[b].band;
+
+	r = reglib_intersect_matrix(ctx, bands, N_MATRIX_BANDS, cells,
+				    nthreads);
+	if (r) {
+		free(cells);
+		return r;
+	}
+
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+	printf("alpha2_1,alpha2_2");
+	for (b = 0; b < N_MATRIX_BANDS; b++)
+		printf(",%s_khz,%s_eirp_mbm", matrix_bands[b].name,
+		       matrix_bands[b].name);
+	printf("\n");
+
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			printf("%.2s,%.2s", ctx->countries[i].alpha2,
+			       ctx->countries[j].alpha2);
+			cell = cells + ((size_t) i * n + j) * N_MATRIX_BANDS;
+			for (b = 0; b < N_MATRIX_BANDS; b++)
+				printf(",%u,%u", cell[b].spectrum_khz,
+				       cell[b].max_eirp);
+			printf("\n");
+		}
+	}
+
+	free(cells);
+
+	if (fflush(stdout))
+		return -EIO;
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	const struct reglib_regdb_ctx *ctx;
 	const struct ieee80211_regdomain *rd;
+	const char **codes = NULL;
+	bool parallel = false, matrix = false;
+	unsigned int nthreads = 0;
+	int n_codes = 0;
+	int opt, r;
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <regulatory-binary-file>\n", argv[0]);
-		return -EINVAL;
+	while ((opt = getopt(argc, argv, "c:j:m")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (codes)
+				goto usage;
+			n_codes = parse_alpha2_list(optarg, &codes);
+			if (n_codes < 0)
+				goto usage;
+			break;
+		case 'j':
+			if (reglib_parse_nthreads(optarg, &nthreads))
+				goto usage;
+			parallel = true;
+			break;
+		case 'm':
+			matrix = true;
+			break;
+		default:
+			goto usage;
+		}
 	}
 
-	ctx = reglib_malloc_regdb_ctx(argv[1]);
+	if (optind != argc - 1 || (codes && (parallel || matrix)))
+		goto usage;
+
+	ctx = reglib_malloc_regdb_ctx(argv[optind]);
 	if (!ctx) {
 		fprintf(stderr, "Invalid or empty regulatory file, note: "
 			"a binary regulatory file should be used.\n");
+		free(codes);
 		return -EINVAL;
 	}
 
-	rd = reglib_intersect_regdb(ctx);
+	if (matrix) {
+		r = print_matrix(ctx, nthreads);
+		if (r)
+			fprintf(stderr, "Could not compute the matrix: %s\n",
+				strerror(-r));
+		reglib_free_regdb_ctx(ctx);
+		return r;
+	}
+
+	/* Every country gets decoded, do it off the compiled form */
+	if (!codes)
+		reglib_regdb_compile(ctx);
+
+	if (codes)
+		rd = reglib_intersect_alpha2_set(ctx, codes, n_codes);
+	else if (parallel)
+		rd = reglib_intersect_regdb_parallel(ctx, nthreads);
+	else
+		rd = reglib_intersect_regdb(ctx);
 	if (!rd) {
 		fprintf(stderr, "Intersection not possible\n");
 		reglib_free_regdb_ctx(ctx);
+		free(codes);
 		return -ENOENT;
 	}
 
@@ -35,5 +183,12 @@ int main(int argc, char **argv)
 	free((struct ieee80211_regdomain *) rd);
 
 	reglib_free_regdb_ctx(ctx);
+	free(codes);
 	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-m] [-j <threads> | -c <alpha2>[,<alpha2>...]] "
+		"<regulatory-binary-file>\n", argv[0]);
+	free(codes);
+	return -EINVAL;
 }
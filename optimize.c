@@ -3,38 +3,126 @@
 #include <stdio.h>
 #include <arpa/inet.h> /* ntohl */
 #include <string.h>
+#include <unistd.h>
 
 #include "nl80211.h"
 #include "reglib.h"
 
+struct optimize_state {
+	bool validate;
+	unsigned int mismatches;
+	struct reglib_ordered_pool *pool;
+};
+
+static int optimize_country_fp(struct ieee80211_regdomain *rd, FILE *out,
+			       struct optimize_state *state)
+{
+	struct ieee80211_regdomain *rd_opt;
+
+	if (state->validate && reglib_optimize_regdom_validate(rd)) {
+		fprintf(stderr, "Optimizers differ on %c%c\n",
+			rd->alpha2[0],
+			rd->alpha2[1]);
+		__atomic_add_fetch(&state->mismatches, 1, __ATOMIC_RELAXED);
+	}
+
+	rd_opt = reglib_optimize_regdom(rd);
+	if (!rd_opt) {
+		fprintf(stderr, "Unable to optimize %c%c\n",
+			rd->alpha2[0],
+			rd->alpha2[1]);
+		return 0;
+	}
+	reglib_fprint_regdom(out, rd_opt);
+	free(rd_opt);
+
+	return 0;
+}
+
+static int optimize_country(struct ieee80211_regdomain *rd, void *data)
+{
+	return optimize_country_fp(rd, stdout, data);
+}
+
+static int optimize_country_pool(void *item, FILE *out, void *data)
+{
+	struct ieee80211_regdomain *rd = item;
+	int r;
+
+	r = optimize_country_fp(rd, out, data);
+	free(rd);
+
+	return r;
+}
+
+static int submit_country(struct ieee80211_regdomain *rd, void *data)
+{
+	struct optimize_state *state = data;
+	struct ieee80211_regdomain *copy;
+
+	copy = reglib_dup_regdom(rd);
+	if (!copy)
+		return -ENOMEM;
+
+	return reglib_ordered_pool_submit(state->pool, copy);
+}
+
 int main(int argc, char **argv)
 {
-	struct ieee80211_regdomain *rd = NULL, *rd_opt = NULL;
-	FILE *fp;
+	struct optimize_state state;
+	unsigned int nthreads = 0;
+	bool parallel = false;
+	int opt, r, r_pool;
 
-	if (argc != 1) {
-		fprintf(stderr, "Usage: cat db.txt | %s\n", argv[0]);
-		return -EINVAL;
+	memset(&state, 0, sizeof(state));
+
+	while ((opt = getopt(argc, argv, "Vj:")) != -1) {
+		switch (opt) {
+		case 'V':
+			state.validate = true;
+			break;
+		case 'j':
+			if (reglib_parse_nthreads(optarg, &nthreads))
+				goto usage;
+			parallel = true;
+			break;
+		default:
+			goto usage;
+		}
 	}
 
-	fp = reglib_create_parse_stream(stdin);
-	if (!fp)
-		return -EINVAL;
-
-	reglib_for_each_country_stream(fp, rd) {
-		rd_opt = reglib_optimize_regdom(rd);
-		if (!rd_opt){
-			fprintf(stderr, "Unable to optimize %c%c\n",
-				rd->alpha2[0],
-				rd->alpha2[1]);
-			free(rd);
-			continue;
+	if (optind != argc)
+		goto usage;
+
+	if (!parallel) {
+		r = reglib_parse_stream(stdin, optimize_country, &state);
+	} else {
+		state.pool = reglib_malloc_ordered_pool(nthreads, stdout,
+							optimize_country_pool,
+							&state);
+		if (!state.pool) {
+			fprintf(stderr, "Unable to start workers\n");
+			return -ENOMEM;
 		}
-		reglib_print_regdom(rd_opt);
-		free(rd);
-		free(rd_opt);
+		r = reglib_parse_stream(stdin, submit_country, &state);
+		r_pool = reglib_free_ordered_pool(state.pool);
+		if (!r)
+			r = r_pool;
+	}
+	if (r < 0) {
+		fprintf(stderr, "Parsing failed: %s\n", strerror(-r));
+		return r;
+	}
+
+	if (state.mismatches) {
+		fprintf(stderr, "%u countries differ from the pairwise optimizer\n",
+			state.mismatches);
+		return 1;
 	}
 
-	fclose(fp);
 	return 0;
+
+usage:
+	fprintf(stderr, "Usage: cat db.txt | %s [-V] [-j <threads>]\n", argv[0]);
+	return -EINVAL;
 }
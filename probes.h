@@ -0,0 +1,17 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes of crda and reglib, where the Makefile found <sys/sdt.h>
+ * and set CONFIG_SDT. Without it a probe only evaluates its arguments.
+ */
+#ifdef CONFIG_SDT
+#include <sys/sdt.h>
+#else
+#define DTRACE_PROBE2(provider, name, arg1, arg2)			\
+	do { (void) (arg1); (void) (arg2); } while (0)
+#define DTRACE_PROBE3(provider, name, arg1, arg2, arg3)			\
+	do { (void) (arg1); (void) (arg2); (void) (arg3); } while (0)
+#endif
+
+#endif
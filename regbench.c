@@ -0,0 +1,383 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "reglib.h"
+
+/*
+ * Microbenchmarks of reglib. Each benchmark is run over and over for at
+ * least the given time and the time it took is reported per item it
+ * went through, a country, a pair of countries or a whole db, so that
+ * numbers can be compared across databases of different sizes.
+ */
+
+struct bench_state {
+	const char *regdb_file;
+	/* A signed db ctx_verify can verify, the regdb if there is none */
+	const char *verify_file;
+	const struct reglib_regdb_ctx *ctx;
+	const struct ieee80211_regdomain **rds;
+	unsigned int n_rds;
+	char *dbtxt;
+	size_t dbtxt_len;
+};
+
+struct bench {
+	const char *name;
+	/* Returns the number of items gone through or a negative error */
+	long (*run)(struct bench_state *state);
+};
+
+static long bench_ctx_verify(struct bench_state *state)
+{
+	const struct reglib_regdb_ctx *ctx;
+
+	ctx = reglib_malloc_regdb_ctx(state->verify_file);
+	if (!ctx)
+		return -EKEYREJECTED;
+	reglib_free_regdb_ctx(ctx);
+
+	return 1;
+}
+
+static long bench_ctx_noverify(struct bench_state *state)
+{
+	const struct reglib_regdb_ctx *ctx;
+
+	ctx = reglib_malloc_regdb_ctx_flags(state->regdb_file,
+					    REGLIB_CTX_NO_VERIFY);
+	if (!ctx)
+		return -EINVAL;
+	reglib_free_regdb_ctx(ctx);
+
+	return 1;
+}
+
+static int count_country(struct ieee80211_regdomain *rd, void *data)
+{
+	long *n = data;
+
+	(*n)++;
+	return 0;
+}
+
+static long bench_parse_buffer(struct bench_state *state)
+{
+	long n = 0;
+	int r;
+
+	r = reglib_parse_buffer(state->dbtxt, state->dbtxt_len,
+				count_country, &n);
+	if (r < 0)
+		return r;
+
+	return n;
+}
+
+static long bench_parse_country(struct bench_state *state)
+{
+	struct ieee80211_regdomain *rd;
+	long n = 0;
+	FILE *fp;
+
+	fp = fmemopen(state->dbtxt, state->dbtxt_len, "r");
+	if (!fp)
+		return -errno;
+
+	reglib_for_each_country_stream(fp, rd) {
+		free(rd);
+		n++;
+	}
+	fclose(fp);
+
+	return n;
+}
+
+static long bench_get_rd_alpha2(struct bench_state *state)
+{
+	const struct ieee80211_regdomain *rd;
+	unsigned int i;
+
+	for (i = 0; i < state->n_rds; i++) {
+		rd = reglib_get_rd_alpha2_ctx(state->ctx,
+					      state->rds[i]->alpha2);
+		if (!rd)
+			return -ENOENT;
+		free((struct ieee80211_regdomain *) rd);
+	}
+
+	return state->n_rds;
+}
+
+static long bench_get_rd_idx(struct bench_state *state)
+{
+	const struct ieee80211_regdomain *rd;
+	unsigned int i;
+
+	for (i = 0; i < state->ctx->num_countries; i++) {
+		rd = reglib_get_rd_idx(i, state->ctx);
+		if (!rd)
+			return -ENOMEM;
+		free((struct ieee80211_regdomain *) rd);
+	}
+
+	return state->ctx->num_countries;
+}
+
+/* What country2rd() was, decoding a country off its file structures */
+static long bench_country2rd(struct bench_state *state)
+{
+	struct ieee80211_regdomain *rd;
+	struct reglib_rd_view view;
+	unsigned int i;
+
+	for (i = 0; i < state->ctx->num_countries; i++) {
+		if (reglib_get_rd_view_idx(i, state->ctx, &view))
+			return -EINVAL;
+		rd = reglib_rd_view2rd(&view);
+		if (!rd)
+			return -ENOMEM;
+		free(rd);
+	}
+
+	return state->ctx->num_countries;
+}
+
+static long bench_intersect_rds(struct bench_state *state)
+{
+	struct ieee80211_regdomain *rd;
+	unsigned int i;
+
+	if (state->n_rds < 2)
+		return -ENOENT;
+
+	for (i = 1; i < state->n_rds; i++) {
+		rd = reglib_intersect_rds(state->rds[i - 1], state->rds[i]);
+		free(rd);
+	}
+
+	return state->n_rds - 1;
+}
+
+static long bench_intersect_regdb(struct bench_state *state)
+{
+	const struct ieee80211_regdomain *rd;
+
+	rd = reglib_intersect_regdb(state->ctx);
+	free((struct ieee80211_regdomain *) rd);
+
+	return 1;
+}
+
+static long bench_optimize_regdom(struct bench_state *state)
+{
+	struct ieee80211_regdomain *rd;
+	unsigned int i;
+
+	for (i = 0; i < state->n_rds; i++) {
+		rd = reglib_optimize_regdom((struct ieee80211_regdomain *)
+					    state->rds[i]);
+		if (!rd)
+			return -ENOMEM;
+		free(rd);
+	}
+
+	return state->n_rds;
+}
+
+/* The compiled form is built once per context, so get a new one each time */
+static long bench_ctx_compile(struct bench_state *state)
+{
+	const struct reglib_regdb_ctx *ctx;
+	long r = 1;
+
+	ctx = reglib_malloc_regdb_ctx_flags(state->regdb_file,
+					    REGLIB_CTX_NO_VERIFY);
+	if (!ctx)
+		return -EINVAL;
+	if (!reglib_regdb_compile(ctx))
+		r = -ENOMEM;
+	reglib_free_regdb_ctx(ctx);
+
+	return r;
+}
+
+static long bench_get_rd_idx_compiled(struct bench_state *state)
+{
+	if (!reglib_regdb_compile(state->ctx))
+		return -ENOMEM;
+
+	return bench_get_rd_idx(state);
+}
+
+static long bench_intersect_regdb_compiled(struct bench_state *state)
+{
+	if (!reglib_regdb_compile(state->ctx))
+		return -ENOMEM;
+
+	return bench_intersect_regdb(state);
+}
+
+/* The context of the state is compiled from the first _compiled one on */
+static const struct bench benches[] = {
+	{ "ctx_verify", bench_ctx_verify },
+	{ "ctx_noverify", bench_ctx_noverify },
+	{ "ctx_compile", bench_ctx_compile },
+	{ "parse_buffer", bench_parse_buffer },
+	{ "parse_country", bench_parse_country },
+	{ "get_rd_alpha2", bench_get_rd_alpha2 },
+	{ "get_rd_idx", bench_get_rd_idx },
+	{ "country2rd", bench_country2rd },
+	{ "intersect_rds", bench_intersect_rds },
+	{ "intersect_regdb", bench_intersect_regdb },
+	{ "optimize_regdom", bench_optimize_regdom },
+	{ "get_rd_idx_compiled", bench_get_rd_idx_compiled },
+	{ "intersect_regdb_compiled", bench_intersect_regdb_compiled },
+};
+
+#define N_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_bench(const struct bench *bench, struct bench_state *state,
+		      uint64_t min_ns)
+{
+	uint64_t start, elapsed;
+	unsigned long items = 0;
+	long r;
+
+	start = now_ns();
+	do {
+		r = bench->run(state);
+		if (r < 0) {
+			printf("%-26s skipped: %s\n", bench->name,
+			       strerror(-r));
+			return;
+		}
+		items += r;
+		elapsed = now_ns() - start;
+	} while (elapsed < min_ns);
+
+	printf("%-26s %12lu %14.1f\n", bench->name, items,
+	       items ? (double) elapsed / items : 0.0);
+}
+
+static char *read_file(const char *file, size_t *len)
+{
+	char *buf;
+	long size;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return NULL;
+
+	if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET)) {
+		fclose(fp);
+		return NULL;
+	}
+
+	buf = malloc(size ? size : 1);
+	if (buf && fread(buf, 1, size, fp) != (size_t) size) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(fp);
+
+	*len = size;
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_state state;
+	unsigned long min_ms = 200;
+	unsigned int i;
+	char *end;
+	int opt, r = 0;
+
+	memset(&state, 0, sizeof(state));
+
+	while ((opt = getopt(argc, argv, "t:v:")) != -1) {
+		switch (opt) {
+		case 't':
+			min_ms = strtoul(optarg, &end, 10);
+			if (*end || !*optarg)
+				goto usage;
+			break;
+		case 'v':
+			state.verify_file = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind != argc - 2)
+		goto usage;
+
+	state.regdb_file = argv[optind];
+	if (!state.verify_file)
+		state.verify_file = state.regdb_file;
+
+	/* Whether the db is trusted is up to ctx_verify, not the others */
+	state.ctx = reglib_malloc_regdb_ctx_flags(state.regdb_file,
+						  REGLIB_CTX_NO_VERIFY);
+	if (!state.ctx) {
+		fprintf(stderr, "Invalid regulatory file %s\n",
+			state.regdb_file);
+		return -EINVAL;
+	}
+
+	state.dbtxt = read_file(argv[optind + 1], &state.dbtxt_len);
+	if (!state.dbtxt) {
+		fprintf(stderr, "Unable to read %s\n", argv[optind + 1]);
+		r = -EIO;
+		goto out;
+	}
+
+	state.rds = calloc(state.ctx->num_countries, sizeof(*state.rds));
+	if (!state.rds && state.ctx->num_countries) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < state.ctx->num_countries; i++) {
+		state.rds[i] = reglib_get_rd_idx(i, state.ctx);
+		if (!state.rds[i]) {
+			r = -ENOMEM;
+			goto out;
+		}
+		state.n_rds++;
+	}
+
+	printf("# %u countries, %lu ms per benchmark\n", state.n_rds, min_ms);
+	printf("%-26s %12s %14s\n", "# benchmark", "items", "ns/item");
+
+	for (i = 0; i < N_BENCHES; i++)
+		run_bench(&benches[i], &state, (uint64_t) min_ms * 1000000);
+
+out:
+	for (i = 0; i < state.n_rds; i++)
+		free((struct ieee80211_regdomain *) state.rds[i]);
+	free(state.rds);
+	free(state.dbtxt);
+	reglib_free_regdb_ctx(state.ctx);
+	return r;
+
+usage:
+	fprintf(stderr, "Usage: %s [-t <min-ms>] [-v <signed-regulatory-file>] "
+		"<regulatory-binary-file> <db.txt>\n", argv[0]);
+	return -EINVAL;
+}
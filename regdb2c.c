@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "reglib.h"
+
+/*
+ * Writes out a verified regulatory.bin as C for libreg to be built
+ * with, see reglib_malloc_regdb_ctx_builtin(). All tables are const so
+ * they end up in .rodata, the rules already in the compiled form lookups
+ * decode countries from.
+ */
+
+static void print_u8s(const char *name, const uint8_t *vals, uint32_t n,
+		      const char *attr)
+{
+	uint32_t i;
+
+	printf("static const uint8_t %s[]%s = {", name, attr);
+	for (i = 0; i < n; i++)
+		printf("%s0x%02x,", i % 12 ? " " : "\n\t", vals[i]);
+	/* Arrays can not be empty, the count says how much of it is used */
+	if (!n)
+		printf("\n\t0,");
+	printf("\n};\n\n");
+}
+
+static void print_u32s(const char *name, const uint32_t *vals, uint32_t n)
+{
+	uint32_t i;
+
+	printf("static const uint32_t %s[] = {", name);
+	for (i = 0; i < n; i++)
+		printf("%s%u,", i % 8 ? " " : "\n\t", vals[i]);
+	if (!n)
+		printf("\n\t0,");
+	printf("\n};\n\n");
+}
+
+static void print_alpha2s(const char (*alpha2)[2], uint32_t n)
+{
+	uint32_t i;
+
+	printf("static const char regdb_alpha2[][2] = {");
+	for (i = 0; i < n; i++)
+		printf("%s{ '%c', '%c' },", i % 6 ? " " : "\n\t",
+		       alpha2[i][0], alpha2[i][1]);
+	if (!n)
+		printf("\n\t{ 0, 0 },");
+	printf("\n};\n\n");
+}
+
+static void print_regdb(const char *file, const struct reglib_regdb_ctx *ctx,
+			const struct reglib_regdb_compiled *compiled)
+{
+	const uint8_t *digest = reglib_regdb_digest(ctx);
+	unsigned int i;
+
+	printf("/* Generated by regdb2c from %s, do not edit */\n\n", file);
+	printf("#include <stdint.h>\n\n#include \"reglib.h\"\n\n");
+
+	/* The file headers are read in place, so keep it aligned for them */
+	print_u8s("regdb_db", ctx->db, ctx->real_dblen,
+		  " __attribute__((aligned(4)))");
+
+	print_u32s("regdb_start_freq_khz", compiled->start_freq_khz,
+		   compiled->n_rules);
+	print_u32s("regdb_end_freq_khz", compiled->end_freq_khz,
+		   compiled->n_rules);
+	print_u32s("regdb_max_bandwidth_khz", compiled->max_bandwidth_khz,
+		   compiled->n_rules);
+	print_u32s("regdb_max_antenna_gain", compiled->max_antenna_gain,
+		   compiled->n_rules);
+	print_u32s("regdb_max_eirp", compiled->max_eirp, compiled->n_rules);
+	print_u32s("regdb_flags", compiled->flags, compiled->n_rules);
+
+	print_alpha2s((const char (*)[2]) compiled->alpha2,
+		      compiled->n_countries);
+	print_u8s("regdb_dfs_region", compiled->dfs_region,
+		  compiled->n_countries, "");
+	print_u32s("regdb_rules_first", compiled->rules_first,
+		   compiled->n_countries + 1);
+	print_u32s("regdb_rule_idx", compiled->rule_idx,
+		   compiled->rules_first[compiled->n_countries]);
+
+	/* The compiled form is never written to, it only is not const */
+	printf("static const struct reglib_regdb_compiled regdb_compiled = {\n"
+	       "\t.n_rules = %u,\n"
+	       "\t.start_freq_khz = (uint32_t *) regdb_start_freq_khz,\n"
+	       "\t.end_freq_khz = (uint32_t *) regdb_end_freq_khz,\n"
+	       "\t.max_bandwidth_khz = (uint32_t *) regdb_max_bandwidth_khz,\n"
+	       "\t.max_antenna_gain = (uint32_t *) regdb_max_antenna_gain,\n"
+	       "\t.max_eirp = (uint32_t *) regdb_max_eirp,\n"
+	       "\t.flags = (uint32_t *) regdb_flags,\n"
+	       "\t.n_countries = %u,\n"
+	       "\t.alpha2 = (char (*)[2]) regdb_alpha2,\n"
+	       "\t.dfs_region = (uint8_t *) regdb_dfs_region,\n"
+	       "\t.rules_first = (uint32_t *) regdb_rules_first,\n"
+	       "\t.rule_idx = (uint32_t *) regdb_rule_idx,\n"
+	       "};\n\n", compiled->n_rules, compiled->n_countries);
+
+	printf("const struct reglib_regdb_builtin reglib_builtin_regdb = {\n"
+	       "\t.db = regdb_db,\n"
+	       "\t.real_dblen = %u,\n"
+	       "\t.siglen = %u,\n"
+	       "\t.digest = {", ctx->real_dblen, ctx->siglen);
+	for (i = 0; i < REGLIB_DIGEST_LEN; i++)
+		printf("%s0x%02x,", i % 8 ? " " : "\n\t\t", digest[i]);
+	printf("\n\t},\n\t.alpha2_idx = {\n");
+	for (i = 0; i < 26 * 26; i++)
+		if (ctx->alpha2_idx[i])
+			printf("\t\t[%u] = %u, /* %c%c */\n", i,
+			       ctx->alpha2_idx[i], 'A' + i / 26, 'A' + i % 26);
+	printf("\t},\n"
+	       "\t.world_idx = %u,\n"
+	       "\t.compiled = &regdb_compiled,\n"
+	       "};\n", ctx->world_idx);
+}
+
+int main(int argc, char **argv)
+{
+	const struct reglib_regdb_compiled *compiled;
+	const struct reglib_regdb_ctx *ctx;
+	int r = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <regulatory-binary-file> > "
+			"regdb-builtin.c\n", argv[0]);
+		return -EINVAL;
+	}
+
+	/* What gets built in is trusted from then on, so it must verify */
+	ctx = reglib_malloc_regdb_ctx(argv[1]);
+	if (!ctx) {
+		fprintf(stderr, "Invalid or unverified regulatory file %s\n",
+			argv[1]);
+		return -EINVAL;
+	}
+
+	compiled = reglib_regdb_compile(ctx);
+	if (!compiled) {
+		fprintf(stderr, "Failed to compile %s\n", argv[1]);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	print_regdb(argv[1], ctx, compiled);
+
+	if (fflush(stdout)) {
+		fprintf(stderr, "Unable to write the builtin regdb\n");
+		r = -EIO;
+	}
+
+out:
+	reglib_free_regdb_ctx(ctx);
+	return r;
+}
@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "reglib.h"
+
+/*
+ * Lists the countries that were added, removed or changed between two
+ * regulatory.bin files, one per line, so a db update can be reviewed
+ * without diffing dumps of both. Exits with 1 if there are any, like
+ * diff(1) does.
+ */
+
+static const char *const diff_names[] = {
+	[REGLIB_DIFF_ADDED] = "added",
+	[REGLIB_DIFF_REMOVED] = "removed",
+	[REGLIB_DIFF_CHANGED] = "changed",
+};
+
+struct diff_state {
+	bool verbose;
+	unsigned int n_diffs;
+};
+
+static int print_diff(const struct reglib_diff *diff, void *data)
+{
+	struct diff_state *state = data;
+
+	state->n_diffs++;
+	printf("%s %s\n", diff_names[diff->type], diff->alpha2);
+
+	if (!state->verbose)
+		return 0;
+
+	if (diff->old_rd) {
+		printf("--- old\n");
+		reglib_print_regdom(diff->old_rd);
+	}
+	if (diff->new_rd) {
+		printf("+++ new\n");
+		reglib_print_regdom(diff->new_rd);
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const struct reglib_regdb_ctx *old_ctx, *new_ctx;
+	struct diff_state state;
+	int opt, r;
+
+	memset(&state, 0, sizeof(state));
+
+	while ((opt = getopt(argc, argv, "v")) != -1) {
+		switch (opt) {
+		case 'v':
+			state.verbose = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind != argc - 2)
+		goto usage;
+
+	old_ctx = reglib_malloc_regdb_ctx(argv[optind]);
+	if (!old_ctx) {
+		fprintf(stderr, "Invalid regulatory file %s\n", argv[optind]);
+		return -EINVAL;
+	}
+
+	new_ctx = reglib_malloc_regdb_ctx(argv[optind + 1]);
+	if (!new_ctx) {
+		fprintf(stderr, "Invalid regulatory file %s\n",
+			argv[optind + 1]);
+		reglib_free_regdb_ctx(old_ctx);
+		return -EINVAL;
+	}
+
+	r = reglib_diff_ctx(old_ctx, new_ctx, print_diff, &state);
+	if (r)
+		fprintf(stderr, "Failed to compare %s and %s: %d\n",
+			argv[optind], argv[optind + 1], r);
+	else if (state.n_diffs)
+		r = 1;
+
+	reglib_free_regdb_ctx(new_ctx);
+	reglib_free_regdb_ctx(old_ctx);
+
+	return r;
+
+usage:
+	fprintf(stderr, "Usage: %s [-v] <old-regulatory-binary-file> "
+		"<new-regulatory-binary-file>\n", argv[0]);
+	return -EINVAL;
+}
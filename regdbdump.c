@@ -1,41 +1,106 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 #include "reglib.h"
 
+/* stdout buffer, a dump of the whole db goes out in a few large writes */
+static char out_buf[1 << 16];
+
 static void reglib_regdbdump(const struct reglib_regdb_ctx *ctx)
 {
-	const struct ieee80211_regdomain *rd = NULL;
+	struct reglib_rd_view view;
 	unsigned int idx = 0;
 
-	reglib_for_each_country(rd, idx, ctx) {
-		if (!reglib_is_valid_rd(rd)) {
-			fprintf(stderr, "country %.2s: invalid\n", rd->alpha2);
-			free((struct ieee80211_regdomain *) rd);
+	reglib_for_each_country_view(&view, idx, ctx) {
+		if (!reglib_is_valid_rd_view(&view)) {
+			fprintf(stderr, "country %.2s: invalid\n", view.alpha2);
 			continue;
 		}
-		reglib_print_regdom(rd);
-		free((struct ieee80211_regdomain *) rd);
+		reglib_print_rd_view(&view);
+	}
+}
+
+static int dump_country(void *item, FILE *out, void *data)
+{
+	const struct reglib_regdb_ctx *ctx = data;
+	struct reglib_rd_view view;
+	int r;
+
+	r = reglib_get_rd_view_idx((uintptr_t) item, ctx, &view);
+	if (r)
+		return r;
+
+	if (!reglib_is_valid_rd_view(&view)) {
+		fprintf(stderr, "country %.2s: invalid\n", view.alpha2);
+		return 0;
+	}
+	reglib_fprint_rd_view(out, &view);
+
+	return 0;
+}
+
+static int reglib_regdbdump_parallel(const struct reglib_regdb_ctx *ctx,
+				     unsigned int nthreads)
+{
+	struct reglib_ordered_pool *pool;
+	unsigned int idx;
+
+	pool = reglib_malloc_ordered_pool(nthreads, stdout, dump_country,
+					  (void *) ctx);
+	if (!pool)
+		return -ENOMEM;
+
+	for (idx = 0; idx < ctx->num_countries; idx++) {
+		if (reglib_ordered_pool_submit(pool, (void *) (uintptr_t) idx))
+			break;
 	}
+
+	return reglib_free_ordered_pool(pool);
 }
 
 int main(int argc, char **argv)
 {
 	const struct reglib_regdb_ctx *ctx;
+	unsigned int nthreads = 0;
+	bool parallel = false;
+	int opt, r = 0;
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <regulatory-binary-file>\n", argv[0]);
-		return -EINVAL;
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			if (reglib_parse_nthreads(optarg, &nthreads))
+				goto usage;
+			parallel = true;
+			break;
+		default:
+			goto usage;
+		}
 	}
 
-	ctx = reglib_malloc_regdb_ctx(argv[1]);
+	if (optind != argc - 1)
+		goto usage;
+
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+	ctx = reglib_malloc_regdb_ctx(argv[optind]);
 	if (!ctx) {
 		fprintf(stderr, "Invalid or empty regulatory file, note: "
 			"a binary regulatory file should be used.\n");
 		return -EINVAL;
 	}
 
-	reglib_regdbdump(ctx);
+	if (parallel)
+		r = reglib_regdbdump_parallel(ctx, nthreads);
+	else
+		reglib_regdbdump(ctx);
 	reglib_free_regdb_ctx(ctx);
 
-	return 0;
+	return r;
+
+usage:
+	fprintf(stderr, "Usage: %s [-j <threads>] <regulatory-binary-file>\n",
+		argv[0]);
+	return -EINVAL;
 }
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "reglib.h"
+
+/*
+ * libFuzzer target for loading a regdb and decoding all of it. The input
+ * is taken as a regulatory.bin, without checking its signature so that
+ * the fuzzer gets past it, and every country is then decoded through its
+ * view, as a domain and through the compiled form. Whatever the input,
+ * none of this may exit, crash or read outside of the db.
+ */
+
+static void fuzz_countries(const struct reglib_regdb_ctx *ctx)
+{
+	const struct ieee80211_regdomain *rd;
+	struct ieee80211_reg_rule rule;
+	struct reglib_rd_view view;
+	unsigned int idx = 0, i;
+
+	reglib_for_each_country_view(&view, idx, ctx) {
+		reglib_for_each_rd_view_rule(&rule, i, &view)
+			;
+		reglib_is_valid_rd_view(&view);
+	}
+
+	for (idx = 0; idx < ctx->num_countries; idx++) {
+		rd = reglib_get_rd_idx(idx, ctx);
+		if (!rd)
+			continue;
+		reglib_is_valid_rd(rd);
+		free((struct ieee80211_regdomain *) rd);
+	}
+
+	rd = reglib_get_rd_alpha2_ctx(ctx, "00");
+	free((struct ieee80211_regdomain *) rd);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const struct reglib_regdb_ctx *ctx;
+	int fd;
+
+	fd = memfd_create("regdb", MFD_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (write(fd, data, size) != (ssize_t) size) {
+		close(fd);
+		return 0;
+	}
+
+	ctx = reglib_malloc_regdb_ctx_fd_flags(fd, REGLIB_CTX_NO_VERIFY);
+	if (!ctx) {
+		close(fd);
+		return 0;
+	}
+
+	fuzz_countries(ctx);
+	if (reglib_regdb_compile(ctx))
+		fuzz_countries(ctx);
+
+	reglib_free_regdb_ctx(ctx);
+
+	return 0;
+}
@@ -0,0 +1,216 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Writes a synthetic db.txt, for benchmarks and tests that want more
+ * countries and rules than the real database has. The same seed always
+ * gets the same database. Rules are drawn from the 2.4, 5, 6 and 60 GHz
+ * bands and sorted by frequency. As in the real database they do not
+ * overlap within a country, and every country has common_rule the way
+ * all of them share 2.4 GHz channels, so intersecting all the countries
+ * has that much left instead of coming up empty after a few.
+ */
+
+struct gen_band {
+	unsigned int start_mhz;
+	unsigned int end_mhz;
+	unsigned int step_mhz;
+};
+
+static const struct gen_band bands[] = {
+	{ 2402, 2494, 20 },
+	{ 5170, 5835, 20 },
+	{ 5945, 7125, 20 },
+	{ 57240, 70200, 2160 },
+};
+
+#define N_BANDS (sizeof(bands) / sizeof(bands[0]))
+
+struct gen_rule {
+	unsigned int start_mhz;
+	unsigned int end_mhz;
+	unsigned int bw_mhz;
+	unsigned int eirp;
+	unsigned int flags;
+};
+
+static const struct gen_rule common_rule = { 2402, 2472, 40, 20, 0 };
+
+static const unsigned int eirps[] = { 14, 17, 20, 23, 24, 27, 30, 36 };
+
+static const struct {
+	const char *name;
+	unsigned int per_mille;
+} flags[] = {
+	{ "NO-OUTDOOR", 50 },
+	{ "DFS", 250 },
+	{ "NO-IR", 100 },
+	{ "AUTO-BW", 200 },
+};
+
+#define N_FLAGS (sizeof(flags) / sizeof(flags[0]))
+
+static const char *const dfs_regions[] = {
+	"", " DFS-FCC", " DFS-ETSI", " DFS-JP",
+};
+
+
+/* xorshift64, so the output does not depend on the libc */
+static uint64_t gen_state;
+
+static unsigned int gen_rand(unsigned int n)
+{
+	gen_state ^= gen_state << 13;
+	gen_state ^= gen_state >> 7;
+	gen_state ^= gen_state << 17;
+	return gen_state % n;
+}
+
+static void gen_rule(struct gen_rule *rule)
+{
+	const struct gen_band *band = &bands[gen_rand(N_BANDS)];
+	unsigned int steps, width, i;
+
+	steps = (band->end_mhz - band->start_mhz) / band->step_mhz;
+	width = 1 + gen_rand(steps < 8 ? steps : 8);
+	rule->start_mhz = band->start_mhz +
+			  gen_rand(steps - width + 1) * band->step_mhz;
+	rule->end_mhz = rule->start_mhz + width * band->step_mhz;
+
+	/* The largest power of two channel width that fits */
+	rule->bw_mhz = band->step_mhz;
+	while (rule->bw_mhz * 2 <= width * band->step_mhz &&
+	       rule->bw_mhz < 160)
+		rule->bw_mhz *= 2;
+
+	rule->eirp = eirps[gen_rand(sizeof(eirps) / sizeof(eirps[0]))];
+
+	rule->flags = 0;
+	for (i = 0; i < N_FLAGS; i++)
+		if (gen_rand(1000) < flags[i].per_mille)
+			rule->flags |= 1U << i;
+}
+
+static int gen_rule_cmp(const void *a, const void *b)
+{
+	const struct gen_rule *r1 = a, *r2 = b;
+
+	if (r1->start_mhz != r2->start_mhz)
+		return r1->start_mhz < r2->start_mhz ? -1 : 1;
+	return r1->end_mhz < r2->end_mhz ? -1 : r1->end_mhz > r2->end_mhz;
+}
+
+static bool gen_rule_overlaps(const struct gen_rule *rules, unsigned int n,
+			      const struct gen_rule *rule)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (rule->start_mhz < rules[i].end_mhz &&
+		    rules[i].start_mhz < rule->end_mhz)
+			return true;
+
+	return false;
+}
+
+static void gen_country(const char *alpha2, struct gen_rule *rules,
+			unsigned int max_rules)
+{
+	unsigned int tries, n, i, f;
+
+	/* Rules that would overlap one the country has are left out */
+	tries = gen_rand(max_rules);
+	rules[0] = common_rule;
+	for (i = 0, n = 1; i < tries; i++) {
+		gen_rule(&rules[n]);
+		if (!gen_rule_overlaps(rules, n, &rules[n]))
+			n++;
+	}
+	qsort(rules, n, sizeof(*rules), gen_rule_cmp);
+
+	printf("country %.2s:%s\n", alpha2, dfs_regions[gen_rand(4)]);
+	for (i = 0; i < n; i++) {
+		printf("\t(%u - %u @ %u), (%u)", rules[i].start_mhz,
+		       rules[i].end_mhz, rules[i].bw_mhz, rules[i].eirp);
+		for (f = 0; f < N_FLAGS; f++)
+			if (rules[i].flags & (1U << f))
+				printf(", %s", flags[f].name);
+		printf("\n");
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n_countries = 26 * 26 + 1, max_rules = 16, i;
+	struct gen_rule *rules;
+	char alpha2[2];
+	char *end;
+	int opt;
+
+	gen_state = 1;
+
+	while ((opt = getopt(argc, argv, "c:r:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			n_countries = strtoul(optarg, &end, 10);
+			if (*end || !*optarg)
+				goto usage;
+			break;
+		case 'r':
+			max_rules = strtoul(optarg, &end, 10);
+			if (*end || !*optarg)
+				goto usage;
+			break;
+		case 's':
+			gen_state = strtoull(optarg, &end, 10);
+			if (*end || !*optarg)
+				goto usage;
+			/* xorshift never leaves 0 */
+			if (!gen_state)
+				gen_state = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	/* The world, then every alpha2 there is */
+	if (optind != argc || !max_rules || n_countries > 26 * 26 + 1)
+		goto usage;
+
+	rules = calloc(max_rules, sizeof(*rules));
+	if (!rules)
+		return -ENOMEM;
+
+	for (i = 0; i < n_countries; i++) {
+		if (!i) {
+			alpha2[0] = alpha2[1] = '0';
+		} else {
+			alpha2[0] = 'A' + (i - 1) / 26;
+			alpha2[1] = 'A' + (i - 1) % 26;
+		}
+		gen_country(alpha2, rules, max_rules);
+	}
+
+	free(rules);
+
+	if (fflush(stdout)) {
+		fprintf(stderr, "Unable to write the database\n");
+		return -EIO;
+	}
+
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-c <countries>] [-r <max-rules>] "
+		"[-s <seed>] > db.txt\n"
+		"At most %u countries, the world and every alpha2\n",
+		argv[0], 26 * 26 + 1);
+	return -EINVAL;
+}
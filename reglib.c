@@ -11,6 +11,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/inotify.h>
 
 #include <arpa/inet.h> /* ntohl */
 
@@ -28,7 +33,16 @@
 #include <gcrypt.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REGLIB_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define REGLIB_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 #include "reglib.h"
+#include "probes.h"
 
 #ifdef USE_OPENSSL
 #include "keys-ssl.c"
@@ -40,6 +54,116 @@
 
 int debug = 0;
 
+/*
+ * Statistics
+ *
+ * Stats are only kept while enabled. The counters are shared by all
+ * threads, the pool, reduction and matrix workers included, so a relaxed
+ * atomic add on them each would have those fight over one cache line;
+ * while disabled they only read the flag. Timing a phase reads the clock
+ * twice, a start time of zero from reglib_stat_clock() means the phase is
+ * not timed. The USDT probes at the same places are there whenever
+ * CONFIG_SDT is.
+ */
+static struct reglib_stats reglib_stats __attribute__((aligned(64)));
+static bool reglib_stats_enabled;
+
+#define reglib_stat_inc(__field, __n)					\
+	do {								\
+		if (__atomic_load_n(&reglib_stats_enabled,		\
+				    __ATOMIC_RELAXED))			\
+			__atomic_fetch_add(&reglib_stats.__field, (__n),	\
+					   __ATOMIC_RELAXED);		\
+	} while (0)
+
+static uint64_t reglib_stat_clock(void)
+{
+	struct timespec ts;
+
+	if (!__atomic_load_n(&reglib_stats_enabled, __ATOMIC_RELAXED))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the time since @start and adds it to @ns, if timed */
+static uint64_t reglib_stat_time(uint64_t *ns, uint64_t start)
+{
+	uint64_t now;
+
+	if (!start)
+		return 0;
+
+	now = reglib_stat_clock();
+	if (now <= start)
+		return 0;
+
+	__atomic_fetch_add(ns, now - start, __ATOMIC_RELAXED);
+	return now - start;
+}
+
+#define REGLIB_STAT(__field)						\
+	{ #__field, offsetof(struct reglib_stats, __field) }
+
+static const struct {
+	const char *name;
+	size_t offset;
+} reglib_stat_fields[] = {
+	REGLIB_STAT(ctx_opens),
+	REGLIB_STAT(open_ns),
+	REGLIB_STAT(verifies),
+	REGLIB_STAT(verify_ns),
+	REGLIB_STAT(bytes_hashed),
+	REGLIB_STAT(keys_tried),
+	REGLIB_STAT(sigcache_hits),
+	REGLIB_STAT(lookups),
+	REGLIB_STAT(lookup_misses),
+	REGLIB_STAT(decodes),
+	REGLIB_STAT(decode_ns),
+	REGLIB_STAT(allocs),
+	REGLIB_STAT(alloc_bytes),
+};
+
+#define REGLIB_N_STATS (sizeof(reglib_stat_fields) / sizeof(reglib_stat_fields[0]))
+
+#define REGLIB_STAT_PTR(__stats, __i)					\
+	((uint64_t *) ((uint8_t *) (__stats) + reglib_stat_fields[__i].offset))
+
+void reglib_enable_stats(bool enable)
+{
+	__atomic_store_n(&reglib_stats_enabled, enable, __ATOMIC_RELAXED);
+}
+
+void reglib_get_stats(struct reglib_stats *stats)
+{
+	unsigned int i;
+
+	for (i = 0; i < REGLIB_N_STATS; i++)
+		*REGLIB_STAT_PTR(stats, i) =
+			__atomic_load_n(REGLIB_STAT_PTR(&reglib_stats, i),
+					__ATOMIC_RELAXED);
+}
+
+void reglib_reset_stats(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < REGLIB_N_STATS; i++)
+		__atomic_store_n(REGLIB_STAT_PTR(&reglib_stats, i), 0,
+				 __ATOMIC_RELAXED);
+}
+
+void reglib_fprint_stats(FILE *fp, const struct reglib_stats *stats)
+{
+	unsigned int i;
+
+	for (i = 0; i < REGLIB_N_STATS; i++)
+		fprintf(fp, "%s %llu\n", reglib_stat_fields[i].name,
+			(unsigned long long)
+			*REGLIB_STAT_PTR(stats, i));
+}
+
 void *
 reglib_get_file_ptr(uint8_t *db, size_t dblen, size_t structlen, uint32_t ptr)
 {
@@ -70,108 +194,379 @@ reglib_array_len(size_t baselen, unsigned int elemcount, size_t elemlen)
 }
 
 /*
- * reglib_verify_db_signature():
+ * Arena allocator
+ *
+ * Allocations are carved out of chunks which are only ever released all
+ * at once. When a reset finds the arena had to grow past its first chunk
+ * the chunks are replaced by a single one large enough for all of them,
+ * so repeating a similar operation on the arena needs no malloc() at all.
+ */
+#define REGLIB_ARENA_ALIGN	16
+#define REGLIB_ARENA_CHUNK_SIZE	4096
+
+struct reglib_arena_chunk {
+	struct reglib_arena_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[] __attribute__((aligned(REGLIB_ARENA_ALIGN)));
+};
+
+struct reglib_arena {
+	struct reglib_arena_chunk *chunks;
+	size_t chunk_size;
+};
+
+static struct reglib_arena_chunk *reglib_arena_chunk_alloc(size_t size)
+{
+	struct reglib_arena_chunk *chunk;
+
+	if (size > SIZE_MAX - sizeof(*chunk))
+		return NULL;
+
+	chunk = malloc(sizeof(*chunk) + size);
+	if (!chunk)
+		return NULL;
+
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+struct reglib_arena *reglib_malloc_arena(size_t chunk_size)
+{
+	struct reglib_arena *arena;
+
+	arena = malloc(sizeof(struct reglib_arena));
+	if (!arena)
+		return NULL;
+
+	if (!chunk_size)
+		chunk_size = REGLIB_ARENA_CHUNK_SIZE;
+
+	arena->chunk_size = chunk_size;
+	arena->chunks = reglib_arena_chunk_alloc(chunk_size);
+	if (!arena->chunks) {
+		free(arena);
+		return NULL;
+	}
+
+	return arena;
+}
+
+void *reglib_arena_zalloc(struct reglib_arena *arena, size_t size)
+{
+	struct reglib_arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	if (size > SIZE_MAX - REGLIB_ARENA_ALIGN)
+		return NULL;
+
+	size = (size + REGLIB_ARENA_ALIGN - 1) & ~(size_t) (REGLIB_ARENA_ALIGN - 1);
+
+	if (size > chunk->size - chunk->used) {
+		chunk = reglib_arena_chunk_alloc(size > arena->chunk_size ?
+						 size : arena->chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	memset(ptr, 0, size);
+
+	return ptr;
+}
+
+void reglib_arena_reset(struct reglib_arena *arena)
+{
+	struct reglib_arena_chunk *chunk, *next, *single;
+	size_t total = 0;
+
+	if (!arena->chunks->next) {
+		arena->chunks->used = 0;
+		return;
+	}
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next)
+		total += chunk->size;
+
+	single = reglib_arena_chunk_alloc(total);
+	if (!single) {
+		/* Keep the most recent chunk, the others go */
+		single = arena->chunks;
+		arena->chunks = single->next;
+		single->next = NULL;
+		single->used = 0;
+	}
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	arena->chunks = single;
+}
+
+void reglib_free_arena(struct reglib_arena *arena)
+{
+	struct reglib_arena_chunk *chunk, *next;
+
+	if (!arena)
+		return;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+/*
+ * Allocation helpers for code which can work either with an arena or
+ * with the heap, pass a NULL arena for malloc() / free().
+ */
+static void *reglib_zalloc(struct reglib_arena *arena, size_t size)
+{
+	void *ptr;
+
+	if (arena)
+		return reglib_arena_zalloc(arena, size);
+
+	ptr = malloc(size);
+	if (ptr) {
+		memset(ptr, 0, size);
+		reglib_stat_inc(allocs, 1);
+		reglib_stat_inc(alloc_bytes, size);
+	}
+
+	return ptr;
+}
+
+static void reglib_release(struct reglib_arena *arena, void *ptr)
+{
+	if (!arena)
+		free(ptr);
+}
+
+/*
+ * reglib_verify_db_hash():
  *
  * Checks the validity of the signature found on the regulatory
  * database against the array 'keys'. Returns 1 if there exists
  * at least one key in the array such that the signature is valid
- * against that key; 0 otherwise.
+ * for the SHA1 sum of the database, @hash, against that key; 0
+ * otherwise.
+ */
+
+#if defined(USE_OPENSSL) || defined(USE_GCRYPT)
+/*
+ * Key ring
+ *
+ * The trusted keys are turned into what the crypto library verifies with
+ * once per process, on first use, rather than on every verification. A
+ * signature is checked against the key that verified the last one first,
+ * usually there is just the one db on a system and this is its key.
  */
+static pthread_once_t reglib_keyring_once = PTHREAD_ONCE_INIT;
+static unsigned int reglib_keyring_last;
+
+static unsigned int reglib_keyring_first(unsigned int n_keys)
+{
+	unsigned int last = __atomic_load_n(&reglib_keyring_last,
+					    __ATOMIC_RELAXED);
+
+	return last < n_keys ? last : 0;
+}
+
+static void reglib_keyring_hit(unsigned int idx)
+{
+	__atomic_store_n(&reglib_keyring_last, idx, __ATOMIC_RELAXED);
+}
+#endif
 
 #ifdef USE_OPENSSL
-int reglib_verify_db_signature(uint8_t *db, size_t dblen, size_t siglen)
+static int reglib_hash_db(uint8_t *db, size_t dblen, uint8_t *hash)
+{
+	if (SHA1(db, dblen, hash) != hash) {
+		fprintf(stderr, "Failed to calculate SHA1 sum.\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+struct reglib_keyring {
+	unsigned int n_keys;
+	RSA **keys;
+#ifdef REGDB_SIGCACHE
+	uint8_t id[REGLIB_DIGEST_LEN];
+#endif
+};
+
+static struct reglib_keyring reglib_keyring;
+
+static void reglib_keyring_add(RSA *rsa)
+{
+	RSA **keys;
+
+	keys = realloc(reglib_keyring.keys,
+		       (reglib_keyring.n_keys + 1) * sizeof(*keys));
+	if (!keys) {
+		fprintf(stderr, "Failed to add RSA key.\n");
+		RSA_free(rsa);
+		return;
+	}
+
+	keys[reglib_keyring.n_keys++] = rsa;
+	reglib_keyring.keys = keys;
+}
+
+#ifdef REGDB_SIGCACHE
+/*
+ * Identifies the set of trusted keys a cached verification was done
+ * with: the SHA1 sum of the built-in keys, and the runtime PUBKEY_DIR
+ * which gets a new mtime whenever a key gets added or removed. It is
+ * taken when the keys are loaded so it matches the keys in use.
+ */
+static void reglib_keyring_load_id(uint8_t *id)
+{
+	struct stat pubkey_dir;
+	SHA_CTX sha;
+	unsigned int i;
+
+	SHA1_Init(&sha);
+	for (i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+		SHA1_Update(&sha, keys[i].e.d, keys[i].e.top * sizeof(BN_ULONG));
+		SHA1_Update(&sha, keys[i].n.d, keys[i].n.top * sizeof(BN_ULONG));
+	}
+	memset(&pubkey_dir, 0, sizeof(pubkey_dir));
+	if (!stat(PUBKEY_DIR, &pubkey_dir)) {
+		SHA1_Update(&sha, &pubkey_dir.st_ino, sizeof(pubkey_dir.st_ino));
+		SHA1_Update(&sha, &pubkey_dir.st_mtim, sizeof(pubkey_dir.st_mtim));
+	}
+	SHA1_Final(id, &sha);
+}
+#endif /* REGDB_SIGCACHE */
+
+/*
+ * The built-in keys point at the static bignums of keys-ssl.c and are
+ * never freed, neither are the ones read from PUBKEY_DIR. Keys added to
+ * PUBKEY_DIR later on are picked up by the next process.
+ */
+static void reglib_load_keyring(void)
 {
 	RSA *rsa;
-	uint8_t hash[SHA_DIGEST_LENGTH];
 	unsigned int i;
-	int ok = 0;
 	DIR *pubkey_dir;
 	struct dirent *nextfile;
 	FILE *keyfile;
 	char filename[PATH_MAX];
 
-	if (SHA1(db, dblen, hash) != hash) {
-		fprintf(stderr, "Failed to calculate SHA1 sum.\n");
-		goto out;
-	}
+#ifdef REGDB_SIGCACHE
+	reglib_keyring_load_id(reglib_keyring.id);
+#endif
 
-	for (i = 0; (i < sizeof(keys)/sizeof(keys[0])) && (!ok); i++) {
+	for (i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
 		rsa = RSA_new();
 		if (!rsa) {
 			fprintf(stderr, "Failed to create RSA key.\n");
-			goto out;
+			continue;
 		}
 
 		rsa->e = &keys[i].e;
 		rsa->n = &keys[i].n;
 
-		ok = RSA_verify(NID_sha1, hash, SHA_DIGEST_LENGTH,
-				db + dblen, siglen, rsa) == 1;
-
-		rsa->e = NULL;
-		rsa->n = NULL;
-		RSA_free(rsa);
+		reglib_keyring_add(rsa);
 	}
-	if (!ok && (pubkey_dir = opendir(PUBKEY_DIR))) {
-		while (!ok && (nextfile = readdir(pubkey_dir))) {
-			snprintf(filename, PATH_MAX, "%s/%s", PUBKEY_DIR,
-				nextfile->d_name);
-			if ((keyfile = fopen(filename, "rb"))) {
-				rsa = PEM_read_RSA_PUBKEY(keyfile,
-					NULL, NULL, NULL);
-				if (rsa)
-					ok = RSA_verify(NID_sha1, hash, SHA_DIGEST_LENGTH,
-						db + dblen, siglen, rsa) == 1;
-				RSA_free(rsa);
-				fclose(keyfile);
-			}
+
+	pubkey_dir = opendir(PUBKEY_DIR);
+	if (!pubkey_dir)
+		return;
+
+	while ((nextfile = readdir(pubkey_dir))) {
+		snprintf(filename, PATH_MAX, "%s/%s", PUBKEY_DIR,
+			nextfile->d_name);
+		if ((keyfile = fopen(filename, "rb"))) {
+			rsa = PEM_read_RSA_PUBKEY(keyfile,
+				NULL, NULL, NULL);
+			if (rsa)
+				reglib_keyring_add(rsa);
+			fclose(keyfile);
 		}
-		closedir(pubkey_dir);
+	}
+	closedir(pubkey_dir);
+}
+
+static int reglib_verify_db_hash(uint8_t *hash, uint8_t *sig, size_t siglen)
+{
+	unsigned int i, j, first;
+	int ok = 0;
+
+	pthread_once(&reglib_keyring_once, reglib_load_keyring);
+
+	first = reglib_keyring_first(reglib_keyring.n_keys);
+	for (j = 0; j < reglib_keyring.n_keys && !ok; j++) {
+		i = (first + j) % reglib_keyring.n_keys;
+		reglib_stat_inc(keys_tried, 1);
+		ok = RSA_verify(NID_sha1, hash, SHA_DIGEST_LENGTH,
+				sig, siglen, reglib_keyring.keys[i]) == 1;
+		if (ok)
+			reglib_keyring_hit(i);
 	}
 
 	if (!ok)
 		fprintf(stderr, "Database signature verification failed.\n");
 
-out:
 	return ok;
 }
+
+#ifdef REGDB_SIGCACHE
+static void reglib_keyring_id(uint8_t *id)
+{
+	pthread_once(&reglib_keyring_once, reglib_load_keyring);
+	memcpy(id, reglib_keyring.id, REGLIB_DIGEST_LEN);
+}
+#endif /* REGDB_SIGCACHE */
 #endif /* USE_OPENSSL */
 
 #ifdef USE_GCRYPT
-int reglib_verify_db_signature(uint8_t *db, size_t dblen, size_t siglen)
+static int reglib_hash_db(uint8_t *db, size_t dblen, uint8_t *hash)
 {
-	gcry_mpi_t mpi_e, mpi_n;
-	gcry_sexp_t rsa, signature, data;
-	uint8_t hash[20];
-	unsigned int i;
-	int ok = 0;
-
 	/* initialise */
 	gcry_check_version(NULL);
 
 	/* hash the db */
 	gcry_md_hash_buffer(GCRY_MD_SHA1, hash, db, dblen);
 
-	if (gcry_sexp_build(&data, NULL, "(data (flags pkcs1) (hash sha1 %b))",
-			    20, hash)) {
-		fprintf(stderr, "Failed to build data S-expression.\n");
-		return ok;
-	}
+	return 0;
+}
 
-	if (gcry_sexp_build(&signature, NULL, "(sig-val (rsa (s %b)))",
-			    siglen, db + dblen)) {
-		fprintf(stderr, "Failed to build signature S-expression.\n");
-		gcry_sexp_release(data);
-		return ok;
-	}
+struct reglib_keyring {
+	unsigned int n_keys;
+	gcry_sexp_t keys[sizeof(keys)/sizeof(keys[0])];
+};
+
+static struct reglib_keyring reglib_keyring;
 
-	for (i = 0; (i < sizeof(keys)/sizeof(keys[0])) && (!ok); i++) {
+static void reglib_load_keyring(void)
+{
+	gcry_mpi_t mpi_e, mpi_n;
+	gcry_sexp_t rsa;
+	unsigned int i;
+
+	gcry_check_version(NULL);
+
+	for (i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
 		if (gcry_mpi_scan(&mpi_e, GCRYMPI_FMT_USG,
 				keys[i].e, keys[i].len_e, NULL) ||
 		    gcry_mpi_scan(&mpi_n, GCRYMPI_FMT_USG,
 				keys[i].n, keys[i].len_n, NULL)) {
 			fprintf(stderr, "Failed to convert numbers.\n");
-			goto out;
+			continue;
 		}
 
 		if (gcry_sexp_build(&rsa, NULL,
@@ -180,52 +575,583 @@ int reglib_verify_db_signature(uint8_t *db, size_t dblen, size_t siglen)
 			fprintf(stderr, "Failed to build RSA S-expression.\n");
 			gcry_mpi_release(mpi_e);
 			gcry_mpi_release(mpi_n);
-			goto out;
+			continue;
 		}
 
-		ok = gcry_pk_verify(signature, data, rsa) == 0;
 		gcry_mpi_release(mpi_e);
 		gcry_mpi_release(mpi_n);
-		gcry_sexp_release(rsa);
+		reglib_keyring.keys[reglib_keyring.n_keys++] = rsa;
+	}
+}
+
+static int reglib_verify_db_hash(uint8_t *hash, uint8_t *sig, size_t siglen)
+{
+	gcry_sexp_t signature, data;
+	unsigned int i, j, first;
+	int ok = 0;
+
+	pthread_once(&reglib_keyring_once, reglib_load_keyring);
+
+	if (gcry_sexp_build(&data, NULL, "(data (flags pkcs1) (hash sha1 %b))",
+			    20, hash)) {
+		fprintf(stderr, "Failed to build data S-expression.\n");
+		return ok;
+	}
+
+	if (gcry_sexp_build(&signature, NULL, "(sig-val (rsa (s %b)))",
+			    siglen, sig)) {
+		fprintf(stderr, "Failed to build signature S-expression.\n");
+		gcry_sexp_release(data);
+		return ok;
+	}
+
+	first = reglib_keyring_first(reglib_keyring.n_keys);
+	for (j = 0; j < reglib_keyring.n_keys && !ok; j++) {
+		i = (first + j) % reglib_keyring.n_keys;
+		reglib_stat_inc(keys_tried, 1);
+		ok = gcry_pk_verify(signature, data,
+				    reglib_keyring.keys[i]) == 0;
+		if (ok)
+			reglib_keyring_hit(i);
 	}
 
 	if (!ok)
 		fprintf(stderr, "Database signature verification failed.\n");
 
-out:
 	gcry_sexp_release(data);
 	gcry_sexp_release(signature);
 	return ok;
 }
+
+#ifdef REGDB_SIGCACHE
+/* Identifies the set of built-in keys a cached verification was done with */
+static void reglib_keyring_id(uint8_t *id)
+{
+	gcry_md_hd_t md;
+	unsigned int i;
+
+	memset(id, 0, REGLIB_DIGEST_LEN);
+	if (gcry_md_open(&md, GCRY_MD_SHA1, 0))
+		return;
+	for (i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+		gcry_md_write(md, keys[i].e, keys[i].len_e);
+		gcry_md_write(md, keys[i].n, keys[i].len_n);
+	}
+	memcpy(id, gcry_md_read(md, GCRY_MD_SHA1), REGLIB_DIGEST_LEN);
+	gcry_md_close(md);
+}
+#endif /* REGDB_SIGCACHE */
 #endif /* USE_GCRYPT */
 
 #if !defined(USE_OPENSSL) && !defined(USE_GCRYPT)
-int reglib_verify_db_signature(uint8_t *db, size_t dblen, size_t siglen)
+/*
+ * Without a crypto library there is no signature to check but a context
+ * still carries the SHA1 sum of its db, for anything that wants to tell
+ * two dbs apart by their contents. This is plain FIPS 180-1, the libraries
+ * we otherwise hash with pick up the SHA extensions of the CPU themselves.
+ */
+static inline uint32_t reglib_rol32(uint32_t x, unsigned int n)
 {
-	return 1;
+	return (x << n) | (x >> (32 - n));
 }
-#endif
 
-const struct reglib_regdb_ctx *reglib_malloc_regdb_ctx(const char *regdb_file)
+static void reglib_sha1_block(uint32_t *h, const uint8_t *p)
 {
-	struct regdb_file_header *header;
-	struct reglib_regdb_ctx *ctx;
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	unsigned int i;
 
-	ctx = malloc(sizeof(struct reglib_regdb_ctx));
-	if (!ctx)
-		return NULL;
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+		       (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 80; i++)
+		w[i] = reglib_rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = reglib_rol32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = reglib_rol32(b, 30);
+		b = a;
+		a = t;
+	}
 
-	memset(ctx, 0, sizeof(struct reglib_regdb_ctx));
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
 
-	ctx->fd = open(regdb_file, O_RDONLY);
+static int reglib_hash_db(uint8_t *db, size_t dblen, uint8_t *hash)
+{
+	uint32_t h[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+	};
+	uint64_t bits = (uint64_t) dblen * 8;
+	uint8_t tail[128];
+	size_t off, rem;
+	unsigned int i;
 
-	if (ctx->fd < 0) {
-		free(ctx);
+	for (off = 0; dblen - off >= 64; off += 64)
+		reglib_sha1_block(h, db + off);
+
+	/* The rest of the db, the 0x80 pad byte and the length in bits */
+	rem = dblen - off;
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, db + off, rem);
+	tail[rem] = 0x80;
+	rem = rem < 56 ? 64 : 128;
+	for (i = 0; i < 8; i++)
+		tail[rem - 1 - i] = bits >> (8 * i);
+
+	reglib_sha1_block(h, tail);
+	if (rem == 128)
+		reglib_sha1_block(h, tail + 64);
+
+	for (i = 0; i < 5; i++) {
+		hash[4 * i] = h[i] >> 24;
+		hash[4 * i + 1] = h[i] >> 16;
+		hash[4 * i + 2] = h[i] >> 8;
+		hash[4 * i + 3] = h[i];
+	}
+
+	return 0;
+}
+#endif
+
+#if defined(USE_OPENSSL) || defined(USE_GCRYPT)
+int reglib_verify_db_signature(uint8_t *db, size_t dblen, size_t siglen)
+{
+	uint8_t hash[REGLIB_DIGEST_LEN];
+
+	if (reglib_hash_db(db, dblen, hash))
+		return 0;
+	reglib_stat_inc(bytes_hashed, dblen);
+
+	return reglib_verify_db_hash(hash, db + dblen, siglen);
+}
+#else
+int reglib_verify_db_signature(uint8_t *db, size_t dblen, size_t siglen)
+{
+	return 1;
+}
+#endif
+
+#ifdef REGDB_SIGCACHE
+/*
+ * Signature verification cache
+ *
+ * Verifying the RSA signature is the most expensive part of opening a
+ * regulatory database, and in the common case every crda run verifies
+ * the very same file. When built with REGDB_SIGCACHE we remember the
+ * last successful verification, keyed on the identity of the file and
+ * its SHA1 sum, in a root-owned file so that later runs on an unchanged
+ * database only need to hash it and can skip the RSA step.
+ */
+#define REGLIB_SIGCACHE_MAGIC	0x52475343 /* "RGSC" */
+#define REGLIB_SIGCACHE_VERSION	1
+
+struct reglib_sigcache_entry {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint8_t digest[REGLIB_DIGEST_LEN];
+	uint8_t keyring[REGLIB_DIGEST_LEN];
+};
+
+static void reglib_sigcache_entry_init(struct reglib_sigcache_entry *entry,
+				       const struct stat *st,
+				       const uint8_t *digest)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->magic = REGLIB_SIGCACHE_MAGIC;
+	entry->version = REGLIB_SIGCACHE_VERSION;
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime_sec = st->st_mtim.tv_sec;
+	entry->mtime_nsec = st->st_mtim.tv_nsec;
+	entry->ctime_sec = st->st_ctim.tv_sec;
+	entry->ctime_nsec = st->st_ctim.tv_nsec;
+	memcpy(entry->digest, digest, REGLIB_DIGEST_LEN);
+	reglib_keyring_id(entry->keyring);
+}
+
+static bool reglib_sigcache_lookup(const struct stat *st, const uint8_t *digest)
+{
+	struct reglib_sigcache_entry entry, cached;
+	struct stat cache_st;
+	bool hit = false;
+	int fd;
+
+	fd = open(REGDB_SIGCACHE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	/* Only trust a cache no one but root could have written */
+	if (fstat(fd, &cache_st) ||
+	    !S_ISREG(cache_st.st_mode) ||
+	    cache_st.st_uid != 0 ||
+	    (cache_st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    cache_st.st_size != sizeof(cached))
+		goto out;
+
+	if (read(fd, &cached, sizeof(cached)) != sizeof(cached))
+		goto out;
+
+	reglib_sigcache_entry_init(&entry, st, digest);
+	hit = memcmp(&entry, &cached, sizeof(entry)) == 0;
+out:
+	close(fd);
+	return hit;
+}
+
+static void reglib_sigcache_store(const struct stat *st, const uint8_t *digest)
+{
+	struct reglib_sigcache_entry entry;
+	char tmp[PATH_MAX];
+	int fd;
+
+	if (geteuid() != 0)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", REGDB_SIGCACHE) >= sizeof(tmp))
+		return;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		  0644);
+	if (fd < 0)
+		return;
+
+	reglib_sigcache_entry_init(&entry, st, digest);
+	if (write(fd, &entry, sizeof(entry)) != sizeof(entry)) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+
+	if (rename(tmp, REGDB_SIGCACHE))
+		unlink(tmp);
+}
+#endif /* REGDB_SIGCACHE */
+
+static bool reglib_verify_regdb_ctx(struct reglib_regdb_ctx *ctx)
+{
+	if (reglib_hash_db(ctx->db, ctx->dblen, ctx->digest))
+		return false;
+	reglib_stat_inc(bytes_hashed, ctx->dblen);
+
+#if defined(USE_OPENSSL) || defined(USE_GCRYPT)
+#ifdef REGDB_SIGCACHE
+	if (reglib_sigcache_lookup(&ctx->stat, ctx->digest)) {
+		reglib_stat_inc(sigcache_hits, 1);
+		return true;
+	}
+#endif
+
+	if (!reglib_verify_db_hash(ctx->digest, ctx->db + ctx->dblen,
+				   ctx->siglen))
+		return false;
+
+#ifdef REGDB_SIGCACHE
+	reglib_sigcache_store(&ctx->stat, ctx->digest);
+#endif
+	return true;
+#else
+	return reglib_verify_db_signature(ctx->db, ctx->dblen, ctx->siglen);
+#endif
+}
+
+const uint8_t *reglib_regdb_digest(const struct reglib_regdb_ctx *ctx)
+{
+	return ctx->digest;
+}
+
+/*
+ * The country list is sorted so we could binary search it, but there are
+ * only 26 * 26 possible alpha2s so we can just as well index all of them
+ * directly. This also keeps lookups correct on an unsorted db, for which
+ * the first entry for an alpha2 wins as it did with the linear search.
+ */
+static void reglib_index_countries(struct reglib_regdb_ctx *ctx)
+{
+	const char *alpha2;
+	uint32_t *idx;
+	unsigned int i;
+
+	for (i = 0; i < ctx->num_countries; i++) {
+		alpha2 = (const char *) ctx->countries[i].alpha2;
+		if (reglib_is_alpha2(alpha2))
+			idx = &ctx->alpha2_idx[REGLIB_ALPHA2_IDX(alpha2)];
+		else if (reglib_is_world_regdom(alpha2))
+			idx = &ctx->world_idx;
+		else
+			continue;
+		if (!*idx)
+			*idx = i + 1;
+	}
+}
+
+/*
+ * Validation
+ *
+ * Every offset and count of the db is checked once when its context is
+ * created: each has to point at a whole, aligned structure within the db
+ * and arrays must fit too. Countries and rule collections may share what
+ * they point at, so each distinct collection and rule is checked once,
+ * off sorted lists of their offsets, and the load stays linear in the
+ * size of the db however much is shared. The rule references of all the
+ * countries add up past that though, and decoders size their arrays by
+ * them, so their total is capped at REGLIB_MAX_RULE_REFS. A db that does
+ * not pass is rejected with an error rather than exiting, and on one that
+ * does the decoders follow offsets without checking them again.
+ */
+#define REGLIB_MAX_RULE_REFS	(1U << 24)
+
+/* As reglib_get_file_ptr(), NULL instead of exiting on a bad pointer */
+static void *reglib_check_file_ptr(const struct reglib_regdb_ctx *ctx,
+				   uint64_t structlen, uint32_t ptr)
+{
+	uint32_t p = ntohl(ptr);
+
+	if (structlen > ctx->dblen || p > ctx->dblen - structlen ||
+	    p % sizeof(uint32_t))
+		return NULL;
+
+	return ctx->db + p;
+}
+
+static int reglib_rule_ptr_cmp(const void *a, const void *b)
+{
+	uint32_t x = ntohl(*(const uint32_t *) a);
+	uint32_t y = ntohl(*(const uint32_t *) b);
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts the file pointers at @ptrs and returns how many distinct ones */
+static uint32_t reglib_unique_ptrs(uint32_t *ptrs, uint32_t n)
+{
+	uint32_t i, n_unique = 0;
+
+	qsort(ptrs, n, sizeof(*ptrs), reglib_rule_ptr_cmp);
+	for (i = 0; i < n; i++) {
+		if (!n_unique || ptrs[n_unique - 1] != ptrs[i])
+			ptrs[n_unique++] = ptrs[i];
+	}
+
+	return n_unique;
+}
+
+static int reglib_validate_rule(const struct reglib_regdb_ctx *ctx,
+				uint32_t ruleptr)
+{
+	struct regdb_file_reg_rule *rule;
+
+	rule = reglib_check_file_ptr(ctx, sizeof(*rule), ruleptr);
+	if (!rule)
+		return -EINVAL;
+
+	if (!reglib_check_file_ptr(ctx, sizeof(struct regdb_file_freq_range),
+				   rule->freq_range_ptr) ||
+	    !reglib_check_file_ptr(ctx, sizeof(struct regdb_file_power_rule),
+				   rule->power_rule_ptr))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Checks the collection at @ptr fits, returning it or NULL */
+static struct regdb_file_reg_rules_collection *
+reglib_validate_collection(const struct reglib_regdb_ctx *ctx, uint32_t ptr)
+{
+	struct regdb_file_reg_rules_collection *rcoll;
+
+	rcoll = reglib_check_file_ptr(ctx, sizeof(*rcoll), ptr);
+	if (!rcoll)
 		return NULL;
+
+	if (!reglib_check_file_ptr(ctx, sizeof(*rcoll) +
+				   (uint64_t) ntohl(rcoll->reg_rule_num) *
+				   sizeof(uint32_t), ptr))
+		return NULL;
+
+	return rcoll;
+}
+
+/*
+ * Checks every distinct rule of the @n_colls distinct collections at
+ * @colls, which all fit, @n_refs being how many rule pointers they hold.
+ */
+static int reglib_validate_rules(const struct reglib_regdb_ctx *ctx,
+				 const uint32_t *colls, uint32_t n_colls,
+				 uint64_t n_refs)
+{
+	struct regdb_file_reg_rules_collection *rcoll;
+	uint32_t *rules, n_rules, i, n;
+	int r = 0;
+
+	/* No more than the countries refer to, so capped */
+	rules = malloc(n_refs * sizeof(*rules) + 1);
+	if (!rules)
+		return -ENOMEM;
+
+	for (i = 0, n_rules = 0; i < n_colls; i++) {
+		rcoll = (struct regdb_file_reg_rules_collection *)
+			(ctx->db + ntohl(colls[i]));
+		n = ntohl(rcoll->reg_rule_num);
+		memcpy(rules + n_rules, rcoll->reg_rule_ptrs,
+		       n * sizeof(*rules));
+		n_rules += n;
+	}
+
+	n_rules = reglib_unique_ptrs(rules, n_rules);
+	for (i = 0; i < n_rules && !r; i++)
+		r = reglib_validate_rule(ctx, rules[i]);
+
+	free(rules);
+	return r;
+}
+
+static int reglib_validate_regdb_ctx(struct reglib_regdb_ctx *ctx)
+{
+	struct regdb_file_reg_rules_collection *rcoll;
+	uint32_t num_countries, n_colls, i, *colls;
+	uint64_t n_refs, n_coll_refs;
+	int r = -EINVAL;
+
+	num_countries = ntohl(ctx->header->reg_country_num);
+	ctx->countries = reglib_check_file_ptr(ctx,
+			(uint64_t) num_countries *
+			sizeof(struct regdb_file_reg_country),
+			ctx->header->reg_country_ptr);
+	if (!ctx->countries) {
+		fprintf(stderr, "Invalid database file, bad country list\n");
+		return -EINVAL;
+	}
+
+	/* The country list is in the db, so this fits */
+	colls = malloc((size_t) num_countries * sizeof(*colls) + 1);
+	if (!colls)
+		return -ENOMEM;
+
+	for (i = 0; i < num_countries; i++)
+		colls[i] = ctx->countries[i].reg_collection_ptr;
+	n_colls = reglib_unique_ptrs(colls, num_countries);
+
+	for (i = 0, n_coll_refs = 0; i < n_colls; i++) {
+		rcoll = reglib_validate_collection(ctx, colls[i]);
+		if (!rcoll) {
+			fprintf(stderr, "Invalid database file, bad rule "
+				"collection at %u\n", ntohl(colls[i]));
+			goto out;
+		}
+		n_coll_refs += ntohl(rcoll->reg_rule_num);
+	}
+
+	/* All collections are good, what the countries make of them */
+	for (i = 0, n_refs = 0; i < num_countries; i++) {
+		rcoll = (struct regdb_file_reg_rules_collection *)
+			(ctx->db + ntohl(ctx->countries[i].reg_collection_ptr));
+		n_refs += ntohl(rcoll->reg_rule_num);
+	}
+	if (n_refs > REGLIB_MAX_RULE_REFS) {
+		fprintf(stderr, "Invalid database file, the countries have "
+			"%llu rules, at most %u are supported\n",
+			(unsigned long long) n_refs, REGLIB_MAX_RULE_REFS);
+		goto out;
+	}
+
+	r = reglib_validate_rules(ctx, colls, n_colls, n_coll_refs);
+	if (r) {
+		if (r == -EINVAL)
+			fprintf(stderr, "Invalid database file, bad rule\n");
+		goto out;
 	}
 
+	ctx->num_countries = num_countries;
+	ctx->trusted = true;
+out:
+	free(colls);
+	return r;
+}
+
+/* Where @ptr points in the db of @ctx, checked unless validated already */
+static inline void *reglib_db_ptr(const struct reglib_regdb_ctx *ctx,
+				  size_t structlen, uint32_t ptr)
+{
+	if (ctx->trusted)
+		return ctx->db + ntohl(ptr);
+
+	return reglib_get_file_ptr(ctx->db, ctx->dblen, structlen, ptr);
+}
+
+/*
+ * The db is small and all of it is read to check the signature, so have
+ * the kernel map it in one go rather than take a page fault per page.
+ */
+#ifdef MAP_POPULATE
+#define REGLIB_MMAP_FLAGS	(MAP_PRIVATE | MAP_POPULATE)
+#else
+#define REGLIB_MMAP_FLAGS	MAP_PRIVATE
+#endif
+
+static const struct reglib_regdb_ctx *
+__reglib_malloc_regdb_ctx_fd(int fd, unsigned int flags)
+{
+	struct regdb_file_header *header;
+	struct reglib_regdb_ctx *ctx;
+	uint64_t start, ns;
+	bool verified;
+
+	reglib_stat_inc(ctx_opens, 1);
+	start = reglib_stat_clock();
+
+	ctx = malloc(sizeof(struct reglib_regdb_ctx));
+	if (!ctx)
+		return NULL;
+
+	memset(ctx, 0, sizeof(struct reglib_regdb_ctx));
+
+	ctx->fd = fd;
+
 	if (fstat(ctx->fd, &ctx->stat)) {
-		close(ctx->fd);
+		free(ctx);
+		return NULL;
+	}
+
+	/*
+	 * Not a db, and reglib_get_file_ptr() would exit() on it. A watched
+	 * db may well be caught empty or half written.
+	 */
+	if (ctx->stat.st_size < (off_t) sizeof(struct regdb_file_header) ||
+	    ctx->stat.st_size > UINT32_MAX) {
 		free(ctx);
 		return NULL;
 	}
@@ -233,9 +1159,8 @@ const struct reglib_regdb_ctx *reglib_malloc_regdb_ctx(const char *regdb_file)
 	ctx->real_dblen = ctx->stat.st_size;
 
 	ctx->db = mmap(NULL, ctx->real_dblen, PROT_READ,
-		       MAP_PRIVATE, ctx->fd, 0);
+		       REGLIB_MMAP_FLAGS, ctx->fd, 0);
 	if (ctx->db == MAP_FAILED) {
-		close(ctx->fd);
 		free(ctx);
 		return NULL;
 	}
@@ -259,154 +1184,743 @@ const struct reglib_regdb_ctx *reglib_malloc_regdb_ctx(const char *regdb_file)
 	/* The actual dblen does not take into account the signature */
 	ctx->dblen = ctx->real_dblen - ctx->siglen;
 
+	ns = reglib_stat_time(&reglib_stats.open_ns, start);
+	DTRACE_PROBE2(reglib, ctx_open, ctx->real_dblen, ns);
+
 	/* verify signature */
-	if (!reglib_verify_db_signature(ctx->db, ctx->dblen, ctx->siglen))
+	start = reglib_stat_clock();
+	if (flags & REGLIB_CTX_NO_VERIFY) {
+		if (reglib_hash_db(ctx->db, ctx->dblen, ctx->digest))
+			goto err_out;
+		reglib_stat_inc(bytes_hashed, ctx->dblen);
+	} else {
+		reglib_stat_inc(verifies, 1);
+		verified = reglib_verify_regdb_ctx(ctx);
+		ns = reglib_stat_time(&reglib_stats.verify_ns, start);
+		DTRACE_PROBE2(reglib, verify, verified, ns);
+		if (!verified)
+			goto err_out;
+		ctx->verified = true;
+	}
+
+	if (reglib_validate_regdb_ctx(ctx))
 		goto err_out;
 
-	ctx->verified = true;
-	ctx->num_countries = ntohl(header->reg_country_num);
-	ctx->countries = reglib_get_file_ptr(ctx->db,
-					     ctx->dblen,
-					     sizeof(struct regdb_file_reg_country) * ctx->num_countries,
-					     header->reg_country_ptr);
+	ctx->refcount = 1;
+	reglib_index_countries(ctx);
 	return ctx;
 
 err_out:
-	close(ctx->fd);
 	munmap(ctx->db, ctx->real_dblen);
 	free(ctx);
 	return NULL;
 }
 
-void reglib_free_regdb_ctx(const struct reglib_regdb_ctx *regdb_ctx)
+const struct reglib_regdb_ctx *reglib_malloc_regdb_ctx_fd(int fd)
 {
-	struct reglib_regdb_ctx *ctx;
-
-	if (!regdb_ctx)
-		return;
-
-	ctx = (struct reglib_regdb_ctx *) regdb_ctx;
-
-	memset(ctx, 0, sizeof(struct reglib_regdb_ctx));
-	close(ctx->fd);
-	munmap(ctx->db, ctx->real_dblen);
-	free(ctx);
+	return __reglib_malloc_regdb_ctx_fd(fd, 0);
 }
 
-static void reg_rule2rd(uint8_t *db, size_t dblen,
-	uint32_t ruleptr, struct ieee80211_reg_rule *rd_reg_rule)
+const struct reglib_regdb_ctx *
+reglib_malloc_regdb_ctx_fd_flags(int fd, unsigned int flags)
 {
-	struct regdb_file_reg_rule *rule;
-	struct regdb_file_freq_range *freq;
-	struct regdb_file_power_rule *power;
-
-	struct ieee80211_freq_range *rd_freq_range = &rd_reg_rule->freq_range;
-	struct ieee80211_power_rule *rd_power_rule = &rd_reg_rule->power_rule;
-
-	rule  = reglib_get_file_ptr(db, dblen, sizeof(*rule), ruleptr);
-	freq  = reglib_get_file_ptr(db, dblen, sizeof(*freq), rule->freq_range_ptr);
-	power = reglib_get_file_ptr(db, dblen, sizeof(*power), rule->power_rule_ptr);
+	return __reglib_malloc_regdb_ctx_fd(fd, flags);
+}
 
-	rd_freq_range->start_freq_khz = ntohl(freq->start_freq);
-	rd_freq_range->end_freq_khz = ntohl(freq->end_freq);
-	rd_freq_range->max_bandwidth_khz = ntohl(freq->max_bandwidth);
+const struct reglib_regdb_ctx *
+reglib_malloc_regdb_ctx_flags(const char *regdb_file, unsigned int flags)
+{
+	const struct reglib_regdb_ctx *ctx;
+	int fd;
 
-	rd_power_rule->max_antenna_gain = ntohl(power->max_antenna_gain);
-	rd_power_rule->max_eirp = ntohl(power->max_eirp);
+	fd = open(regdb_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
 
-	rd_reg_rule->flags = ntohl(rule->flags);
+	ctx = __reglib_malloc_regdb_ctx_fd(fd, flags);
+	if (!ctx)
+		close(fd);
 
-	if (rd_reg_rule->flags & RRF_NO_IR_ALL)
-		rd_reg_rule->flags |= RRF_NO_IR_ALL;
+	return ctx;
 }
 
-/* Converts a file regdomain to ieee80211_regdomain, easier to manage */
-const static struct ieee80211_regdomain *
-country2rd(const struct reglib_regdb_ctx *ctx,
-	   struct regdb_file_reg_country *country)
+const struct reglib_regdb_ctx *reglib_malloc_regdb_ctx(const char *regdb_file)
 {
-	struct regdb_file_reg_rules_collection *rcoll;
-	struct ieee80211_regdomain *rd;
-	unsigned int i, num_rules;
-	size_t size_of_rd;
-
-	rcoll = reglib_get_file_ptr(ctx->db, ctx->dblen, sizeof(*rcoll),
-				    country->reg_collection_ptr);
-	num_rules = ntohl(rcoll->reg_rule_num);
-	/* re-get pointer with sanity checking for num_rules */
-	rcoll = reglib_get_file_ptr(ctx->db, ctx->dblen,
-				    reglib_array_len(sizeof(*rcoll), num_rules,
-						     sizeof(uint32_t)),
-				    country->reg_collection_ptr);
+	return reglib_malloc_regdb_ctx_flags(regdb_file, 0);
+}
 
-	size_of_rd = reglib_array_len(sizeof(struct ieee80211_regdomain),
-				      num_rules,
-				      sizeof(struct ieee80211_reg_rule));
+const struct reglib_regdb_ctx *
+reglib_malloc_regdb_ctx_search(const char *const *paths, const char **path)
+{
+	const struct reglib_regdb_ctx *ctx;
+	int fd = -1;
 
-	rd = malloc(size_of_rd);
-	if (!rd)
+	for (; *paths; paths++) {
+		fd = open(*paths, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+			break;
+	}
+	if (fd < 0)
 		return NULL;
 
-	memset(rd, 0, size_of_rd);
+	if (path)
+		*path = *paths;
 
-	rd->alpha2[0] = country->alpha2[0];
-	rd->alpha2[1] = country->alpha2[1];
-	rd->dfs_region = country->creqs & 0x3;
-	rd->n_reg_rules = num_rules;
-
-	for (i = 0; i < num_rules; i++) {
-		reg_rule2rd(ctx->db, ctx->dblen, rcoll->reg_rule_ptrs[i],
-			&rd->reg_rules[i]);
+	ctx = reglib_malloc_regdb_ctx_fd(fd);
+	if (!ctx) {
+		close(fd);
+		errno = EINVAL;
 	}
 
-	return rd;
+	return ctx;
 }
 
-const struct ieee80211_regdomain *
-reglib_get_rd_idx(unsigned int idx, const struct reglib_regdb_ctx *ctx)
+const struct reglib_regdb_ctx *
+reglib_malloc_regdb_ctx_builtin(const struct reglib_regdb_builtin *builtin)
 {
-	struct regdb_file_reg_country *country;
+	struct reglib_regdb_ctx *ctx;
 
+	reglib_stat_inc(ctx_opens, 1);
+
+	ctx = calloc(1, sizeof(struct reglib_regdb_ctx));
 	if (!ctx)
 		return NULL;
 
-	if (idx >= ctx->num_countries)
-		return NULL;
+	/* regdb2c only writes out dbs it was able to verify and validate */
+	ctx->fd = -1;
+	ctx->db = (uint8_t *) builtin->db;
+	ctx->real_dblen = builtin->real_dblen;
+	ctx->siglen = builtin->siglen;
+	ctx->dblen = builtin->real_dblen - builtin->siglen;
+	ctx->verified = true;
+	ctx->trusted = true;
+	memcpy(ctx->digest, builtin->digest, REGLIB_DIGEST_LEN);
 
-	country = ctx->countries + idx;
+	ctx->header = (struct regdb_file_header *) ctx->db;
+	ctx->num_countries = builtin->compiled->n_countries;
+	ctx->countries = (struct regdb_file_reg_country *)
+		(ctx->db + ntohl(ctx->header->reg_country_ptr));
+	memcpy(ctx->alpha2_idx, builtin->alpha2_idx, sizeof(ctx->alpha2_idx));
+	ctx->world_idx = builtin->world_idx;
 
-	return country2rd(ctx, country);
+	ctx->compiled = (struct reglib_regdb_compiled *) builtin->compiled;
+	ctx->builtin = true;
+	ctx->refcount = 1;
+
+	return ctx;
 }
 
-const struct ieee80211_regdomain *
-reglib_get_rd_alpha2(const char *alpha2, const char *file)
+static void reglib_free_intersect_cache(struct reglib_intersect_cache *cache);
+
+void reglib_free_regdb_ctx(const struct reglib_regdb_ctx *regdb_ctx)
 {
-	const struct reglib_regdb_ctx *ctx;
-	const struct ieee80211_regdomain *rd = NULL;
-	struct regdb_file_reg_country *country;
-	bool found_country = false;
-	unsigned int i;
+	struct reglib_regdb_ctx *ctx;
 
-	ctx = reglib_malloc_regdb_ctx(file);
-	if (!ctx)
-		return NULL;
+	if (!regdb_ctx)
+		return;
 
-	for (i = 0; i < ctx->num_countries; i++) {
-		country = ctx->countries + i;
-		if (memcmp(country->alpha2, alpha2, 2) == 0) {
-			found_country = 1;
-			break;
-		}
-	}
+	ctx = (struct reglib_regdb_ctx *) regdb_ctx;
 
-	if (!found_country)
-		goto out;
+	if (__atomic_sub_fetch(&ctx->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
 
-	rd = country2rd(ctx, country);
-	if (!rd)
-		goto out;
+	reglib_free_intersect_cache(ctx->isect_cache);
+	if (!ctx->builtin) {
+		free(ctx->compiled);
+		close(ctx->fd);
+		munmap(ctx->db, ctx->real_dblen);
+	}
+	memset(ctx, 0, sizeof(struct reglib_regdb_ctx));
+	free(ctx);
+}
+
+const struct reglib_regdb_ctx *
+reglib_get_regdb_ctx(const struct reglib_regdb_ctx *regdb_ctx)
+{
+	struct reglib_regdb_ctx *ctx = (struct reglib_regdb_ctx *) regdb_ctx;
+
+	__atomic_add_fetch(&ctx->refcount, 1, __ATOMIC_RELAXED);
+
+	return regdb_ctx;
+}
+
+/*
+ * Regdb watch
+ *
+ * The watch holds a reference on the current context and readers take
+ * their own reference on it, so a context swapped out stays around until
+ * its last reader is done with it. What takes care is getting a reference
+ * on the current context while it is being swapped out: readers announce
+ * themselves on one of two counters, picked by the parity of the epoch,
+ * before loading the pointer. After publishing a new context the writer
+ * bumps the epoch and waits for the readers of the old parity to drain,
+ * then it does the same for the other one. A reader that loaded the old
+ * pointer was counted on either counter before the swap so it is waited
+ * for, and new readers go to the counter not waited on, so lookups never
+ * block and the writer does not starve.
+ */
+struct reglib_regdb_watch {
+	char *path;
+	const char *name;
+	int fd;
+	int wd;
+	const struct reglib_regdb_ctx *ctx;
+	unsigned int epoch;
+	unsigned int readers[2];
+};
+
+struct reglib_regdb_watch *
+reglib_malloc_regdb_watch(const char *regdb_file,
+			  const struct reglib_regdb_ctx *ctx)
+{
+	struct reglib_regdb_watch *watch;
+	char *slash;
+
+	watch = calloc(1, sizeof(*watch));
+	if (!watch)
+		return NULL;
+
+	/*
+	 * Packages replace the db by renaming a new file over it, so it is
+	 * the directory that gets watched for the name of the db.
+	 */
+	watch->path = malloc(strlen(regdb_file) + 3);
+	if (!watch->path)
+		goto err;
+	slash = strrchr(regdb_file, '/');
+	if (slash) {
+		strcpy(watch->path, regdb_file);
+		slash = watch->path + (slash - regdb_file);
+	} else {
+		sprintf(watch->path, "./%s", regdb_file);
+		slash = watch->path + 1;
+	}
+	watch->name = slash + 1;
+
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0)
+		goto err;
+
+	*slash = '\0';
+	watch->wd = inotify_add_watch(watch->fd,
+				      slash == watch->path ? "/" : watch->path,
+				      IN_CLOSE_WRITE | IN_MOVED_TO);
+	*slash = '/';
+	if (watch->wd < 0)
+		goto err_close;
+
+	watch->ctx = ctx ? ctx : reglib_malloc_regdb_ctx(watch->path);
+	if (!watch->ctx)
+		goto err_close;
+
+	return watch;
+
+err_close:
+	close(watch->fd);
+err:
+	free(watch->path);
+	free(watch);
+	return NULL;
+}
+
+void reglib_free_regdb_watch(struct reglib_regdb_watch *watch)
+{
+	if (!watch)
+		return;
+
+	reglib_free_regdb_ctx(watch->ctx);
+	close(watch->fd);
+	free(watch->path);
+	free(watch);
+}
+
+int reglib_regdb_watch_fd(const struct reglib_regdb_watch *watch)
+{
+	return watch->fd;
+}
+
+const struct reglib_regdb_ctx *
+reglib_regdb_watch_get(struct reglib_regdb_watch *watch)
+{
+	const struct reglib_regdb_ctx *ctx;
+	unsigned int idx;
+
+	idx = __atomic_load_n(&watch->epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&watch->readers[idx], 1, __ATOMIC_SEQ_CST);
+	ctx = __atomic_load_n(&watch->ctx, __ATOMIC_SEQ_CST);
+	reglib_get_regdb_ctx(ctx);
+	__atomic_sub_fetch(&watch->readers[idx], 1, __ATOMIC_RELEASE);
+
+	return ctx;
+}
+
+static void reglib_regdb_watch_publish(struct reglib_regdb_watch *watch,
+				       const struct reglib_regdb_ctx *ctx)
+{
+	const struct reglib_regdb_ctx *old;
+	unsigned int i, idx;
+
+	old = __atomic_exchange_n(&watch->ctx, ctx, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < 2; i++) {
+		idx = __atomic_fetch_add(&watch->epoch, 1,
+					 __ATOMIC_SEQ_CST) & 1;
+		while (__atomic_load_n(&watch->readers[idx], __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+
+	reglib_free_regdb_ctx(old);
+}
+
+int reglib_regdb_watch_reload(struct reglib_regdb_watch *watch)
+{
+	const struct reglib_regdb_ctx *ctx;
+
+	ctx = reglib_malloc_regdb_ctx(watch->path);
+	if (!ctx)
+		return -EINVAL;
+
+	if (!memcmp(reglib_regdb_digest(ctx), reglib_regdb_digest(watch->ctx),
+		    REGLIB_DIGEST_LEN)) {
+		reglib_free_regdb_ctx(ctx);
+		return 0;
+	}
+
+	reglib_regdb_watch_publish(watch, ctx);
+
+	return 1;
+}
+
+int reglib_regdb_watch_process(struct reglib_regdb_watch *watch)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	bool changed = false;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(watch->fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) p;
+			if (event->len && !strcmp(event->name, watch->name))
+				changed = true;
+		}
+	}
+	if (len < 0 && errno != EAGAIN && errno != EINTR)
+		return -errno;
+
+	if (!changed)
+		return 0;
+
+	return reglib_regdb_watch_reload(watch);
+}
+
+static void reg_rule2rd(const struct reglib_regdb_ctx *ctx,
+	uint32_t ruleptr, struct ieee80211_reg_rule *rd_reg_rule)
+{
+	struct regdb_file_reg_rule *rule;
+	struct regdb_file_freq_range *freq;
+	struct regdb_file_power_rule *power;
+
+	struct ieee80211_freq_range *rd_freq_range = &rd_reg_rule->freq_range;
+	struct ieee80211_power_rule *rd_power_rule = &rd_reg_rule->power_rule;
+
+	rule  = reglib_db_ptr(ctx, sizeof(*rule), ruleptr);
+	freq  = reglib_db_ptr(ctx, sizeof(*freq), rule->freq_range_ptr);
+	power = reglib_db_ptr(ctx, sizeof(*power), rule->power_rule_ptr);
+
+	rd_freq_range->start_freq_khz = ntohl(freq->start_freq);
+	rd_freq_range->end_freq_khz = ntohl(freq->end_freq);
+	rd_freq_range->max_bandwidth_khz = ntohl(freq->max_bandwidth);
+
+	rd_power_rule->max_antenna_gain = ntohl(power->max_antenna_gain);
+	rd_power_rule->max_eirp = ntohl(power->max_eirp);
+
+	rd_reg_rule->flags = ntohl(rule->flags);
+
+	if (rd_reg_rule->flags & RRF_NO_IR_ALL)
+		rd_reg_rule->flags |= RRF_NO_IR_ALL;
+}
+
+static int is_valid_reg_rule(const struct ieee80211_reg_rule *rule);
+
+static void reglib_country_view(const struct reglib_regdb_ctx *ctx,
+				struct regdb_file_reg_country *country,
+				struct reglib_rd_view *view)
+{
+	struct regdb_file_reg_rules_collection *rcoll;
+	unsigned int num_rules;
+
+	rcoll = reglib_db_ptr(ctx, sizeof(*rcoll), country->reg_collection_ptr);
+	num_rules = ntohl(rcoll->reg_rule_num);
+	/* re-get pointer with sanity checking for num_rules */
+	if (!ctx->trusted)
+		rcoll = reglib_get_file_ptr(ctx->db, ctx->dblen,
+					    reglib_array_len(sizeof(*rcoll),
+							     num_rules,
+							     sizeof(uint32_t)),
+					    country->reg_collection_ptr);
+
+	view->ctx = ctx;
+	view->reg_rule_ptrs = rcoll->reg_rule_ptrs;
+	view->n_reg_rules = num_rules;
+	view->alpha2[0] = country->alpha2[0];
+	view->alpha2[1] = country->alpha2[1];
+	view->dfs_region = country->creqs & 0x3;
+}
+
+int reglib_get_rd_view_idx(unsigned int idx,
+			   const struct reglib_regdb_ctx *ctx,
+			   struct reglib_rd_view *view)
+{
+	if (!ctx)
+		return -EINVAL;
+
+	if (idx >= ctx->num_countries)
+		return -ENOENT;
+
+	reglib_country_view(ctx, ctx->countries + idx, view);
+
+	return 0;
+}
+
+void reglib_rd_view_rule(const struct reglib_rd_view *view, unsigned int i,
+			 struct ieee80211_reg_rule *rule)
+{
+	memset(rule, 0, sizeof(*rule));
+	reg_rule2rd(view->ctx, view->reg_rule_ptrs[i], rule);
+}
+
+int reglib_is_valid_rd_view(const struct reglib_rd_view *view)
+{
+	struct ieee80211_reg_rule rule;
+	unsigned int i;
+
+	if (!view->n_reg_rules)
+		return 0;
+
+	reglib_for_each_rd_view_rule(&rule, i, view) {
+		if (!is_valid_reg_rule(&rule))
+			return 0;
+	}
+	return 1;
+}
+
+static struct ieee80211_regdomain *
+__reglib_rd_view2rd(const struct reglib_rd_view *view,
+		    struct reglib_arena *arena)
+{
+	struct ieee80211_regdomain *rd;
+	unsigned int i;
+	size_t size_of_rd;
+
+	size_of_rd = reglib_array_len(sizeof(struct ieee80211_regdomain),
+				      view->n_reg_rules,
+				      sizeof(struct ieee80211_reg_rule));
+
+	rd = reglib_zalloc(arena, size_of_rd);
+	if (!rd)
+		return NULL;
+
+	rd->alpha2[0] = view->alpha2[0];
+	rd->alpha2[1] = view->alpha2[1];
+	rd->dfs_region = view->dfs_region;
+	rd->n_reg_rules = view->n_reg_rules;
+
+	for (i = 0; i < view->n_reg_rules; i++)
+		reglib_rd_view_rule(view, i, &rd->reg_rules[i]);
+
+	return rd;
+}
+
+struct ieee80211_regdomain *
+reglib_rd_view2rd(const struct reglib_rd_view *view)
+{
+	return __reglib_rd_view2rd(view, NULL);
+}
+
+/*
+ * Compiled regdb. The rule pointers of all collections are sorted to find
+ * the distinct rules, each is decoded once into the rule arrays and the
+ * countries get the indexes of theirs. All arrays share one allocation.
+ */
+static uint32_t reglib_find_rule_ptr(const uint32_t *ptrs, uint32_t n,
+				     uint32_t ptr)
+{
+	uint32_t lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ntohl(ptrs[mid]) < ntohl(ptr))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Adds @n elements of @elemlen bytes to @size, false if it overflows */
+static bool reglib_size_add(size_t *size, uint64_t n, size_t elemlen)
+{
+	if (n > (SIZE_MAX - *size) / elemlen)
+		return false;
+
+	*size += n * elemlen;
+	return true;
+}
+
+static struct reglib_regdb_compiled *
+reglib_build_compiled(const struct reglib_regdb_ctx *ctx)
+{
+	struct reglib_regdb_compiled *compiled;
+	struct ieee80211_reg_rule rule;
+	struct reglib_rd_view view;
+	uint32_t *ptrs, n_rules, i, j, k;
+	uint64_t n_refs = 0;
+	size_t size = 0;
+	uint8_t *p;
+
+	/*
+	 * Countries can share a collection, so the references can add up to
+	 * more than the db has rules. The arrays are indexed by uint32_t.
+	 */
+	for (i = 0; i < ctx->num_countries; i++) {
+		reglib_get_rd_view_idx(i, ctx, &view);
+		n_refs += view.n_reg_rules;
+	}
+	if (n_refs > UINT32_MAX || !reglib_size_add(&size, n_refs,
+						    sizeof(*ptrs)))
+		return NULL;
+
+	ptrs = malloc(size);
+	if (!ptrs && n_refs)
+		return NULL;
+
+	for (i = 0, k = 0; i < ctx->num_countries; i++) {
+		reglib_get_rd_view_idx(i, ctx, &view);
+		memcpy(ptrs + k, view.reg_rule_ptrs,
+		       view.n_reg_rules * sizeof(*ptrs));
+		k += view.n_reg_rules;
+	}
+	n_rules = reglib_unique_ptrs(ptrs, n_refs);
+
+	size = sizeof(*compiled);
+	if (!reglib_size_add(&size, n_rules, 6 * sizeof(uint32_t)) ||
+	    !reglib_size_add(&size, (uint64_t) ctx->num_countries + 1,
+			     sizeof(uint32_t)) ||
+	    !reglib_size_add(&size, n_refs, sizeof(uint32_t)) ||
+	    !reglib_size_add(&size, ctx->num_countries, 3)) {
+		free(ptrs);
+		return NULL;
+	}
+
+	compiled = calloc(1, size);
+	if (!compiled) {
+		free(ptrs);
+		return NULL;
+	}
+
+	p = (uint8_t *) (compiled + 1);
+	compiled->n_rules = n_rules;
+	compiled->start_freq_khz = (uint32_t *) p;
+	compiled->end_freq_khz = compiled->start_freq_khz + n_rules;
+	compiled->max_bandwidth_khz = compiled->end_freq_khz + n_rules;
+	compiled->max_antenna_gain = compiled->max_bandwidth_khz + n_rules;
+	compiled->max_eirp = compiled->max_antenna_gain + n_rules;
+	compiled->flags = compiled->max_eirp + n_rules;
+	compiled->n_countries = ctx->num_countries;
+	compiled->rules_first = compiled->flags + n_rules;
+	compiled->rule_idx = compiled->rules_first + ctx->num_countries + 1;
+	compiled->alpha2 = (char (*)[2]) (compiled->rule_idx + n_refs);
+	compiled->dfs_region = (uint8_t *) (compiled->alpha2 +
+					    ctx->num_countries);
+
+	for (i = 0; i < n_rules; i++) {
+		memset(&rule, 0, sizeof(rule));
+		reg_rule2rd(ctx, ptrs[i], &rule);
+		compiled->start_freq_khz[i] = rule.freq_range.start_freq_khz;
+		compiled->end_freq_khz[i] = rule.freq_range.end_freq_khz;
+		compiled->max_bandwidth_khz[i] =
+			rule.freq_range.max_bandwidth_khz;
+		compiled->max_antenna_gain[i] =
+			rule.power_rule.max_antenna_gain;
+		compiled->max_eirp[i] = rule.power_rule.max_eirp;
+		compiled->flags[i] = rule.flags;
+	}
+
+	for (i = 0, k = 0; i < ctx->num_countries; i++) {
+		reglib_get_rd_view_idx(i, ctx, &view);
+		compiled->alpha2[i][0] = view.alpha2[0];
+		compiled->alpha2[i][1] = view.alpha2[1];
+		compiled->dfs_region[i] = view.dfs_region;
+		compiled->rules_first[i] = k;
+		for (j = 0; j < view.n_reg_rules; j++)
+			compiled->rule_idx[k++] =
+				reglib_find_rule_ptr(ptrs, n_rules,
+						     view.reg_rule_ptrs[j]);
+	}
+	compiled->rules_first[ctx->num_countries] = k;
+
+	free(ptrs);
+	return compiled;
+}
+
+const struct reglib_regdb_compiled *
+reglib_regdb_compile(const struct reglib_regdb_ctx *regdb_ctx)
+{
+	struct reglib_regdb_ctx *ctx = (struct reglib_regdb_ctx *) regdb_ctx;
+	struct reglib_regdb_compiled *compiled, *expected = NULL;
+
+	compiled = __atomic_load_n(&ctx->compiled, __ATOMIC_ACQUIRE);
+	if (compiled)
+		return compiled;
+
+	compiled = reglib_build_compiled(ctx);
+	if (!compiled)
+		return NULL;
+
+	/* Someone else may have beaten us to it */
+	if (!__atomic_compare_exchange_n(&ctx->compiled, &expected, compiled,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		free(compiled);
+		return expected;
+	}
+
+	return compiled;
+}
+
+static struct ieee80211_regdomain *
+reglib_compiled2rd(const struct reglib_regdb_compiled *compiled,
+		   unsigned int idx, struct reglib_arena *arena)
+{
+	struct ieee80211_regdomain *rd;
+	uint32_t i, first, n;
+
+	first = compiled->rules_first[idx];
+	n = compiled->rules_first[idx + 1] - first;
+
+	rd = reglib_zalloc(arena,
+			   reglib_array_len(sizeof(struct ieee80211_regdomain),
+					    n,
+					    sizeof(struct ieee80211_reg_rule)));
+	if (!rd)
+		return NULL;
+
+	rd->alpha2[0] = compiled->alpha2[idx][0];
+	rd->alpha2[1] = compiled->alpha2[idx][1];
+	rd->dfs_region = compiled->dfs_region[idx];
+	rd->n_reg_rules = n;
+
+	for (i = 0; i < n; i++)
+		reglib_compiled_rule(compiled, compiled->rule_idx[first + i],
+				     &rd->reg_rules[i]);
+
+	return rd;
+}
+
+/* Decodes the country at @idx, which must be in @ctx */
+static struct ieee80211_regdomain *
+reglib_decode_rd_idx(const struct reglib_regdb_ctx *ctx, unsigned int idx,
+		     struct reglib_arena *arena)
+{
+	const struct reglib_regdb_compiled *compiled;
+	struct ieee80211_regdomain *rd;
+	struct reglib_rd_view view;
+	uint64_t start, ns;
+
+	reglib_stat_inc(decodes, 1);
+	start = reglib_stat_clock();
+
+	compiled = __atomic_load_n(&ctx->compiled, __ATOMIC_ACQUIRE);
+	if (compiled) {
+		rd = reglib_compiled2rd(compiled, idx, arena);
+	} else {
+		reglib_get_rd_view_idx(idx, ctx, &view);
+		rd = __reglib_rd_view2rd(&view, arena);
+	}
+
+	ns = reglib_stat_time(&reglib_stats.decode_ns, start);
+	DTRACE_PROBE3(reglib, decode, idx, compiled != NULL, ns);
+
+	return rd;
+}
+
+const struct ieee80211_regdomain *
+reglib_get_rd_idx(unsigned int idx, const struct reglib_regdb_ctx *ctx)
+{
+	if (!ctx || idx >= ctx->num_countries)
+		return NULL;
+
+	return reglib_decode_rd_idx(ctx, idx, NULL);
+}
+
+/*
+ * Finds the index of @alpha2 in @ctx, through the direct index for the
+ * codes we index and by scanning the countries for anything else.
+ */
+static int reglib_find_alpha2_idx(const struct reglib_regdb_ctx *ctx,
+				  const char *alpha2, unsigned int *idx)
+{
+	uint32_t i;
+
+	if (reglib_is_alpha2(alpha2))
+		i = ctx->alpha2_idx[REGLIB_ALPHA2_IDX(alpha2)];
+	else if (reglib_is_world_regdom(alpha2))
+		i = ctx->world_idx;
+	else {
+		/* Not something we index, such as intersected domains */
+		for (i = 0; i < ctx->num_countries; i++) {
+			if (memcmp(ctx->countries[i].alpha2, alpha2, 2) == 0) {
+				*idx = i;
+				return 0;
+			}
+		}
+		return -ENOENT;
+	}
+
+	if (!i)
+		return -ENOENT;
+
+	*idx = i - 1;
+	return 0;
+}
+
+const struct ieee80211_regdomain *
+reglib_get_rd_alpha2_ctx(const struct reglib_regdb_ctx *ctx,
+			 const char *alpha2)
+{
+	unsigned int idx;
+	int r;
+
+	if (!ctx)
+		return NULL;
+
+	reglib_stat_inc(lookups, 1);
+	r = reglib_find_alpha2_idx(ctx, alpha2, &idx);
+	DTRACE_PROBE2(reglib, lookup, alpha2, r);
+	if (r) {
+		reglib_stat_inc(lookup_misses, 1);
+		return NULL;
+	}
+
+	return reglib_get_rd_idx(idx, ctx);
+}
+
+const struct ieee80211_regdomain *
+reglib_get_rd_alpha2(const char *alpha2, const char *file)
+{
+	const struct reglib_regdb_ctx *ctx;
+	const struct ieee80211_regdomain *rd;
+
+	ctx = reglib_malloc_regdb_ctx(file);
+	if (!ctx)
+		return NULL;
+
+	rd = reglib_get_rd_alpha2_ctx(ctx, alpha2);
 
-out:
 	reglib_free_regdb_ctx(ctx);
 	return rd;
 }
@@ -537,8 +2051,424 @@ static int reg_rules_intersect(const struct ieee80211_reg_rule *rule1,
 	return 0;
 }
 
-/**
- * reglib_intersect_rds - do the intersection between two regulatory domains
+/*
+ * Block intersection
+ *
+ * reg_rules_intersect() of one rule with each rule of a block. The
+ * intersection of a pair never ends up with a bandwidth larger than its
+ * frequency range, so of is_valid_reg_rule() only the start being set
+ * and the end being above it is left to check. Which of the kernels is
+ * used is decided on first use by what the CPU supports. The vector ones
+ * always go through whole vectors, rules beyond @n are in the block but
+ * their bits are dropped.
+ */
+typedef uint32_t (*reglib_block_fn)(const struct ieee80211_reg_rule *rule,
+				    const struct reglib_rule_block *block,
+				    unsigned int n,
+				    struct reglib_rule_block *out);
+
+static uint32_t
+reglib_intersect_block_scalar(const struct ieee80211_reg_rule *rule,
+			      const struct reglib_rule_block *block,
+			      unsigned int n, struct reglib_rule_block *out)
+{
+	uint32_t start, end, bw, mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		start = reglib_max(rule->freq_range.start_freq_khz,
+				   block->start_freq_khz[i]);
+		end = reglib_min(rule->freq_range.end_freq_khz,
+				 block->end_freq_khz[i]);
+		bw = reglib_min(rule->freq_range.max_bandwidth_khz,
+				block->max_bandwidth_khz[i]);
+
+		out->start_freq_khz[i] = start;
+		out->end_freq_khz[i] = end;
+		out->max_bandwidth_khz[i] = reglib_min(bw, end - start);
+		out->max_antenna_gain[i] =
+			reglib_min(rule->power_rule.max_antenna_gain,
+				   block->max_antenna_gain[i]);
+		out->max_eirp[i] = reglib_min(rule->power_rule.max_eirp,
+					      block->max_eirp[i]);
+		out->flags[i] = rule->flags | block->flags[i];
+
+		if (start && end > start)
+			mask |= 1U << i;
+	}
+
+	return mask;
+}
+
+#ifdef REGLIB_SIMD_X86
+#define REGLIB_LOAD128(p)	_mm_loadu_si128((const __m128i *) (p))
+#define REGLIB_STORE128(p, v)	_mm_storeu_si128((__m128i *) (p), v)
+#define REGLIB_LOAD256(p)	_mm256_loadu_si256((const __m256i *) (p))
+#define REGLIB_STORE256(p, v)	_mm256_storeu_si256((__m256i *) (p), v)
+
+__attribute__((target("sse4.1")))
+static uint32_t
+reglib_intersect_block_sse41(const struct ieee80211_reg_rule *rule,
+			     const struct reglib_rule_block *block,
+			     unsigned int n, struct reglib_rule_block *out)
+{
+	const __m128i bias = _mm_set1_epi32(INT32_MIN);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i s = _mm_set1_epi32(rule->freq_range.start_freq_khz);
+	__m128i e = _mm_set1_epi32(rule->freq_range.end_freq_khz);
+	__m128i b = _mm_set1_epi32(rule->freq_range.max_bandwidth_khz);
+	__m128i g = _mm_set1_epi32(rule->power_rule.max_antenna_gain);
+	__m128i p = _mm_set1_epi32(rule->power_rule.max_eirp);
+	__m128i f = _mm_set1_epi32(rule->flags);
+	__m128i start, end, bw, valid;
+	uint32_t mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i += 4) {
+		start = _mm_max_epu32(s, REGLIB_LOAD128(block->start_freq_khz + i));
+		end = _mm_min_epu32(e, REGLIB_LOAD128(block->end_freq_khz + i));
+		bw = _mm_min_epu32(b, REGLIB_LOAD128(block->max_bandwidth_khz + i));
+		bw = _mm_min_epu32(bw, _mm_sub_epi32(end, start));
+
+		REGLIB_STORE128(out->start_freq_khz + i, start);
+		REGLIB_STORE128(out->end_freq_khz + i, end);
+		REGLIB_STORE128(out->max_bandwidth_khz + i, bw);
+		REGLIB_STORE128(out->max_antenna_gain + i,
+			_mm_min_epu32(g, REGLIB_LOAD128(block->max_antenna_gain + i)));
+		REGLIB_STORE128(out->max_eirp + i,
+			_mm_min_epu32(p, REGLIB_LOAD128(block->max_eirp + i)));
+		REGLIB_STORE128(out->flags + i,
+			_mm_or_si128(f, REGLIB_LOAD128(block->flags + i)));
+
+		/* No unsigned compare, flip the sign bits for a signed one */
+		valid = _mm_andnot_si128(_mm_cmpeq_epi32(start, zero),
+					 _mm_cmpgt_epi32(_mm_xor_si128(end, bias),
+							 _mm_xor_si128(start, bias)));
+		mask |= (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(valid)) << i;
+	}
+
+	return mask & ((1U << n) - 1);
+}
+
+__attribute__((target("avx2")))
+static uint32_t
+reglib_intersect_block_avx2(const struct ieee80211_reg_rule *rule,
+			    const struct reglib_rule_block *block,
+			    unsigned int n, struct reglib_rule_block *out)
+{
+	const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i s = _mm256_set1_epi32(rule->freq_range.start_freq_khz);
+	__m256i e = _mm256_set1_epi32(rule->freq_range.end_freq_khz);
+	__m256i b = _mm256_set1_epi32(rule->freq_range.max_bandwidth_khz);
+	__m256i g = _mm256_set1_epi32(rule->power_rule.max_antenna_gain);
+	__m256i p = _mm256_set1_epi32(rule->power_rule.max_eirp);
+	__m256i f = _mm256_set1_epi32(rule->flags);
+	__m256i start, end, bw, valid;
+	uint32_t mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i += 8) {
+		start = _mm256_max_epu32(s, REGLIB_LOAD256(block->start_freq_khz + i));
+		end = _mm256_min_epu32(e, REGLIB_LOAD256(block->end_freq_khz + i));
+		bw = _mm256_min_epu32(b, REGLIB_LOAD256(block->max_bandwidth_khz + i));
+		bw = _mm256_min_epu32(bw, _mm256_sub_epi32(end, start));
+
+		REGLIB_STORE256(out->start_freq_khz + i, start);
+		REGLIB_STORE256(out->end_freq_khz + i, end);
+		REGLIB_STORE256(out->max_bandwidth_khz + i, bw);
+		REGLIB_STORE256(out->max_antenna_gain + i,
+			_mm256_min_epu32(g, REGLIB_LOAD256(block->max_antenna_gain + i)));
+		REGLIB_STORE256(out->max_eirp + i,
+			_mm256_min_epu32(p, REGLIB_LOAD256(block->max_eirp + i)));
+		REGLIB_STORE256(out->flags + i,
+			_mm256_or_si256(f, REGLIB_LOAD256(block->flags + i)));
+
+		valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(start, zero),
+					    _mm256_cmpgt_epi32(_mm256_xor_si256(end, bias),
+							       _mm256_xor_si256(start, bias)));
+		mask |= (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(valid)) << i;
+	}
+
+	return mask & ((1U << n) - 1);
+}
+#endif
+
+#ifdef REGLIB_SIMD_NEON
+static uint32_t
+reglib_intersect_block_neon(const struct ieee80211_reg_rule *rule,
+			    const struct reglib_rule_block *block,
+			    unsigned int n, struct reglib_rule_block *out)
+{
+	static const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+	const uint32x4_t bits = vld1q_u32(lane_bits);
+	uint32x4_t s = vdupq_n_u32(rule->freq_range.start_freq_khz);
+	uint32x4_t e = vdupq_n_u32(rule->freq_range.end_freq_khz);
+	uint32x4_t b = vdupq_n_u32(rule->freq_range.max_bandwidth_khz);
+	uint32x4_t g = vdupq_n_u32(rule->power_rule.max_antenna_gain);
+	uint32x4_t p = vdupq_n_u32(rule->power_rule.max_eirp);
+	uint32x4_t f = vdupq_n_u32(rule->flags);
+	uint32x4_t start, end, bw, valid;
+	uint32_t mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i += 4) {
+		start = vmaxq_u32(s, vld1q_u32(block->start_freq_khz + i));
+		end = vminq_u32(e, vld1q_u32(block->end_freq_khz + i));
+		bw = vminq_u32(b, vld1q_u32(block->max_bandwidth_khz + i));
+		bw = vminq_u32(bw, vsubq_u32(end, start));
+
+		vst1q_u32(out->start_freq_khz + i, start);
+		vst1q_u32(out->end_freq_khz + i, end);
+		vst1q_u32(out->max_bandwidth_khz + i, bw);
+		vst1q_u32(out->max_antenna_gain + i,
+			  vminq_u32(g, vld1q_u32(block->max_antenna_gain + i)));
+		vst1q_u32(out->max_eirp + i,
+			  vminq_u32(p, vld1q_u32(block->max_eirp + i)));
+		vst1q_u32(out->flags + i,
+			  vorrq_u32(f, vld1q_u32(block->flags + i)));
+
+		valid = vbicq_u32(vcgtq_u32(end, start),
+				  vceqq_u32(start, vdupq_n_u32(0)));
+		mask |= vaddvq_u32(vandq_u32(valid, bits)) << i;
+	}
+
+	return mask & ((1U << n) - 1);
+}
+#endif
+
+static reglib_block_fn reglib_block_impl;
+
+static reglib_block_fn reglib_pick_block_fn(void)
+{
+#if defined(REGLIB_SIMD_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return reglib_intersect_block_avx2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return reglib_intersect_block_sse41;
+#elif defined(REGLIB_SIMD_NEON)
+	return reglib_intersect_block_neon;
+#endif
+	return reglib_intersect_block_scalar;
+}
+
+uint32_t reglib_intersect_rule_block(const struct ieee80211_reg_rule *rule,
+				     const struct reglib_rule_block *block,
+				     unsigned int n,
+				     struct reglib_rule_block *out)
+{
+	reglib_block_fn fn;
+
+	if (n > REGLIB_RULE_BLOCK)
+		n = REGLIB_RULE_BLOCK;
+
+	/* Racing threads all pick the same one */
+	fn = __atomic_load_n(&reglib_block_impl, __ATOMIC_RELAXED);
+	if (!fn) {
+		fn = reglib_pick_block_fn();
+		__atomic_store_n(&reglib_block_impl, fn, __ATOMIC_RELAXED);
+	}
+
+	return fn(rule, block, n, out);
+}
+
+/*
+ * Intersection sweep
+ *
+ * Two rules can only intersect if their frequency ranges overlap, any
+ * other pair makes reg_rules_intersect() fail. Visiting the rules of
+ * both domains in order of their start frequency lets us skip all of
+ * those pairs: for each rule of the first domain we start from the first
+ * rule of the second one that does not end before it and stop at the
+ * first one that starts after it ends. As the rules of the first domain
+ * are visited with increasing start frequencies rules of the second one
+ * that end before the current one starts can be dropped for good. For
+ * domains without overlapping rules this is linear in the number of
+ * rules of both domains plus the number of intersections.
+ *
+ * Only pairs which cannot intersect are skipped, and the pairs that are
+ * left get computed by reglib_intersect_rule_block() in blocks of the
+ * candidates for each rule of the first domain, so the result is the
+ * same as intersecting all pairs in turn. Domains are normally
+ * sorted already; if one is not we sweep over a sorted order of its
+ * rules and then put the resulting rules back into the order the nested
+ * loop over both domains would have produced.
+ */
+struct reglib_rule_order {
+	uint32_t start_freq_khz;
+	uint32_t idx;
+};
+
+struct reglib_sweep_result {
+	uint64_t key;
+	uint32_t pos;
+};
+
+#define SWEEP_IDX(order, i) ((order) ? (order)[i].idx : (i))
+
+static bool reglib_rules_sorted(const struct ieee80211_regdomain *rd)
+{
+	unsigned int i;
+
+	for (i = 1; i < rd->n_reg_rules; i++) {
+		if (rd->reg_rules[i].freq_range.start_freq_khz <
+		    rd->reg_rules[i - 1].freq_range.start_freq_khz)
+			return false;
+	}
+
+	return true;
+}
+
+static int reglib_rule_order_cmp(const void *a, const void *b)
+{
+	const struct reglib_rule_order *o1 = a, *o2 = b;
+
+	if (o1->start_freq_khz != o2->start_freq_khz)
+		return o1->start_freq_khz < o2->start_freq_khz ? -1 : 1;
+	return o1->idx < o2->idx ? -1 : o1->idx > o2->idx;
+}
+
+static int reglib_sweep_result_cmp(const void *a, const void *b)
+{
+	const struct reglib_sweep_result *r1 = a, *r2 = b;
+
+	return r1->key < r2->key ? -1 : r1->key > r2->key;
+}
+
+/* Returns NULL in @order if the domain is sorted already */
+static int reglib_sort_rules(const struct ieee80211_regdomain *rd,
+			     struct reglib_arena *arena,
+			     struct reglib_rule_order **order)
+{
+	unsigned int i;
+
+	*order = NULL;
+
+	if (reglib_rules_sorted(rd))
+		return 0;
+
+	*order = reglib_zalloc(arena,
+			       reglib_array_len(0, rd->n_reg_rules,
+						sizeof(struct reglib_rule_order)));
+	if (!*order)
+		return -ENOMEM;
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		(*order)[i].start_freq_khz =
+			rd->reg_rules[i].freq_range.start_freq_khz;
+		(*order)[i].idx = i;
+	}
+
+	qsort(*order, rd->n_reg_rules, sizeof(struct reglib_rule_order),
+	      reglib_rule_order_cmp);
+
+	return 0;
+}
+
+/*
+ * Computes the valid intersections between the rules of both domains.
+ * If @rules is NULL this only counts them, otherwise they are written to
+ * @rules which must have room for one more rule than there are valid
+ * intersections. If @results is given it gets the position in the nested
+ * loop order for each of them.
+ */
+struct reglib_sweep_block {
+	struct reglib_rule_block in;
+	struct reglib_rule_block out;
+	uint32_t y_idx[REGLIB_RULE_BLOCK];
+	unsigned int n;
+};
+
+/* Intersects @rule1 with the candidates gathered in @block */
+static unsigned int
+reglib_sweep_flush(const struct ieee80211_reg_rule *rule1, uint32_t x_idx,
+		   const struct ieee80211_regdomain *rd2,
+		   struct reglib_sweep_block *block,
+		   struct ieee80211_reg_rule *rules,
+		   struct reglib_sweep_result *results,
+		   unsigned int num_rules)
+{
+	uint32_t mask;
+	unsigned int i;
+
+	mask = reglib_intersect_rule_block(rule1, &block->in, block->n,
+					   &block->out);
+	for (i = 0; i < block->n; i++) {
+		if (!(mask & (1U << i)))
+			continue;
+
+		if (rules)
+			reglib_rule_block_get(&block->out, i,
+					      &rules[num_rules]);
+		if (results) {
+			results[num_rules].key =
+				(uint64_t) x_idx * rd2->n_reg_rules +
+				block->y_idx[i];
+			results[num_rules].pos = num_rules;
+		}
+		num_rules++;
+	}
+	block->n = 0;
+
+	return num_rules;
+}
+
+static unsigned int
+reglib_sweep_intersect(const struct ieee80211_regdomain *rd1,
+		       const struct reglib_rule_order *order1,
+		       const struct ieee80211_regdomain *rd2,
+		       const struct reglib_rule_order *order2,
+		       struct ieee80211_reg_rule *rules,
+		       struct reglib_sweep_result *results)
+{
+	const struct ieee80211_reg_rule *rule1, *rule2;
+	struct reglib_sweep_block block;
+	unsigned int x, y, lo = 0, num_rules = 0;
+	uint32_t x_idx, y_idx;
+
+	/* The kernels read whole blocks, don't have them read garbage */
+	memset(&block, 0, sizeof(block));
+
+	for (x = 0; x < rd1->n_reg_rules; x++) {
+		x_idx = SWEEP_IDX(order1, x);
+		rule1 = &rd1->reg_rules[x_idx];
+
+		while (lo < rd2->n_reg_rules &&
+		       rd2->reg_rules[SWEEP_IDX(order2, lo)].freq_range.end_freq_khz <=
+		       rule1->freq_range.start_freq_khz)
+			lo++;
+
+		for (y = lo; y < rd2->n_reg_rules; y++) {
+			y_idx = SWEEP_IDX(order2, y);
+			rule2 = &rd2->reg_rules[y_idx];
+
+			if (rule2->freq_range.start_freq_khz >=
+			    rule1->freq_range.end_freq_khz)
+				break;
+			if (rule2->freq_range.end_freq_khz <=
+			    rule1->freq_range.start_freq_khz)
+				continue;
+
+			reglib_rule_block_set(&block.in, block.n, rule2);
+			block.y_idx[block.n++] = y_idx;
+			if (block.n == REGLIB_RULE_BLOCK)
+				num_rules = reglib_sweep_flush(rule1, x_idx, rd2,
+							       &block, rules,
+							       results,
+							       num_rules);
+		}
+		if (block.n)
+			num_rules = reglib_sweep_flush(rule1, x_idx, rd2,
+						       &block, rules, results,
+						       num_rules);
+	}
+
+	return num_rules;
+}
+
+/**
+ * reglib_intersect_rds - do the intersection between two regulatory domains
  * @rd1: first regulatory domain
  * @rd2: second regulatory domain
  *
@@ -550,123 +2480,144 @@ static int reg_rules_intersect(const struct ieee80211_reg_rule *rule1,
  * resulting intersection of rules between rd1 and rd2. We will
  * malloc() this structure for you.
  */
-struct ieee80211_regdomain *
-reglib_intersect_rds(const struct ieee80211_regdomain *rd1,
-		     const struct ieee80211_regdomain *rd2)
+static struct ieee80211_regdomain *
+__reglib_intersect_rds(const struct ieee80211_regdomain *rd1,
+		       const struct ieee80211_regdomain *rd2,
+		       struct reglib_arena *arena)
 {
-	int r;
 	size_t size_of_regd;
-	unsigned int x, y;
-	unsigned int num_rules = 0, rule_idx = 0;
-	const struct ieee80211_reg_rule *rule1, *rule2;
-	struct ieee80211_reg_rule *intersected_rule;
-	struct ieee80211_regdomain *rd;
-	/* This is just a dummy holder to help us count */
-	struct ieee80211_reg_rule irule;
-
-	/* Uses the stack temporarily for counter arithmetic */
-	intersected_rule = &irule;
-
-	memset(intersected_rule, 0, sizeof(struct ieee80211_reg_rule));
+	unsigned int i, num_rules, rule_idx;
+	struct reglib_rule_order *order1 = NULL, *order2 = NULL;
+	struct reglib_sweep_result *results = NULL;
+	struct ieee80211_reg_rule *rules = NULL;
+	struct ieee80211_regdomain *rd = NULL;
 
 	if (!rd1 || !rd2)
 		return NULL;
 
+	if (reglib_sort_rules(rd1, arena, &order1) ||
+	    reglib_sort_rules(rd2, arena, &order2))
+		goto out;
+
 	/* First we get a count of the rules we'll need, then we actually
 	 * build them. This is to so we can malloc() and free() a
-	 * regdomain once. The reason we use reg_rules_intersect() here
-	 * is it will return -EINVAL if the rule computed makes no sense.
-	 * All rules that do check out OK are valid. */
-
-	for (x = 0; x < rd1->n_reg_rules; x++) {
-		rule1 = &rd1->reg_rules[x];
-		for (y = 0; y < rd2->n_reg_rules; y++) {
-			rule2 = &rd2->reg_rules[y];
-			if (!reg_rules_intersect(rule1, rule2,
-					intersected_rule))
-				num_rules++;
-			memset(intersected_rule, 0,
-					sizeof(struct ieee80211_reg_rule));
-		}
-	}
-
+	 * regdomain once. */
+	num_rules = reglib_sweep_intersect(rd1, order1, rd2, order2,
+					   NULL, NULL);
 	if (!num_rules)
-		return NULL;
+		goto out;
 
 	size_of_regd = reglib_array_len(sizeof(struct ieee80211_regdomain),
 					num_rules + 1,
 					sizeof(struct ieee80211_reg_rule));
 
-	rd = malloc(size_of_regd);
+	rd = reglib_zalloc(arena, size_of_regd);
 	if (!rd)
-		return NULL;
+		goto out;
 
-	memset(rd, 0, size_of_regd);
+	if (!order1 && !order2) {
+		/* The sweep visits pairs in the nested loop order */
+		rule_idx = reglib_sweep_intersect(rd1, NULL, rd2, NULL,
+						  rd->reg_rules, NULL);
+	} else {
+		rules = reglib_zalloc(arena,
+				      reglib_array_len(0, num_rules + 1,
+						       sizeof(*rules)));
+		results = reglib_zalloc(arena,
+					reglib_array_len(0, num_rules,
+							 sizeof(*results)));
+		if (!rules || !results) {
+			reglib_release(arena, rd);
+			rd = NULL;
+			goto out;
+		}
 
-	for (x = 0; x < rd1->n_reg_rules; x++) {
-		rule1 = &rd1->reg_rules[x];
-		for (y = 0; y < rd2->n_reg_rules; y++) {
-			rule2 = &rd2->reg_rules[y];
-			/* This time around instead of using the stack lets
-			 * write to the target rule directly saving ourselves
-			 * a memcpy() */
-			intersected_rule = &rd->reg_rules[rule_idx];
-			r = reg_rules_intersect(rule1, rule2,
-				intersected_rule);
-			if (r)
-				continue;
-			rule_idx++;
+		rule_idx = reglib_sweep_intersect(rd1, order1, rd2, order2,
+						  rules, results);
+		if (rule_idx == num_rules) {
+			qsort(results, num_rules, sizeof(*results),
+			      reglib_sweep_result_cmp);
+			for (i = 0; i < num_rules; i++)
+				rd->reg_rules[i] = rules[results[i].pos];
 		}
 	}
 
 	if (rule_idx != num_rules) {
-		free(rd);
-		return NULL;
+		reglib_release(arena, rd);
+		rd = NULL;
+		goto out;
 	}
 
 	rd->n_reg_rules = num_rules;
 	rd->alpha2[0] = '9';
 	rd->alpha2[1] = '9';
 
+out:
+	reglib_release(arena, results);
+	reglib_release(arena, rules);
+	reglib_release(arena, order2);
+	reglib_release(arena, order1);
 	return rd;
 }
 
-const struct ieee80211_regdomain *
-reglib_intersect_regdb(const struct reglib_regdb_ctx *ctx)
+struct ieee80211_regdomain *
+reglib_intersect_rds(const struct ieee80211_regdomain *rd1,
+		     const struct ieee80211_regdomain *rd2)
 {
-	const struct ieee80211_regdomain *rd;
+	return __reglib_intersect_rds(rd1, rd2, NULL);
+}
+
+struct ieee80211_regdomain *
+reglib_intersect_rds_arena(const struct ieee80211_regdomain *rd1,
+			   const struct ieee80211_regdomain *rd2,
+			   struct reglib_arena *arena)
+{
+	return __reglib_intersect_rds(rd1, rd2, arena);
+}
+
+static const struct ieee80211_regdomain *
+__reglib_intersect_regdb(const struct reglib_regdb_ctx *ctx,
+			 struct reglib_arena *arena)
+{
+	struct ieee80211_regdomain *rd;
 	struct ieee80211_regdomain *prev_rd_intsct = NULL, *rd_intsct = NULL;
 	int intersected = 0;
-	unsigned int idx = 0;
+	unsigned int idx;
 
 	if (!ctx)
 		return NULL;
 
-	reglib_for_each_country(rd, idx, ctx) {
-		if (reglib_is_world_regdom((const char *) rd->alpha2)) {
-			free((struct ieee80211_regdomain *) rd);
+	for (idx = 0; idx < ctx->num_countries; idx++) {
+		if (reglib_is_world_regdom((const char *)
+					   ctx->countries[idx].alpha2))
 			continue;
+
+		rd = reglib_decode_rd_idx(ctx, idx, arena);
+		if (!rd) {
+			reglib_release(arena, prev_rd_intsct);
+			reglib_release(arena, rd_intsct);
+			return NULL;
 		}
 
 		if (!prev_rd_intsct) {
-			prev_rd_intsct = (struct ieee80211_regdomain *) rd;
+			prev_rd_intsct = rd;
 			continue;
 		}
 
 		if (rd_intsct) {
-			free(prev_rd_intsct);
-			prev_rd_intsct = (struct ieee80211_regdomain *) rd_intsct;
+			reglib_release(arena, prev_rd_intsct);
+			prev_rd_intsct = rd_intsct;
 		}
 
-		rd_intsct = reglib_intersect_rds(prev_rd_intsct, rd);
+		rd_intsct = __reglib_intersect_rds(prev_rd_intsct, rd, arena);
 		if (!rd_intsct) {
-			free(prev_rd_intsct);
-			free((struct ieee80211_regdomain *) rd);
+			reglib_release(arena, prev_rd_intsct);
+			reglib_release(arena, rd);
 			return NULL;
 		}
 
 		intersected++;
-		free((struct ieee80211_regdomain *) rd);
+		reglib_release(arena, rd);
 	}
 
 	if (!idx)
@@ -676,659 +2627,3349 @@ reglib_intersect_regdb(const struct reglib_regdb_ctx *ctx)
 		rd_intsct = prev_rd_intsct;
 		prev_rd_intsct = NULL;
 		if (idx > 1) {
-			free(rd_intsct);
+			reglib_release(arena, rd_intsct);
 			return NULL;
 		}
 	}
 
 	if (prev_rd_intsct)
-		free(prev_rd_intsct);
+		reglib_release(arena, prev_rd_intsct);
 
 	return rd_intsct;
 }
 
-static const char *dfs_domain_name(enum regdb_dfs_regions region)
+const struct ieee80211_regdomain *
+reglib_intersect_regdb(const struct reglib_regdb_ctx *ctx)
 {
-	switch (region) {
-	case REGDB_DFS_UNSET:
-		return "DFS-UNSET";
-	case REGDB_DFS_FCC:
-		return "DFS-FCC";
-	case REGDB_DFS_ETSI:
-		return "DFS-ETSI";
-	case REGDB_DFS_JP:
-		return "DFS-JP";
-	default:
-		return "DFS-invalid";
-	}
+	return __reglib_intersect_regdb(ctx, NULL);
 }
 
-static void print_reg_rule(const struct ieee80211_reg_rule *rule)
+const struct ieee80211_regdomain *
+reglib_intersect_regdb_arena(const struct reglib_regdb_ctx *ctx,
+			     struct reglib_arena *arena)
 {
-	const struct ieee80211_freq_range *freq;
-	const struct ieee80211_power_rule *power;
+	return __reglib_intersect_regdb(ctx, arena);
+}
 
-	freq  = &rule->freq_range;
-	power = &rule->power_rule;
+static const struct ieee80211_regdomain *
+__reglib_intersect_alpha2_set(const struct reglib_regdb_ctx *ctx,
+			      const char *const *codes, unsigned int n,
+			      struct reglib_arena *arena)
+{
+	struct ieee80211_regdomain *rd, *rd_intsct = NULL, *tmp;
+	unsigned int i, idx;
 
-	printf("\t(%.3f - %.3f @ %.3f), ",
-	       ((float)(freq->start_freq_khz))/1000.0,
-	       ((float)(freq->end_freq_khz))/1000.0,
-	       ((float)(freq->max_bandwidth_khz))/1000.0);
+	if (!ctx || !n)
+		return NULL;
 
-	printf("(");
+	/* Only decode anything once we know all codes are there */
+	for (i = 0; i < n; i++) {
+		if (reglib_find_alpha2_idx(ctx, codes[i], &idx))
+			return NULL;
+	}
 
-	if (power->max_eirp)
-		printf("%.2f)", ((float)(power->max_eirp)/100.0));
-	else
-		printf("N/A)");
+	for (i = 0; i < n; i++) {
+		reglib_find_alpha2_idx(ctx, codes[i], &idx);
 
-	if (rule->dfs_cac_ms)
-		printf(", (%u)", rule->dfs_cac_ms);
-	else
-		printf(", (N/A)");
+		rd = reglib_decode_rd_idx(ctx, idx, arena);
+		if (!rd) {
+			reglib_release(arena, rd_intsct);
+			return NULL;
+		}
 
-	if (rule->flags & RRF_NO_OFDM)
-		printf(", NO-OFDM");
-	if (rule->flags & RRF_NO_CCK)
-		printf(", NO-CCK");
-	if (rule->flags & RRF_NO_INDOOR)
-		printf(", NO-INDOOR");
-	if (rule->flags & RRF_NO_OUTDOOR)
-		printf(", NO-OUTDOOR");
-	if (rule->flags & RRF_DFS)
-		printf(", DFS");
-	if (rule->flags & RRF_PTP_ONLY)
-		printf(", PTP-ONLY");
-	if (rule->flags & RRF_PTMP_ONLY)
-		printf(", PTMP-ONLY");
-	if (rule->flags & RRF_NO_IR_ALL)
-		printf(", NO-IR");
-	if (rule->flags & RRF_AUTO_BW)
-		printf(", AUTO-BW");
+		if (!rd_intsct) {
+			rd_intsct = rd;
+			continue;
+		}
+
+		tmp = __reglib_intersect_rds(rd_intsct, rd, arena);
+		reglib_release(arena, rd_intsct);
+		reglib_release(arena, rd);
+		if (!tmp)
+			return NULL;
+		rd_intsct = tmp;
+	}
 
-	printf("\n");
+	return rd_intsct;
 }
 
-void reglib_print_regdom(const struct ieee80211_regdomain *rd)
+const struct ieee80211_regdomain *
+reglib_intersect_alpha2_set(const struct reglib_regdb_ctx *ctx,
+			    const char *const *codes, unsigned int n)
 {
-	unsigned int i;
-	printf("country %.2s: %s\n", rd->alpha2,
-	       dfs_domain_name(rd->dfs_region));
-	for (i = 0; i < rd->n_reg_rules; i++)
-		print_reg_rule(&rd->reg_rules[i]);
-	printf("\n");
+	return __reglib_intersect_alpha2_set(ctx, codes, n, NULL);
 }
 
-static unsigned int reglib_parse_dfs_region(char *dfs_region)
+const struct ieee80211_regdomain *
+reglib_intersect_alpha2_set_arena(const struct reglib_regdb_ctx *ctx,
+				  const char *const *codes, unsigned int n,
+				  struct reglib_arena *arena)
 {
-	if (!dfs_region)
-		return REGDB_DFS_UNSET;
-
-	if (strstr(dfs_region, "DFS-FCC"))
-		return REGDB_DFS_FCC;
-	if (strstr(dfs_region, "DFS-ETSI"))
-		return REGDB_DFS_ETSI;
-	if (strstr(dfs_region, "DFS-JP"))
-		return REGDB_DFS_JP;
-	return REGDB_DFS_UNSET;
+	return __reglib_intersect_alpha2_set(ctx, codes, n, arena);
 }
 
-static uint32_t reglib_parse_rule_flag(char *flag_s)
-{
-	uint32_t flags = 0;
+/*
+ * Intersection cache of a regdb context. Entries are kept on a hash table
+ * for lookups and on a list in LRU order for eviction. The domain a user
+ * gets is stored right after its entry, each user and the cache itself
+ * holding a reference. The references are atomic so that a user can drop
+ * theirs without the cache, which may be gone with its context by then.
+ */
+#define REGLIB_ISECT_CACHE_ENTRIES	64
+#define REGLIB_ISECT_CACHE_BUCKETS	128
+
+struct reglib_isect_entry {
+	struct reglib_isect_entry *hnext;
+	struct reglib_isect_entry *prev, *next;
+	uint32_t hash;
+	unsigned int refcount;
+	unsigned int n;
+	const uint8_t *key;
+};
 
-	if (strstr(flag_s, "NO-OFDM"))
-		flags |= RRF_NO_OFDM;
-	if (strstr(flag_s, "NO-CCK"))
-		flags |= RRF_NO_CCK;
-	if (strstr(flag_s, "NO-INDOOR"))
-		flags |= RRF_NO_INDOOR;
-	if (strstr(flag_s, "NO-OUTDOOR"))
-		flags |= RRF_NO_OUTDOOR;
-	if (strstr(flag_s, "DFS"))
-		flags |= RRF_DFS;
-	if (strstr(flag_s, "PTP-ONLY"))
-		flags |= RRF_PTP_ONLY;
-	if (strstr(flag_s, "PTMP-ONLY"))
-		flags |= RRF_PTMP_ONLY;
-	if (strstr(flag_s, "NO-IR"))
-		flags |= RRF_NO_IR;
-	if (strstr(flag_s, "AUTO-BW"))
-		flags |= RRF_AUTO_BW;
+struct reglib_intersect_cache {
+	pthread_mutex_t lock;
+	unsigned int n_entries;
+	struct reglib_isect_entry *head, *tail;
+	struct reglib_isect_entry *buckets[REGLIB_ISECT_CACHE_BUCKETS];
+};
 
-	return flags;
-}
+#define ISECT_ENTRY_RD(__e)						\
+	((struct ieee80211_regdomain *) ((__e) + 1))
+#define RD_ISECT_ENTRY(__rd)						\
+	((struct reglib_isect_entry *) (__rd) - 1)
 
-static int reglib_parse_rule(FILE *fp, struct ieee80211_reg_rule *reg_rule)
+static void reglib_put_isect_entry(struct reglib_isect_entry *e)
 {
-	char line[1024];
-	char *line_p;
-	int hits, r = 0;
-	float start_freq_khz, end_freq_khz, max_bandwidth_khz, max_eirp;
-	unsigned int dfs_cac_ms = 0;
-
-	memset(line, 0, sizeof(line));
-	line_p = fgets(line, sizeof(line), fp);
-	if (line_p != line)
-		return -EINVAL;
+	if (__atomic_sub_fetch(&e->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(e);
+}
 
-	/* First get start, end and bandwidth */
-	hits = sscanf(line_p, "\t(%f - %f @ %f),",
-		      &start_freq_khz,
-		      &end_freq_khz,
-		      &max_bandwidth_khz);
+void reglib_put_cached_rd(const struct ieee80211_regdomain *rd)
+{
+	if (rd)
+		reglib_put_isect_entry(RD_ISECT_ENTRY(rd));
+}
 
-	if (hits != 3)
-		return -EINVAL;
+static void reglib_free_intersect_cache(struct reglib_intersect_cache *cache)
+{
+	struct reglib_isect_entry *e, *next;
 
-	reg_rule->freq_range.start_freq_khz =
-		REGLIB_MHZ_TO_KHZ(start_freq_khz);
-	reg_rule->freq_range.end_freq_khz =
-		REGLIB_MHZ_TO_KHZ(end_freq_khz);
-	reg_rule->freq_range.max_bandwidth_khz =
-		REGLIB_MHZ_TO_KHZ(max_bandwidth_khz);
+	if (!cache)
+		return;
 
-	/* Next get eirp */
-	strsep(&line_p, ",");
-	if (!line_p) {
-		fprintf(stderr, "not found eirp in line: %s\n", line);
-		return -EINVAL;
+	for (e = cache->head; e; e = next) {
+		next = e->next;
+		reglib_put_isect_entry(e);
 	}
 
-	if (strstr(line_p, "mW")) {
-		hits = sscanf(line_p, " (%f mW)", &max_eirp);
-		if (hits != 1)
-			return -EINVAL;
-		reg_rule->power_rule.max_eirp =
-			REGLIB_MW_TO_MBM(max_eirp);
-	} else {
-		hits = sscanf(line_p, " (%f)", &max_eirp);
-		if (hits != 1)
-			return -EINVAL;
-		reg_rule->power_rule.max_eirp =
-			REGLIB_DBM_TO_MBM(max_eirp);
-	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
 
-	/* Next get optional arguments (flags ...) */
-	strsep(&line_p, ",");
-	if (line_p) {
-		/* Check DFS CAC time */
-		hits = sscanf(line_p, " (%u)", &dfs_cac_ms);
-		if (hits == 1)
-			reg_rule->dfs_cac_ms = dfs_cac_ms;
+static struct reglib_intersect_cache *
+reglib_get_intersect_cache(const struct reglib_regdb_ctx *regdb_ctx)
+{
+	struct reglib_regdb_ctx *ctx = (struct reglib_regdb_ctx *) regdb_ctx;
+	struct reglib_intersect_cache *cache, *expected = NULL;
 
-		/* Check flags */
-		reg_rule->flags = reglib_parse_rule_flag(line_p);
+	cache = __atomic_load_n(&ctx->isect_cache, __ATOMIC_ACQUIRE);
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	/* Someone else may have beaten us to it */
+	if (!__atomic_compare_exchange_n(&ctx->isect_cache, &expected, cache,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		reglib_free_intersect_cache(cache);
+		return expected;
 	}
 
-	return r;
+	return cache;
 }
 
-static uint32_t
-reglib_get_n_rules(FILE *fp, struct ieee80211_reg_rule *reg_rule)
+static void reglib_isect_lru_unlink(struct reglib_intersect_cache *cache,
+				    struct reglib_isect_entry *e)
 {
-	uint32_t n_rules = 0;
-	int r;
-	bool save_debug = false;
-
-	save_debug = debug;
-	debug = false;
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->tail = e->prev;
+	e->prev = e->next = NULL;
+}
 
-	while (1) {
-		r = reglib_parse_rule(fp, reg_rule);
-		if (r != 0)
-			break;
-		n_rules++;
-	}
+static void reglib_isect_lru_push(struct reglib_intersect_cache *cache,
+				  struct reglib_isect_entry *e)
+{
+	e->next = cache->head;
+	if (cache->head)
+		cache->head->prev = e;
+	else
+		cache->tail = e;
+	cache->head = e;
+}
+
+static struct reglib_isect_entry *
+reglib_isect_lookup(struct reglib_intersect_cache *cache, uint32_t hash,
+		    const uint8_t *key, unsigned int n)
+{
+	struct reglib_isect_entry *e;
 
-	debug = save_debug;
+	for (e = cache->buckets[hash % REGLIB_ISECT_CACHE_BUCKETS]; e;
+	     e = e->hnext) {
+		if (e->hash == hash && e->n == n &&
+		    memcmp(e->key, key, 2 * n) == 0)
+			return e;
+	}
 
-	return n_rules;
+	return NULL;
 }
 
-static int reglib_parse_reg_rule(FILE *fp, struct ieee80211_reg_rule *reg_rule)
+static void reglib_isect_evict(struct reglib_intersect_cache *cache)
 {
-	int r;
+	struct reglib_isect_entry *e = cache->tail, **p;
 
-	while (1) {
-		r = reglib_parse_rule(fp, reg_rule);
-		if (r != 0)
-			continue;
-		return 0;
-	}
+	p = &cache->buckets[e->hash % REGLIB_ISECT_CACHE_BUCKETS];
+	while (*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+
+	reglib_isect_lru_unlink(cache, e);
+	cache->n_entries--;
+	reglib_put_isect_entry(e);
 }
 
-static struct ieee80211_regdomain *
-reglib_parse_rules(FILE *fp, struct ieee80211_regdomain *trd)
+static int reglib_alpha2_ptr_cmp(const void *a, const void *b)
 {
-	struct ieee80211_regdomain *rd;
-	struct ieee80211_reg_rule rule;
-	struct ieee80211_reg_rule *reg_rule;
-	fpos_t pos;
-	unsigned int i;
-	uint32_t size_of_regd = 0, num_rules = 0;
-	int r;
+	return memcmp(*(const char *const *) a, *(const char *const *) b, 2);
+}
 
-	memset(&rule, 0, sizeof(rule));
-	reg_rule = &rule;
+/* FNV-1a */
+static uint32_t reglib_hash_bytes(const uint8_t *key, unsigned int len)
+{
+	uint32_t hash = 2166136261u;
+	unsigned int i;
 
-	r = fgetpos(fp, &pos);
-	if (r != 0) {
-		fprintf(stderr, "fgetpos() failed: %s\n",
-			strerror(errno));
-		return NULL;
+	for (i = 0; i < len; i++) {
+		hash ^= key[i];
+		hash *= 16777619u;
 	}
 
-	num_rules = reglib_get_n_rules(fp, reg_rule);
-	if (!num_rules)
+	return hash;
+}
+
+const struct ieee80211_regdomain *
+reglib_intersect_alpha2_set_cached(const struct reglib_regdb_ctx *ctx,
+				   const char *const *codes, unsigned int n)
+{
+	struct reglib_intersect_cache *cache;
+	struct reglib_isect_entry *e = NULL, *found;
+	const struct ieee80211_regdomain *rd = NULL;
+	const char **sorted;
+	size_t size_of_rd;
+	uint8_t *key;
+	uint32_t hash;
+	unsigned int i, k;
+
+	if (!ctx || !n)
 		return NULL;
 
-	size_of_regd = reglib_array_len(sizeof(struct ieee80211_regdomain),
-					num_rules + 1,
-					sizeof(struct ieee80211_reg_rule));
-	rd = malloc(size_of_regd);
-	if (!rd)
+	cache = reglib_get_intersect_cache(ctx);
+	if (!cache)
 		return NULL;
 
-	memset(rd, 0, size_of_regd);
-	memcpy(rd, trd, sizeof(*trd));
+	/* Any permutation of a set with or without duplicates is one entry */
+	sorted = malloc(reglib_array_len(0, n, sizeof(*sorted)));
+	key = malloc(reglib_array_len(0, n, 2));
+	if (!sorted || !key)
+		goto out;
 
-	rd->n_reg_rules = num_rules;
+	memcpy(sorted, codes, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), reglib_alpha2_ptr_cmp);
+	for (i = 0, k = 0; i < n; i++) {
+		if (k && memcmp(sorted[k - 1], sorted[i], 2) == 0)
+			continue;
+		sorted[k] = sorted[i];
+		memcpy(&key[2 * k], sorted[i], 2);
+		k++;
+	}
+	hash = reglib_hash_bytes(key, 2 * k);
+
+	pthread_mutex_lock(&cache->lock);
+	e = reglib_isect_lookup(cache, hash, key, k);
+	if (e) {
+		reglib_isect_lru_unlink(cache, e);
+		reglib_isect_lru_push(cache, e);
+		__atomic_add_fetch(&e->refcount, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&cache->lock);
 
-	r = fsetpos(fp, &pos);
-	if (r != 0) {
-		fprintf(stderr, "fsetpos() failed: %s\n",
-			strerror(errno));
-		free(rd);
-		return NULL;
+	if (e) {
+		rd = ISECT_ENTRY_RD(e);
+		goto out;
 	}
-	for (i = 0; i < num_rules; i++) {
-		struct ieee80211_reg_rule *rrule = &rd->reg_rules[i];
 
-		if (reglib_parse_reg_rule(fp, rrule) != 0) {
-			fprintf(stderr, "rule parse failed\n");
-			free(rd);
-			return NULL;
-		}
+	/* Not cached, intersect without holding the lock */
+	rd = __reglib_intersect_alpha2_set(ctx, sorted, k, NULL);
+	if (!rd)
+		goto out;
+
+	size_of_rd = reglib_array_len(sizeof(struct ieee80211_regdomain),
+				      rd->n_reg_rules,
+				      sizeof(struct ieee80211_reg_rule));
+	e = malloc(sizeof(*e) + size_of_rd + 2 * k);
+	if (!e) {
+		free((struct ieee80211_regdomain *) rd);
+		rd = NULL;
+		goto out;
+	}
+
+	memset(e, 0, sizeof(*e));
+	memcpy(ISECT_ENTRY_RD(e), rd, size_of_rd);
+	free((struct ieee80211_regdomain *) rd);
+	rd = ISECT_ENTRY_RD(e);
+
+	memcpy((uint8_t *) rd + size_of_rd, key, 2 * k);
+	e->key = (uint8_t *) rd + size_of_rd;
+	e->n = k;
+	e->hash = hash;
+	/* One for the cache, one for our caller */
+	e->refcount = 2;
+
+	pthread_mutex_lock(&cache->lock);
+	found = reglib_isect_lookup(cache, hash, key, k);
+	if (found) {
+		/* Lost a race against another caller, use theirs */
+		__atomic_add_fetch(&found->refcount, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&cache->lock);
+		free(e);
+		rd = ISECT_ENTRY_RD(found);
+		goto out;
 	}
+
+	if (cache->n_entries == REGLIB_ISECT_CACHE_ENTRIES)
+		reglib_isect_evict(cache);
+
+	e->hnext = cache->buckets[hash % REGLIB_ISECT_CACHE_BUCKETS];
+	cache->buckets[hash % REGLIB_ISECT_CACHE_BUCKETS] = e;
+	reglib_isect_lru_push(cache, e);
+	cache->n_entries++;
+	pthread_mutex_unlock(&cache->lock);
+
+out:
+	free(key);
+	free(sorted);
 	return rd;
 }
 
-static int reglib_parse_country_dfs(char *line, struct ieee80211_regdomain *rd)
+/*
+ * Runs @fn on up to @nthreads threads, the calling thread being one of
+ * them, and waits for all of them to finish. @fn is expected to pull
+ * work from @data until there is none left, so should we fail to start
+ * some threads the work still gets done by the others.
+ */
+static void reglib_run_threads(unsigned int nthreads, void *(*fn)(void *),
+			       void *data)
 {
-	char dfs_region_alpha[9];
-	char alpha2[2];
-	int hits;
+	pthread_t threads[nthreads];
+	unsigned int i, started = 0;
 
-	memset(rd, 0, sizeof(*rd));
-	memset(alpha2, 0, sizeof(alpha2));
-	memset(dfs_region_alpha, 0, sizeof(dfs_region_alpha));
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, fn, data))
+			break;
+		started++;
+	}
+
+	fn(data);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static unsigned int reglib_nthreads(unsigned int nthreads)
+{
+	long n;
+
+	if (nthreads)
+		return nthreads;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+int reglib_parse_nthreads(const char *arg, unsigned int *nthreads)
+{
+	unsigned long n;
+	char *end;
 
-	hits = sscanf(line, "country %2[a-zA-Z0-9]:%*[ ]%s\n",
-		      alpha2,
-		      dfs_region_alpha);
-	if (hits <= 0)
+	/* strtoul() would take leading blanks and a sign */
+	if (*arg < '0' || *arg > '9')
 		return -EINVAL;
 
-	rd->alpha2[0] = alpha2[0];
-	rd->alpha2[1] = alpha2[1];
-	rd->dfs_region = reglib_parse_dfs_region(dfs_region_alpha);
+	errno = 0;
+	n = strtoul(arg, &end, 10);
+	if (*end || errno || n > REGLIB_MAX_THREADS)
+		return -EINVAL;
 
+	*nthreads = n;
 	return 0;
 }
 
-struct ieee80211_regdomain *__reglib_parse_country(FILE *fp)
+/*
+ * Parallel intersection of a regdb
+ *
+ * Intersections are associative, and reglib_intersect_rds() emits rules
+ * in the order of the pairs of rules they came from. So intersecting
+ * neighbouring domains pairwise, and then neighbouring results
+ * pairwise, and so on, yields the very same domain as folding all of
+ * them into one accumulator from left to right. Each level of that
+ * tree is done in parallel, after decoding all countries in parallel.
+ *
+ * The tree is reduced in place in @rds: at level @stride the domain
+ * at i, for each i which is a multiple of 2 * stride, gets intersected
+ * with the one at i + stride.
+ */
+struct reglib_intersect_reduce {
+	const struct reglib_regdb_ctx *ctx;
+	unsigned int *country_idx;
+	struct ieee80211_regdomain **rds;
+	unsigned int n;
+
+	pthread_mutex_t lock;
+	unsigned int stride;
+	unsigned int next;
+	bool failed;
+};
+
+static bool reglib_reduce_next(struct reglib_intersect_reduce *reduce,
+			       unsigned int *i)
+{
+	unsigned int step = reduce->stride ? 2 * reduce->stride : 1;
+	bool ok = false;
+
+	pthread_mutex_lock(&reduce->lock);
+	while (!reduce->failed && reduce->next < reduce->n) {
+		*i = reduce->next;
+		reduce->next += step;
+		if (reduce->stride && *i + reduce->stride >= reduce->n)
+			continue;
+		ok = true;
+		break;
+	}
+	pthread_mutex_unlock(&reduce->lock);
+
+	return ok;
+}
+
+static void *reglib_intersect_reduce_thread(void *data)
 {
+	struct reglib_intersect_reduce *reduce = data;
 	struct ieee80211_regdomain *rd;
-	struct ieee80211_regdomain tmp_rd;
-	char line[1024];
-	char *line_p;
-	int r = 0;
+	unsigned int i;
+
+	while (reglib_reduce_next(reduce, &i)) {
+		if (!reduce->stride) {
+			rd = reglib_decode_rd_idx(reduce->ctx,
+						  reduce->country_idx[i],
+						  NULL);
+		} else {
+			rd = reglib_intersect_rds(reduce->rds[i],
+				reduce->rds[i + reduce->stride]);
+			free(reduce->rds[i]);
+			free(reduce->rds[i + reduce->stride]);
+			reduce->rds[i + reduce->stride] = NULL;
+		}
+		reduce->rds[i] = rd;
+		if (!rd) {
+			pthread_mutex_lock(&reduce->lock);
+			reduce->failed = true;
+			pthread_mutex_unlock(&reduce->lock);
+		}
+	}
 
-	memset(&tmp_rd, 0, sizeof(tmp_rd));
-	memset(line, 0, sizeof(line));
+	return NULL;
+}
 
-	line_p = fgets(line, sizeof(line), fp);
+const struct ieee80211_regdomain *
+reglib_intersect_regdb_parallel(const struct reglib_regdb_ctx *ctx,
+				unsigned int nthreads)
+{
+	struct reglib_intersect_reduce reduce;
+	struct ieee80211_regdomain *rd = NULL;
+	unsigned int i;
 
-	if (line_p != line) {
+	if (!ctx || !ctx->num_countries)
 		return NULL;
+
+	memset(&reduce, 0, sizeof(reduce));
+	reduce.ctx = ctx;
+
+	reduce.country_idx = malloc(reglib_array_len(0, ctx->num_countries,
+						     sizeof(unsigned int)));
+	reduce.rds = malloc(reglib_array_len(0, ctx->num_countries,
+					     sizeof(struct ieee80211_regdomain *)));
+	if (!reduce.country_idx || !reduce.rds)
+		goto out;
+
+	for (i = 0; i < ctx->num_countries; i++) {
+		if (reglib_is_world_regdom((const char *) ctx->countries[i].alpha2))
+			continue;
+		reduce.rds[reduce.n] = NULL;
+		reduce.country_idx[reduce.n++] = i;
 	}
 
-	/* Country */
-	r = reglib_parse_country_dfs(line_p, &tmp_rd);
-	if (r != 0) {
-		fprintf(stderr, "Invalid country line: %s", line);
-		return NULL;
+	/*
+	 * Same as reglib_intersect_regdb(), a single country gets returned
+	 * as is, but only if it is the only entry in the db at all.
+	 */
+	if (!reduce.n || (reduce.n == 1 && ctx->num_countries > 1))
+		goto out;
+
+	nthreads = reglib_nthreads(nthreads);
+	if (nthreads > reduce.n)
+		nthreads = reduce.n;
+
+	pthread_mutex_init(&reduce.lock, NULL);
+
+	/* Stride 0 decodes the countries, then the levels of the tree */
+	do {
+		reduce.next = 0;
+		reglib_run_threads(nthreads, reglib_intersect_reduce_thread,
+				   &reduce);
+		reduce.stride = reduce.stride ? 2 * reduce.stride : 1;
+	} while (!reduce.failed && reduce.stride < reduce.n);
+
+	if (!reduce.failed) {
+		rd = reduce.rds[0];
+		reduce.rds[0] = NULL;
 	}
 
-	/* Rules */
-	rd = reglib_parse_rules(fp, &tmp_rd);
+	pthread_mutex_destroy(&reduce.lock);
 
+	for (i = 0; i < reduce.n; i++)
+		free(reduce.rds[i]);
+out:
+	free(reduce.rds);
+	free(reduce.country_idx);
 	return rd;
 }
 
-static int reglib_find_next_country_stream(FILE *fp)
+/*
+ * Intersection matrix
+ *
+ * Each country is decoded once and its rules are put in blocks for
+ * reglib_intersect_rule_block(). A pair of countries is then every rule
+ * of one against each block of the other, the valid intersections are
+ * only accounted to the bands and never make it to a domain. Threads take
+ * rows, the one which takes row i does all pairs of i with the countries
+ * from i on and fills in both halves of the matrix for them, so no two
+ * threads write the same cell.
+ */
+struct reglib_matrix_country {
+	struct ieee80211_regdomain *rd;
+	struct reglib_rule_block *blocks;
+	unsigned int n_blocks;
+};
+
+struct reglib_matrix_span {
+	uint32_t start_freq_khz;
+	uint32_t end_freq_khz;
+	uint32_t max_eirp;
+};
+
+struct reglib_matrix {
+	struct reglib_matrix_country *countries;
+	unsigned int n;
+	unsigned int max_rules;
+	const struct reglib_band *bands;
+	unsigned int n_bands;
+	struct reglib_matrix_cell *cells;
+	unsigned int next;
+};
+
+static int reglib_matrix_country(const struct reglib_regdb_ctx *ctx,
+				 unsigned int idx,
+				 struct reglib_matrix_country *country)
 {
-	fpos_t prev_pos;
-	int r;
-	unsigned int i = 0;
+	struct ieee80211_regdomain *rd;
+	unsigned int i;
 
-	while(1) {
-		char line[1024];
-		char *line_p;
+	rd = reglib_decode_rd_idx(ctx, idx, NULL);
+	if (!rd)
+		return -ENOMEM;
 
-		r = fgetpos(fp, &prev_pos);
-		if (r != 0) {
-			fprintf(stderr, "fgetpos() failed: %s\n",
-				strerror(errno));
-			return r;
-		}
+	country->rd = rd;
+	country->n_blocks = (rd->n_reg_rules + REGLIB_RULE_BLOCK - 1) /
+			    REGLIB_RULE_BLOCK;
+	/* Zeroed, the kernels read the unused end of the last block */
+	country->blocks = calloc(country->n_blocks,
+				 sizeof(struct reglib_rule_block));
+	if (!country->blocks && country->n_blocks)
+		return -ENOMEM;
 
-		memset(line, 0, sizeof(line));
+	for (i = 0; i < rd->n_reg_rules; i++)
+		reglib_rule_block_set(&country->blocks[i / REGLIB_RULE_BLOCK],
+				      i % REGLIB_RULE_BLOCK,
+				      &rd->reg_rules[i]);
 
-		line_p = fgets(line, sizeof(line), fp);
-		if (line_p == line) {
-			if (strspn(line, "\n") == strlen(line)) {
-				i++;
-				continue;
-			}
-			if (strncmp(line, "country", 7) != 0)
+	return 0;
+}
+
+static int reglib_matrix_span_cmp(const void *a, const void *b)
+{
+	const struct reglib_matrix_span *s1 = a, *s2 = b;
+
+	if (s1->start_freq_khz != s2->start_freq_khz)
+		return s1->start_freq_khz < s2->start_freq_khz ? -1 : 1;
+	return s1->end_freq_khz < s2->end_freq_khz ? -1 :
+	       s1->end_freq_khz > s2->end_freq_khz;
+}
+
+/* Accounts the spans, sorted by their start, to each band */
+static void reglib_matrix_account(const struct reglib_matrix *matrix,
+				  const struct reglib_matrix_span *spans,
+				  unsigned int n_spans,
+				  struct reglib_matrix_cell *cells)
+{
+	const struct reglib_band *band;
+	uint32_t start, end, covered;
+	unsigned int i, b;
+
+	for (b = 0; b < matrix->n_bands; b++) {
+		band = &matrix->bands[b];
+		covered = band->start_freq_khz;
+		cells[b].spectrum_khz = 0;
+		cells[b].max_eirp = 0;
+
+		for (i = 0; i < n_spans; i++) {
+			start = reglib_max(spans[i].start_freq_khz,
+					   band->start_freq_khz);
+			end = reglib_min(spans[i].end_freq_khz,
+					 band->end_freq_khz);
+			if (end <= start)
 				continue;
-			r = fsetpos(fp, &prev_pos);
-			if (r != 0) {
-				fprintf(stderr, "fsetpos() failed: %s\n",
-					strerror(errno));
-				return r;
+
+			/* Rules may overlap, count what they cover once */
+			start = reglib_max(start, covered);
+			if (end > start) {
+				cells[b].spectrum_khz += end - start;
+				covered = end;
 			}
-			return 0;
-		} else
-			return EOF;
+			cells[b].max_eirp = reglib_max(cells[b].max_eirp,
+						       spans[i].max_eirp);
+		}
 	}
 }
 
-struct ieee80211_regdomain *reglib_parse_country(FILE *fp)
+static void reglib_matrix_pair(const struct reglib_matrix *matrix,
+			       unsigned int x, unsigned int y,
+			       struct reglib_matrix_span *spans)
 {
-	int r;
+	const struct reglib_matrix_country *c1 = &matrix->countries[x];
+	const struct reglib_matrix_country *c2 = &matrix->countries[y];
+	struct reglib_matrix_cell *cells, *mirror;
+	struct reglib_rule_block out;
+	unsigned int i, k, n, bit, n_spans = 0;
+	uint32_t mask;
+
+	for (i = 0; i < c1->rd->n_reg_rules; i++) {
+		for (k = 0; k < c2->n_blocks; k++) {
+			n = reglib_min(c2->rd->n_reg_rules -
+				       k * REGLIB_RULE_BLOCK,
+				       REGLIB_RULE_BLOCK);
+			mask = reglib_intersect_rule_block(&c1->rd->reg_rules[i],
+							   &c2->blocks[k], n,
+							   &out);
+			for (bit = 0; mask; bit++, mask >>= 1) {
+				if (!(mask & 1))
+					continue;
+				spans[n_spans].start_freq_khz =
+					out.start_freq_khz[bit];
+				spans[n_spans].end_freq_khz =
+					out.end_freq_khz[bit];
+				spans[n_spans].max_eirp = out.max_eirp[bit];
+				n_spans++;
+			}
+		}
+	}
 
-	r = reglib_find_next_country_stream(fp);
-	if (r != 0)
-		return NULL;
-	return __reglib_parse_country(fp);
+	qsort(spans, n_spans, sizeof(*spans), reglib_matrix_span_cmp);
+
+	cells = matrix->cells + ((size_t) x * matrix->n + y) * matrix->n_bands;
+	mirror = matrix->cells + ((size_t) y * matrix->n + x) * matrix->n_bands;
+	reglib_matrix_account(matrix, spans, n_spans, cells);
+	if (mirror != cells)
+		memcpy(mirror, cells, matrix->n_bands * sizeof(*cells));
 }
 
-FILE *reglib_create_parse_stream(FILE *f)
+static void *reglib_matrix_thread(void *data)
 {
-	unsigned int lines = 0;
-	FILE *fp;
+	struct reglib_matrix *matrix = data;
+	struct reglib_matrix_span *spans;
+	unsigned int x, y;
 
-	fp = tmpfile();
-	if (errno) {
-		fprintf(stderr, "%s\n", strerror(errno));
+	spans = malloc(reglib_array_len(0, matrix->max_rules * matrix->max_rules,
+					sizeof(*spans)));
+	if (!spans)
 		return NULL;
+
+	while ((x = __atomic_fetch_add(&matrix->next, 1,
+				       __ATOMIC_RELAXED)) < matrix->n) {
+		for (y = x; y < matrix->n; y++)
+			reglib_matrix_pair(matrix, x, y, spans);
 	}
 
-	while(1) {
-		char line[1024];
-		char *line_p;
+	free(spans);
+	return NULL;
+}
 
-		line_p = fgets(line, sizeof(line), f);
-		if (line_p == line) {
-			if (strchr(line, '#') == NULL) {
-				fputs(line, fp);
-				lines++;
-			}
-			continue;
-		} else
-			break;
+int reglib_intersect_matrix(const struct reglib_regdb_ctx *ctx,
+			    const struct reglib_band *bands,
+			    unsigned int n_bands,
+			    struct reglib_matrix_cell *cells,
+			    unsigned int nthreads)
+{
+	struct reglib_matrix matrix;
+	unsigned int i;
+	int r = 0;
+
+	if (!ctx || !cells || (n_bands && !bands))
+		return -EINVAL;
+
+	if (!ctx->num_countries)
+		return 0;
+
+	memset(&matrix, 0, sizeof(matrix));
+	matrix.n = ctx->num_countries;
+	matrix.bands = bands;
+	matrix.n_bands = n_bands;
+	matrix.cells = cells;
+
+	matrix.countries = calloc(matrix.n, sizeof(*matrix.countries));
+	if (!matrix.countries)
+		return -ENOMEM;
+
+	/* All countries get decoded, might as well do it off the compiled form */
+	reglib_regdb_compile(ctx);
+
+	for (i = 0; i < matrix.n; i++) {
+		r = reglib_matrix_country(ctx, i, &matrix.countries[i]);
+		if (r)
+			goto out;
+		matrix.max_rules = reglib_max(matrix.max_rules,
+					      matrix.countries[i].rd->n_reg_rules);
 	}
 
-	rewind(fp);
-	fflush(fp);
+	/* Each thread has room for all pairs of rules of two countries */
+	if (matrix.max_rules > UINT16_MAX) {
+		r = -E2BIG;
+		goto out;
+	}
 
-	return fp;
+	nthreads = reglib_nthreads(nthreads);
+	if (nthreads > matrix.n)
+		nthreads = matrix.n;
+
+	reglib_run_threads(nthreads, reglib_matrix_thread, &matrix);
+
+	/*
+	 * A thread without scratch space does no rows, they were all done
+	 * unless every one of them failed.
+	 */
+	if (matrix.next < matrix.n)
+		r = -ENOMEM;
+
+out:
+	for (i = 0; i < matrix.n; i++) {
+		free(matrix.countries[i].blocks);
+		free(matrix.countries[i].rd);
+	}
+	free(matrix.countries);
+	return r;
 }
 
 /*
- * Just whatever for now, nothing formal, but note that as bands
- * grow we'll want to make this a bit more formal somehow.
+ * Diff
+ *
+ * Two dbs are compared through the alpha2 index of each, so every alpha2
+ * gets looked at once whatever order the countries are in. A country in
+ * both is decoded from each and the two are told apart by the hash of
+ * their canonical rule sets, the rules sorted by all of their members
+ * with duplicates dropped, so that writing the same rules differently
+ * does not count as a change.
  */
-static uint32_t reglib_deduce_band(uint32_t start_freq_khz)
-{
-	uint32_t freq_mhz = REGLIB_KHZ_TO_MHZ(start_freq_khz);
+#define REGLIB_RULE_WORDS	8
 
-	if (freq_mhz >= 4000)
-		return 5;
-	if (freq_mhz > 2000 && freq_mhz < 4000)
-		return 2;
-	if (freq_mhz > 50000)
-		return 60;
-	return 1234;
+static void reglib_rule_words(const struct ieee80211_reg_rule *rule,
+			      uint32_t *words)
+{
+	words[0] = rule->freq_range.start_freq_khz;
+	words[1] = rule->freq_range.end_freq_khz;
+	words[2] = rule->freq_range.max_bandwidth_khz;
+	words[3] = rule->power_rule.max_antenna_gain;
+	words[4] = rule->power_rule.max_eirp;
+	words[5] = rule->flags;
+	words[6] = rule->dfs_cac_ms;
+	words[7] = 0;
 }
 
-/*
- * The idea behind a rule key is that if two rule keys share the
- * same key they can be merged together if their frequencies overlap.
- */
-static uint64_t reglib_rule_key(struct ieee80211_reg_rule *reg_rule)
+static int reglib_rule_canon_cmp(const void *a, const void *b)
 {
-	struct ieee80211_power_rule *power_rule;
-	struct ieee80211_freq_range *freq_range;
-	uint32_t band;
-	uint32_t key;
+	uint32_t wa[REGLIB_RULE_WORDS], wb[REGLIB_RULE_WORDS];
+	unsigned int i;
 
-	freq_range = &reg_rule->freq_range;
-	band = reglib_deduce_band(freq_range->start_freq_khz);
+	reglib_rule_words(a, wa);
+	reglib_rule_words(b, wb);
 
-	power_rule = &reg_rule->power_rule;
+	for (i = 0; i < REGLIB_RULE_WORDS; i++)
+		if (wa[i] != wb[i])
+			return wa[i] < wb[i] ? -1 : 1;
 
-	key = ((power_rule->max_eirp ^  0) <<  0) ^
-	      ((reg_rule->flags      ^  8) <<  8) ^
-	      ((band                 ^ 16) << 16);
+	return 0;
+}
 
-	return key;
+/* FNV-1a, 64 bit, of a word at a time */
+static uint64_t reglib_hash_word(uint64_t hash, uint32_t word)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		hash ^= (word >> (8 * i)) & 0xff;
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
 }
 
-struct reglib_optimize_map {
-	bool optimized;
-	uint32_t key;
-};
+static void reglib_rd_canon_sort(struct ieee80211_regdomain *rd)
+{
+	qsort(rd->reg_rules, rd->n_reg_rules, sizeof(rd->reg_rules[0]),
+	      reglib_rule_canon_cmp);
+}
 
-/* Does the provided rule suffice both of the other two */
-static int reglib_opt_rule_fit(struct ieee80211_reg_rule *rule1,
-			       struct ieee80211_reg_rule *rule2,
-			       struct ieee80211_reg_rule *opt_rule)
+/* The index of the next rule of sorted @rd after @i that differs from it */
+static unsigned int
+reglib_rd_canon_next(const struct ieee80211_regdomain *rd, unsigned int i)
 {
-	struct ieee80211_reg_rule interesected_rule;
-	struct ieee80211_reg_rule *int_rule;
+	unsigned int j = i + 1;
+
+	while (j < rd->n_reg_rules &&
+	       !reglib_rule_canon_cmp(&rd->reg_rules[i], &rd->reg_rules[j]))
+		j++;
+
+	return j;
+}
+
+/* Whether sorted @a and @b have the same DFS region and distinct rules */
+static bool reglib_rd_canon_equal(const struct ieee80211_regdomain *a,
+				  const struct ieee80211_regdomain *b)
+{
+	unsigned int i = 0, j = 0;
+
+	if (a->dfs_region != b->dfs_region)
+		return false;
+
+	while (i < a->n_reg_rules && j < b->n_reg_rules) {
+		if (reglib_rule_canon_cmp(&a->reg_rules[i], &b->reg_rules[j]))
+			return false;
+		i = reglib_rd_canon_next(a, i);
+		j = reglib_rd_canon_next(b, j);
+	}
+
+	return i == a->n_reg_rules && j == b->n_reg_rules;
+}
+
+uint64_t reglib_rd_hash(struct ieee80211_regdomain *rd)
+{
+	uint32_t words[REGLIB_RULE_WORDS];
+	uint64_t hash = 14695981039346656037ull;
+	unsigned int i, j;
+
+	reglib_rd_canon_sort(rd);
+
+	hash = reglib_hash_word(hash, rd->dfs_region);
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		if (i && !reglib_rule_canon_cmp(&rd->reg_rules[i - 1],
+						&rd->reg_rules[i]))
+			continue;
+		reglib_rule_words(&rd->reg_rules[i], words);
+		for (j = 0; j < REGLIB_RULE_WORDS; j++)
+			hash = reglib_hash_word(hash, words[j]);
+	}
+
+	return hash;
+}
+
+/* The index of the country of slot @i, the world first, plus one or 0 */
+static uint32_t reglib_diff_slot(const struct reglib_regdb_ctx *ctx,
+				 unsigned int i, char *alpha2)
+{
+	if (!i) {
+		alpha2[0] = alpha2[1] = '0';
+		return ctx->world_idx;
+	}
+
+	alpha2[0] = 'A' + (i - 1) / 26;
+	alpha2[1] = 'A' + (i - 1) % 26;
+	return ctx->alpha2_idx[i - 1];
+}
+
+int reglib_diff_ctx(const struct reglib_regdb_ctx *old_ctx,
+		    const struct reglib_regdb_ctx *new_ctx,
+		    int (*fn)(const struct reglib_diff *diff, void *data),
+		    void *data)
+{
+	struct ieee80211_regdomain *old_rd, *new_rd;
+	struct reglib_arena *arena;
+	struct reglib_diff diff;
+	uint32_t old_idx, new_idx;
+	unsigned int i;
+	int r = 0;
+
+	arena = reglib_malloc_arena(0);
+	if (!arena)
+		return -ENOMEM;
+
+	memset(&diff, 0, sizeof(diff));
+
+	for (i = 0; i < 26 * 26 + 1 && !r; i++) {
+		old_idx = reglib_diff_slot(old_ctx, i, diff.alpha2);
+		new_idx = reglib_diff_slot(new_ctx, i, diff.alpha2);
+		if (!old_idx && !new_idx)
+			continue;
+
+		reglib_arena_reset(arena);
+		old_rd = new_rd = NULL;
+
+		if (old_idx) {
+			old_rd = reglib_decode_rd_idx(old_ctx, old_idx - 1,
+						      arena);
+			if (!old_rd) {
+				r = -ENOMEM;
+				break;
+			}
+		}
+		if (new_idx) {
+			new_rd = reglib_decode_rd_idx(new_ctx, new_idx - 1,
+						      arena);
+			if (!new_rd) {
+				r = -ENOMEM;
+				break;
+			}
+		}
+
+		/* Added and removed ones are handed out in canonical order too */
+		if (old_rd)
+			reglib_rd_canon_sort(old_rd);
+		if (new_rd)
+			reglib_rd_canon_sort(new_rd);
+
+		if (!old_rd)
+			diff.type = REGLIB_DIFF_ADDED;
+		else if (!new_rd)
+			diff.type = REGLIB_DIFF_REMOVED;
+		else if (!reglib_rd_canon_equal(old_rd, new_rd))
+			diff.type = REGLIB_DIFF_CHANGED;
+		else
+			continue;
+
+		diff.old_rd = old_rd;
+		diff.new_rd = new_rd;
+		r = fn(&diff, data);
+	}
+
+	reglib_free_arena(arena);
+	return r;
+}
+
+/*
+ * Ordered pool
+ *
+ * Items are processed by a pool of workers, each into its own memory
+ * stream, and the output of each is written to the pool's stream in the
+ * order the items were submitted. Items in flight are held on a ring of
+ * slots, when it is full submitting waits for the oldest output to be
+ * written which bounds the output buffered. Whichever worker completes
+ * the oldest item in flight writes out all outputs that are ready from
+ * there, without holding the pool lock while doing so.
+ */
+struct reglib_pool_slot {
+	void *item;
+	char *buf;
+	size_t len;
+	bool done;
+};
+
+struct reglib_ordered_pool {
+	int (*process)(void *item, FILE *out, void *data);
+	void *data;
+	FILE *out;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t space;
+	struct reglib_pool_slot *slots;
+	unsigned int n_slots;
+	/* sequence numbers of the next item to submit, process and write */
+	uint64_t submitted, taken, written;
+	bool writing;
+	bool closing;
+	int error;
+
+	unsigned int nthreads;
+	pthread_t *threads;
+};
+
+static void reglib_pool_write(struct reglib_ordered_pool *pool)
+{
+	struct reglib_pool_slot *slot;
+	char *buf;
+	size_t len;
+	bool failed;
+
+	if (pool->writing)
+		return;
+	pool->writing = true;
+
+	while (pool->written < pool->taken) {
+		slot = &pool->slots[pool->written % pool->n_slots];
+		if (!slot->done)
+			break;
+		buf = slot->buf;
+		len = slot->len;
+
+		pthread_mutex_unlock(&pool->lock);
+		failed = len && fwrite(buf, len, 1, pool->out) != 1;
+		free(buf);
+		pthread_mutex_lock(&pool->lock);
+
+		if (failed && !pool->error)
+			pool->error = -EIO;
+		slot->done = false;
+		slot->buf = NULL;
+		pool->written++;
+		pthread_cond_signal(&pool->space);
+	}
+
+	pool->writing = false;
+}
+
+static void *reglib_pool_worker(void *data)
+{
+	struct reglib_ordered_pool *pool = data;
+	struct reglib_pool_slot *slot;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out;
+	int r;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->taken == pool->submitted && !pool->closing)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->taken == pool->submitted)
+			break;
+
+		slot = &pool->slots[pool->taken++ % pool->n_slots];
+		pthread_mutex_unlock(&pool->lock);
+
+		buf = NULL;
+		len = 0;
+		out = open_memstream(&buf, &len);
+
+		/*
+		 * Should we be out of memory for the stream the output still
+		 * makes it out, albeit maybe out of order, and the pool fails.
+		 */
+		r = pool->process(slot->item, out ? out : pool->out, pool->data);
+		if (out && fclose(out) && !r)
+			r = -ENOMEM;
+
+		pthread_mutex_lock(&pool->lock);
+		if (!out && !r)
+			r = -ENOMEM;
+		if (r && !pool->error)
+			pool->error = r;
+		slot->buf = out ? buf : NULL;
+		slot->len = out ? len : 0;
+		slot->done = true;
+		reglib_pool_write(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct reglib_ordered_pool *
+reglib_malloc_ordered_pool(unsigned int nthreads, FILE *out,
+			   int (*process)(void *item, FILE *out, void *data),
+			   void *data)
+{
+	struct reglib_ordered_pool *pool;
+	unsigned int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->nthreads = reglib_nthreads(nthreads);
+	pool->n_slots = 4 * pool->nthreads;
+	pool->out = out;
+	pool->process = process;
+	pool->data = data;
+
+	pool->slots = calloc(pool->n_slots, sizeof(*pool->slots));
+	pool->threads = calloc(pool->nthreads, sizeof(*pool->threads));
+	if (!pool->slots || !pool->threads || pool->n_slots < pool->nthreads)
+		goto err;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->space, NULL);
+
+	for (i = 0; i < pool->nthreads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, reglib_pool_worker,
+				   pool))
+			break;
+	}
+
+	/* Any number of workers gets the job done as long as there is one */
+	if (!i) {
+		pthread_cond_destroy(&pool->space);
+		pthread_cond_destroy(&pool->work);
+		pthread_mutex_destroy(&pool->lock);
+		goto err;
+	}
+	pool->nthreads = i;
+
+	return pool;
+err:
+	free(pool->threads);
+	free(pool->slots);
+	free(pool);
+	return NULL;
+}
+
+int reglib_ordered_pool_submit(struct reglib_ordered_pool *pool, void *item)
+{
+	int r;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->submitted - pool->written == pool->n_slots)
+		pthread_cond_wait(&pool->space, &pool->lock);
+
+	pool->slots[pool->submitted++ % pool->n_slots].item = item;
+	pthread_cond_signal(&pool->work);
+	r = pool->error;
+	pthread_mutex_unlock(&pool->lock);
+
+	return r;
+}
+
+int reglib_free_ordered_pool(struct reglib_ordered_pool *pool)
+{
+	unsigned int i;
 	int r;
 
-	memset(&interesected_rule, 0, sizeof(struct ieee80211_reg_rule));
-	int_rule = &interesected_rule;
+	if (!pool)
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->closing = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	r = pool->error;
+
+	pthread_cond_destroy(&pool->space);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->slots);
+	free(pool);
+
+	return r;
+}
+
+/*
+ * Text formatting
+ *
+ * The text is rendered with integers only, without going through printf.
+ * The historic output printed frequencies with "%.3f" of the kHz value as
+ * a float over 1000.0 and powers with "%.2f" of the mBm value as a float
+ * over 100.0. The float rounds values past 24 bits, after that the
+ * division yields the double closest to a decimal of three, or two,
+ * places which prints as that very decimal. Rounding the integer the way
+ * a float does and printing it as fixed point gives the same text.
+ */
+struct reglib_fmt {
+	char *p;
+	char *end;
+	size_t len;
+};
+
+static void reglib_fmt_mem(struct reglib_fmt *fmt, const char *s, size_t n)
+{
+	size_t room = fmt->end - fmt->p;
+
+	fmt->len += n;
+	if (n > room)
+		n = room;
+	memcpy(fmt->p, s, n);
+	fmt->p += n;
+}
+
+static void reglib_fmt_str(struct reglib_fmt *fmt, const char *s)
+{
+	reglib_fmt_mem(fmt, s, strlen(s));
+}
+
+static void reglib_fmt_init(struct reglib_fmt *fmt, char *buf, size_t len)
+{
+	fmt->p = buf;
+	/* Leave room for the terminating NUL */
+	fmt->end = len ? buf + len - 1 : buf;
+	fmt->len = 0;
+}
+
+static size_t reglib_fmt_finish(struct reglib_fmt *fmt, size_t len)
+{
+	if (len)
+		*fmt->p = '\0';
+	return fmt->len;
+}
+
+/* Rounds @val to the nearest value a float holds, ties to even */
+static uint64_t reglib_float_round(uint32_t val)
+{
+	uint64_t half, rem;
+	unsigned int shift = 0;
+
+	while ((val >> shift) >= (1U << 24))
+		shift++;
+	if (!shift)
+		return val;
+
+	half = 1ULL << (shift - 1);
+	rem = val & ((1ULL << shift) - 1);
+	val >>= shift;
+	if (rem > half || (rem == half && (val & 1)))
+		return ((uint64_t) val + 1) << shift;
+	return (uint64_t) val << shift;
+}
+
+/* Prints @val / 10^@places with exactly @places decimals */
+static void reglib_fmt_fixed(struct reglib_fmt *fmt, uint64_t val,
+			     unsigned int places)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned int i;
+
+	for (i = 0; i < places; i++) {
+		*--p = '0' + val % 10;
+		val /= 10;
+	}
+	*--p = '.';
+	do {
+		*--p = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	reglib_fmt_mem(fmt, p, tmp + sizeof(tmp) - p);
+}
+
+static void reglib_fmt_uint(struct reglib_fmt *fmt, uint32_t val)
+{
+	char tmp[12];
+	char *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	reglib_fmt_mem(fmt, p, tmp + sizeof(tmp) - p);
+}
+
+static const char *dfs_domain_name(enum regdb_dfs_regions region)
+{
+	switch (region) {
+	case REGDB_DFS_UNSET:
+		return "DFS-UNSET";
+	case REGDB_DFS_FCC:
+		return "DFS-FCC";
+	case REGDB_DFS_ETSI:
+		return "DFS-ETSI";
+	case REGDB_DFS_JP:
+		return "DFS-JP";
+	default:
+		return "DFS-invalid";
+	}
+}
+
+static void reglib_fmt_reg_rule(struct reglib_fmt *fmt,
+				const struct ieee80211_reg_rule *rule)
+{
+	const struct ieee80211_freq_range *freq;
+	const struct ieee80211_power_rule *power;
+
+	freq  = &rule->freq_range;
+	power = &rule->power_rule;
+
+	reglib_fmt_str(fmt, "\t(");
+	reglib_fmt_fixed(fmt, reglib_float_round(freq->start_freq_khz), 3);
+	reglib_fmt_str(fmt, " - ");
+	reglib_fmt_fixed(fmt, reglib_float_round(freq->end_freq_khz), 3);
+	reglib_fmt_str(fmt, " @ ");
+	reglib_fmt_fixed(fmt, reglib_float_round(freq->max_bandwidth_khz), 3);
+	reglib_fmt_str(fmt, "), (");
+
+	if (power->max_eirp) {
+		reglib_fmt_fixed(fmt, reglib_float_round(power->max_eirp), 2);
+		reglib_fmt_str(fmt, ")");
+	} else
+		reglib_fmt_str(fmt, "N/A)");
+
+	if (rule->dfs_cac_ms) {
+		reglib_fmt_str(fmt, ", (");
+		reglib_fmt_uint(fmt, rule->dfs_cac_ms);
+		reglib_fmt_str(fmt, ")");
+	} else
+		reglib_fmt_str(fmt, ", (N/A)");
+
+	if (rule->flags & RRF_NO_OFDM)
+		reglib_fmt_str(fmt, ", NO-OFDM");
+	if (rule->flags & RRF_NO_CCK)
+		reglib_fmt_str(fmt, ", NO-CCK");
+	if (rule->flags & RRF_NO_INDOOR)
+		reglib_fmt_str(fmt, ", NO-INDOOR");
+	if (rule->flags & RRF_NO_OUTDOOR)
+		reglib_fmt_str(fmt, ", NO-OUTDOOR");
+	if (rule->flags & RRF_DFS)
+		reglib_fmt_str(fmt, ", DFS");
+	if (rule->flags & RRF_PTP_ONLY)
+		reglib_fmt_str(fmt, ", PTP-ONLY");
+	if (rule->flags & RRF_PTMP_ONLY)
+		reglib_fmt_str(fmt, ", PTMP-ONLY");
+	if (rule->flags & RRF_NO_IR_ALL)
+		reglib_fmt_str(fmt, ", NO-IR");
+	if (rule->flags & RRF_AUTO_BW)
+		reglib_fmt_str(fmt, ", AUTO-BW");
+
+	reglib_fmt_str(fmt, "\n");
+}
+
+static void reglib_fmt_country(struct reglib_fmt *fmt, const char *alpha2,
+			       enum regdb_dfs_regions dfs_region)
+{
+	reglib_fmt_str(fmt, "country ");
+	reglib_fmt_mem(fmt, alpha2, strnlen(alpha2, 2));
+	reglib_fmt_str(fmt, ": ");
+	reglib_fmt_str(fmt, dfs_domain_name(dfs_region));
+	reglib_fmt_str(fmt, "\n");
+}
+
+size_t reglib_format_regdom(const struct ieee80211_regdomain *rd,
+			    char *buf, size_t len)
+{
+	struct reglib_fmt fmt;
+	unsigned int i;
+
+	reglib_fmt_init(&fmt, buf, len);
+	reglib_fmt_country(&fmt, rd->alpha2, rd->dfs_region);
+	for (i = 0; i < rd->n_reg_rules; i++)
+		reglib_fmt_reg_rule(&fmt, &rd->reg_rules[i]);
+	reglib_fmt_str(&fmt, "\n");
+
+	return reglib_fmt_finish(&fmt, len);
+}
+
+size_t reglib_format_rd_view(const struct reglib_rd_view *view,
+			     char *buf, size_t len)
+{
+	struct ieee80211_reg_rule rule;
+	struct reglib_fmt fmt;
+	unsigned int i;
+
+	reglib_fmt_init(&fmt, buf, len);
+	reglib_fmt_country(&fmt, view->alpha2, view->dfs_region);
+	reglib_for_each_rd_view_rule(&rule, i, view)
+		reglib_fmt_reg_rule(&fmt, &rule);
+	reglib_fmt_str(&fmt, "\n");
+
+	return reglib_fmt_finish(&fmt, len);
+}
+
+/*
+ * Domains that do not fit the buffer on the stack, which takes a few dozen
+ * rules, are written out one line at a time.
+ */
+#define REGLIB_FMT_BUF_LEN	4096
+#define REGLIB_FMT_RULE_LEN	256
+
+void reglib_fprint_regdom(FILE *fp, const struct ieee80211_regdomain *rd)
+{
+	char buf[REGLIB_FMT_BUF_LEN];
+	struct reglib_fmt fmt;
+	unsigned int i;
+	size_t len;
+
+	len = reglib_format_regdom(rd, buf, sizeof(buf));
+	if (len < sizeof(buf)) {
+		fwrite(buf, len, 1, fp);
+		return;
+	}
+
+	reglib_fmt_init(&fmt, buf, sizeof(buf));
+	reglib_fmt_country(&fmt, rd->alpha2, rd->dfs_region);
+	fwrite(buf, fmt.len, 1, fp);
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		reglib_fmt_init(&fmt, buf, REGLIB_FMT_RULE_LEN);
+		reglib_fmt_reg_rule(&fmt, &rd->reg_rules[i]);
+		fwrite(buf, fmt.len, 1, fp);
+	}
+	fputc('\n', fp);
+}
+
+void reglib_fprint_rd_view(FILE *fp, const struct reglib_rd_view *view)
+{
+	char buf[REGLIB_FMT_BUF_LEN];
+	struct ieee80211_reg_rule rule;
+	struct reglib_fmt fmt;
+	unsigned int i;
+	size_t len;
+
+	len = reglib_format_rd_view(view, buf, sizeof(buf));
+	if (len < sizeof(buf)) {
+		fwrite(buf, len, 1, fp);
+		return;
+	}
+
+	reglib_fmt_init(&fmt, buf, sizeof(buf));
+	reglib_fmt_country(&fmt, view->alpha2, view->dfs_region);
+	fwrite(buf, fmt.len, 1, fp);
+	reglib_for_each_rd_view_rule(&rule, i, view) {
+		reglib_fmt_init(&fmt, buf, REGLIB_FMT_RULE_LEN);
+		reglib_fmt_reg_rule(&fmt, &rule);
+		fwrite(buf, fmt.len, 1, fp);
+	}
+	fputc('\n', fp);
+}
+
+void reglib_print_regdom(const struct ieee80211_regdomain *rd)
+{
+	reglib_fprint_regdom(stdout, rd);
+}
+
+void reglib_print_rd_view(const struct reglib_rd_view *view)
+{
+	reglib_fprint_rd_view(stdout, view);
+}
+
+/*
+ * db.txt lexer. Lines are handed over as a pointer and a length into the
+ * input, which need not be NUL terminated, and numbers are read as fixed
+ * point decimals with three fractional digits, which is exactly what kHz
+ * from MHz in db.txt needs. This accepts what the sscanf() based parser
+ * did, other than floats written in exponent notation.
+ */
+static bool reglib_lex_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+	       c == '\f' || c == '\v';
+}
+
+static const char *reglib_lex_skip_space(const char *p, const char *end)
+{
+	while (p < end && reglib_lex_space(*p))
+		p++;
+	return p;
+}
+
+/* Skips whitespace and then expects @c */
+static const char *reglib_lex_char(const char *p, const char *end, char c)
+{
+	p = reglib_lex_skip_space(p, end);
+	if (p == end || *p != c)
+		return NULL;
+	return p + 1;
+}
+
+/*
+ * Reads an optionally signed decimal number such as "5170" or "2402.5"
+ * into thousandths, extra fractional digits are truncated.
+ */
+static const char *reglib_lex_decimal(const char *p, const char *end,
+				      int64_t *milli)
+{
+	int64_t v = 0;
+	unsigned int frac = 0;
+	bool neg = false, digits = false;
+
+	p = reglib_lex_skip_space(p, end);
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		/* No rule comes anywhere near, just don't overflow */
+		if (v > INT64_MAX / 10000)
+			return NULL;
+		v = v * 10 + (*p - '0');
+		digits = true;
+	}
+	v *= 1000;
+
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			if (frac < 3) {
+				v += (*p - '0') * (frac == 0 ? 100 :
+						   frac == 1 ? 10 : 1);
+				frac++;
+			}
+			digits = true;
+		}
+	}
+
+	if (!digits)
+		return NULL;
+
+	*milli = neg ? -v : v;
+	return p;
+}
+
+static const char *reglib_lex_khz(const char *p, const char *end,
+				  uint32_t *khz)
+{
+	int64_t milli;
+
+	p = reglib_lex_decimal(p, end, &milli);
+	if (!p || milli < 0 || milli > UINT32_MAX)
+		return NULL;
+
+	*khz = milli;
+	return p;
+}
+
+static bool reglib_lex_has(const char *p, const char *end, const char *s)
+{
+	size_t len = strlen(s);
+
+	for (; (size_t) (end - p) >= len; p++) {
+		if (memcmp(p, s, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+static unsigned int reglib_parse_dfs_region(const char *p, const char *end)
+{
+	if (reglib_lex_has(p, end, "DFS-FCC"))
+		return REGDB_DFS_FCC;
+	if (reglib_lex_has(p, end, "DFS-ETSI"))
+		return REGDB_DFS_ETSI;
+	if (reglib_lex_has(p, end, "DFS-JP"))
+		return REGDB_DFS_JP;
+	return REGDB_DFS_UNSET;
+}
+
+static const struct {
+	const char *name;
+	uint32_t flag;
+} reglib_rule_flags[] = {
+	{ "NO-OFDM",	RRF_NO_OFDM },
+	{ "NO-CCK",	RRF_NO_CCK },
+	{ "NO-INDOOR",	RRF_NO_INDOOR },
+	{ "NO-OUTDOOR",	RRF_NO_OUTDOOR },
+	{ "DFS",	RRF_DFS },
+	{ "PTP-ONLY",	RRF_PTP_ONLY },
+	{ "PTMP-ONLY",	RRF_PTMP_ONLY },
+	{ "NO-IR",	RRF_NO_IR },
+	{ "AUTO-BW",	RRF_AUTO_BW },
+};
+
+static uint32_t reglib_parse_rule_flag(const char *p, const char *end)
+{
+	const char *tok;
+	uint32_t flags = 0;
+	unsigned int i;
+
+	while (p < end) {
+		while (p < end && (*p == ',' || reglib_lex_space(*p)))
+			p++;
+		for (tok = p; p < end && *p != ',' && !reglib_lex_space(*p); p++)
+			;
+		for (i = 0; i < sizeof(reglib_rule_flags) /
+				 sizeof(reglib_rule_flags[0]); i++) {
+			if (strlen(reglib_rule_flags[i].name) ==
+			    (size_t) (p - tok) &&
+			    memcmp(reglib_rule_flags[i].name, tok, p - tok) == 0)
+				flags |= reglib_rule_flags[i].flag;
+		}
+	}
+
+	return flags;
+}
+
+/*
+ * A rule is "(start - end @ bandwidth), (eirp[ mW])[, (cac)][, flags...]",
+ * anything else makes it the end of the rules of a country.
+ */
+static int reglib_parse_rule(const char *line, size_t len,
+			     struct ieee80211_reg_rule *reg_rule)
+{
+	const char *end = line + len, *p, *eirp, *opt;
+	int64_t max_eirp, dfs_cac_ms;
+
+	/* First get start, end and bandwidth */
+	p = reglib_lex_char(line, end, '(');
+	if (p)
+		p = reglib_lex_khz(p, end, &reg_rule->freq_range.start_freq_khz);
+	if (p)
+		p = reglib_lex_char(p, end, '-');
+	if (p)
+		p = reglib_lex_khz(p, end, &reg_rule->freq_range.end_freq_khz);
+	if (p)
+		p = reglib_lex_char(p, end, '@');
+	if (p)
+		p = reglib_lex_khz(p, end,
+				   &reg_rule->freq_range.max_bandwidth_khz);
+	if (!p)
+		return -EINVAL;
+
+	/* Next get eirp */
+	eirp = memchr(line, ',', len);
+	if (!eirp) {
+		fprintf(stderr, "not found eirp in line: %.*s\n",
+			(int) len, line);
+		return -EINVAL;
+	}
+	eirp++;
+
+	p = reglib_lex_char(eirp, end, '(');
+	if (p)
+		p = reglib_lex_decimal(p, end, &max_eirp);
+	if (!p)
+		return -EINVAL;
+
+	if (reglib_lex_has(eirp, end, "mW"))
+		reg_rule->power_rule.max_eirp =
+			REGLIB_MW_TO_MBM((double) max_eirp / 1000);
+	else
+		reg_rule->power_rule.max_eirp = max_eirp / 10;
+
+	/* Next get optional arguments (flags ...) */
+	opt = memchr(eirp, ',', end - eirp);
+	if (opt) {
+		opt++;
+
+		/* Check DFS CAC time */
+		p = reglib_lex_char(opt, end, '(');
+		if (p)
+			p = reglib_lex_decimal(p, end, &dfs_cac_ms);
+		if (p && dfs_cac_ms >= 0)
+			reg_rule->dfs_cac_ms = dfs_cac_ms / 1000;
+
+		/* Check flags */
+		reg_rule->flags = reglib_parse_rule_flag(opt, end);
+	}
+
+	return 0;
+}
+
+static bool reglib_lex_alnum(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9');
+}
+
+/* "country XY:[ DFS-REGION]", up to the first two characters are used */
+static int reglib_parse_country_dfs(const char *line, size_t len,
+				    struct ieee80211_regdomain *rd)
+{
+	const char *end = line + len, *p = line + 7, *tok;
+	unsigned int n = 0;
+
+	memset(rd, 0, sizeof(*rd));
+
+	p = reglib_lex_skip_space(p, end);
+	while (n < 2 && p < end && reglib_lex_alnum(*p))
+		rd->alpha2[n++] = *p++;
+	if (!n)
+		return -EINVAL;
+
+	if (p == end || *p++ != ':' || p == end || *p != ' ')
+		return 0;
+
+	while (p < end && *p == ' ')
+		p++;
+	p = reglib_lex_skip_space(p, end);
+	for (tok = p; p < end && !reglib_lex_space(*p); p++)
+		;
+	rd->dfs_region = reglib_parse_dfs_region(tok, p);
+
+	return 0;
+}
+
+/*
+ * The text parser reads each line once. A line it looked at but could not
+ * use yet, like the line ending the rules of a country, is kept as a
+ * lookahead for the next step rather than seeking back to read it again.
+ * Lines of a buffer are used in place, only those of a stream are read
+ * into @line_buf. Rules are collected on a scratch domain that grows as
+ * needed, so a domain can be allocated with its final size once they are
+ * all in, or the scratch one handed out as is by reglib_parse_buffer().
+ */
+struct reglib_parser {
+	FILE *fp;
+	const char *buf;
+	size_t buf_len;
+	size_t buf_pos;
+
+	bool skip_comments;
+	bool track_pos;
+	fpos_t line_pos;
+
+	const char *line;
+	size_t line_len;
+	bool have_line;
+	char *line_buf;
+	size_t line_buf_size;
+
+	struct ieee80211_regdomain *rd;
+	unsigned int max_rules;
+};
+
+static int reglib_parser_getline(struct reglib_parser *parser)
+{
+	const char *nl;
+	ssize_t len;
+
+	while (1) {
+		if (parser->fp) {
+			if (parser->track_pos &&
+			    fgetpos(parser->fp, &parser->line_pos)) {
+				fprintf(stderr, "fgetpos() failed: %s\n",
+					strerror(errno));
+				return -errno;
+			}
+			len = getline(&parser->line_buf, &parser->line_buf_size,
+				      parser->fp);
+			if (len < 0)
+				return EOF;
+			parser->line = parser->line_buf;
+			parser->line_len = len;
+		} else {
+			if (parser->buf_pos >= parser->buf_len)
+				return EOF;
+			parser->line = parser->buf + parser->buf_pos;
+			parser->line_len = parser->buf_len - parser->buf_pos;
+			nl = memchr(parser->line, '\n', parser->line_len);
+			if (nl)
+				parser->line_len = nl - parser->line + 1;
+			parser->buf_pos += parser->line_len;
+		}
+
+		if (parser->skip_comments &&
+		    memchr(parser->line, '#', parser->line_len))
+			continue;
+		return 0;
+	}
+}
+
+static const char *reglib_parser_peek(struct reglib_parser *parser)
+{
+	if (!parser->have_line) {
+		if (reglib_parser_getline(parser))
+			return NULL;
+		parser->have_line = true;
+	}
+
+	return parser->line;
+}
+
+static void reglib_parser_consume(struct reglib_parser *parser)
+{
+	parser->have_line = false;
+}
+
+static struct ieee80211_reg_rule *
+reglib_parser_new_rule(struct reglib_parser *parser)
+{
+	struct ieee80211_regdomain *rd;
+	unsigned int max_rules;
+	struct ieee80211_reg_rule *rule;
+
+	if (!parser->rd || parser->rd->n_reg_rules == parser->max_rules) {
+		max_rules = parser->max_rules ? 2 * parser->max_rules : 16;
+		if (max_rules < parser->max_rules)
+			return NULL;
+		rd = realloc(parser->rd,
+			     reglib_array_len(sizeof(*rd), max_rules,
+					      sizeof(struct ieee80211_reg_rule)));
+		if (!rd)
+			return NULL;
+		if (!parser->rd)
+			rd->n_reg_rules = 0;
+		parser->rd = rd;
+		parser->max_rules = max_rules;
+	}
+
+	rule = &parser->rd->reg_rules[parser->rd->n_reg_rules];
+	memset(rule, 0, sizeof(*rule));
+	return rule;
+}
+
+/*
+ * Parses the next country onto the scratch domain, returns the number of
+ * rules found, zero once no more countries could be built, or a negative
+ * error.
+ */
+static int reglib_parser_scan_country(struct reglib_parser *parser)
+{
+	struct ieee80211_regdomain tmp_rd;
+	struct ieee80211_reg_rule *rule;
+	const char *line;
+
+	/* Country */
+	while ((line = reglib_parser_peek(parser))) {
+		if (parser->line_len >= 7 && memcmp(line, "country", 7) == 0)
+			break;
+		reglib_parser_consume(parser);
+	}
+
+	if (!line)
+		return 0;
+
+	reglib_parser_consume(parser);
+	if (reglib_parse_country_dfs(line, parser->line_len, &tmp_rd) != 0) {
+		fprintf(stderr, "Invalid country line: %.*s",
+			(int) parser->line_len, line);
+		return 0;
+	}
+
+	/* Rules, up to the first line that is not one */
+	if (!reglib_parser_new_rule(parser))
+		return -ENOMEM;
+	memcpy(parser->rd, &tmp_rd, sizeof(tmp_rd));
+
+	while ((line = reglib_parser_peek(parser))) {
+		rule = reglib_parser_new_rule(parser);
+		if (!rule)
+			return -ENOMEM;
+		if (reglib_parse_rule(line, parser->line_len, rule) != 0)
+			break;
+		reglib_parser_consume(parser);
+		parser->rd->n_reg_rules++;
+	}
+
+	return parser->rd->n_reg_rules;
+}
+
+static struct ieee80211_regdomain *
+__reglib_parser_next_country(struct reglib_parser *parser,
+			     struct reglib_arena *arena)
+{
+	struct ieee80211_regdomain *rd;
+	uint32_t size_of_regd;
+	int num_rules;
+
+	num_rules = reglib_parser_scan_country(parser);
+	if (num_rules <= 0)
+		return NULL;
+
+	size_of_regd = reglib_array_len(sizeof(struct ieee80211_regdomain),
+					num_rules + 1,
+					sizeof(struct ieee80211_reg_rule));
+	rd = reglib_zalloc(arena, size_of_regd);
+	if (!rd)
+		return NULL;
+
+	memcpy(rd, parser->rd, sizeof(*rd) +
+	       num_rules * sizeof(struct ieee80211_reg_rule));
+
+	return rd;
+}
+
+static void reglib_parser_release(struct reglib_parser *parser)
+{
+	free(parser->line_buf);
+	free(parser->rd);
+}
+
+struct reglib_parser *reglib_malloc_parser(FILE *fp)
+{
+	struct reglib_parser *parser;
+
+	parser = calloc(1, sizeof(*parser));
+	if (!parser)
+		return NULL;
+
+	parser->fp = fp;
+	parser->skip_comments = true;
+
+	return parser;
+}
+
+struct reglib_parser *reglib_malloc_parser_buf(const char *buf, size_t len)
+{
+	struct reglib_parser *parser;
+
+	parser = calloc(1, sizeof(*parser));
+	if (!parser)
+		return NULL;
+
+	parser->buf = buf;
+	parser->buf_len = len;
+	parser->skip_comments = true;
+
+	return parser;
+}
+
+void reglib_free_parser(struct reglib_parser *parser)
+{
+	if (!parser)
+		return;
+
+	reglib_parser_release(parser);
+	free(parser);
+}
+
+struct ieee80211_regdomain *
+reglib_parser_next_country(struct reglib_parser *parser)
+{
+	return __reglib_parser_next_country(parser, NULL);
+}
+
+struct ieee80211_regdomain *
+reglib_parser_next_country_arena(struct reglib_parser *parser,
+				 struct reglib_arena *arena)
+{
+	return __reglib_parser_next_country(parser, arena);
+}
+
+int reglib_parse_buffer(const char *buf, size_t len,
+			int (*cb)(struct ieee80211_regdomain *rd, void *data),
+			void *data)
+{
+	struct reglib_parser parser;
+	int r;
+
+	memset(&parser, 0, sizeof(parser));
+	parser.buf = buf;
+	parser.buf_len = len;
+	parser.skip_comments = true;
+
+	while ((r = reglib_parser_scan_country(&parser)) > 0) {
+		r = cb(parser.rd, data);
+		if (r)
+			break;
+	}
+
+	reglib_parser_release(&parser);
+	return r;
+}
+
+struct ieee80211_regdomain *
+reglib_dup_regdom(const struct ieee80211_regdomain *rd)
+{
+	struct ieee80211_regdomain *copy;
+	size_t size_of_rd;
+
+	size_of_rd = reglib_array_len(sizeof(*rd), rd->n_reg_rules,
+				      sizeof(rd->reg_rules[0]));
+	copy = malloc(size_of_rd);
+	if (!copy)
+		return NULL;
+	memcpy(copy, rd, size_of_rd);
+
+	return copy;
+}
+
+int reglib_parse_stream(FILE *fp,
+			int (*cb)(struct ieee80211_regdomain *rd, void *data),
+			void *data)
+{
+	struct reglib_parser parser;
+	struct stat st;
+	off_t off;
+	void *map;
+	int r;
+
+	/* Regular files are parsed in place, from where @fp is at */
+	off = ftello(fp);
+	if (off >= 0 && fstat(fileno(fp), &st) == 0 &&
+	    S_ISREG(st.st_mode) && st.st_size > off) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			   fileno(fp), 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			r = reglib_parse_buffer((const char *) map + off,
+						st.st_size - off, cb, data);
+			munmap(map, st.st_size);
+			return r;
+		}
+	}
+
+	memset(&parser, 0, sizeof(parser));
+	parser.fp = fp;
+	parser.skip_comments = true;
+
+	while ((r = reglib_parser_scan_country(&parser)) > 0) {
+		r = cb(parser.rd, data);
+		if (r)
+			break;
+	}
+
+	reglib_parser_release(&parser);
+	return r;
+}
+
+/*
+ * The stream interface leaves @fp on the line after the country parsed, so
+ * a lookahead line is pushed back with a single fsetpos() when done. The
+ * stream is expected to be free of comments already.
+ */
+static struct ieee80211_regdomain *
+reglib_parse_country_rd(FILE *fp, struct reglib_arena *arena)
+{
+	struct ieee80211_regdomain *rd;
+	struct reglib_parser parser;
+
+	memset(&parser, 0, sizeof(parser));
+	parser.fp = fp;
+	parser.track_pos = true;
+
+	rd = __reglib_parser_next_country(&parser, arena);
+
+	if (parser.have_line && fsetpos(fp, &parser.line_pos)) {
+		fprintf(stderr, "fsetpos() failed: %s\n", strerror(errno));
+		reglib_release(arena, rd);
+		rd = NULL;
+	}
+
+	reglib_parser_release(&parser);
+	return rd;
+}
+
+struct ieee80211_regdomain *__reglib_parse_country(FILE *fp)
+{
+	return reglib_parse_country_rd(fp, NULL);
+}
+
+struct ieee80211_regdomain *reglib_parse_country(FILE *fp)
+{
+	return reglib_parse_country_rd(fp, NULL);
+}
+
+struct ieee80211_regdomain *
+reglib_parse_country_arena(FILE *fp, struct reglib_arena *arena)
+{
+	return reglib_parse_country_rd(fp, arena);
+}
+
+FILE *reglib_create_parse_stream(FILE *f)
+{
+	unsigned int lines = 0;
+	FILE *fp;
+
+	fp = tmpfile();
+	if (!fp) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		return NULL;
+	}
+
+	while(1) {
+		char line[1024];
+		char *line_p;
+
+		line_p = fgets(line, sizeof(line), f);
+		if (line_p == line) {
+			if (strchr(line, '#') == NULL) {
+				fputs(line, fp);
+				lines++;
+			}
+			continue;
+		} else
+			break;
+	}
+
+	rewind(fp);
+	fflush(fp);
+
+	return fp;
+}
+
+/*
+ * Just whatever for now, nothing formal, but note that as bands
+ * grow we'll want to make this a bit more formal somehow.
+ */
+static uint32_t reglib_deduce_band(uint32_t start_freq_khz)
+{
+	uint32_t freq_mhz = REGLIB_KHZ_TO_MHZ(start_freq_khz);
+
+	if (freq_mhz >= 4000)
+		return 5;
+	if (freq_mhz > 2000 && freq_mhz < 4000)
+		return 2;
+	if (freq_mhz > 50000)
+		return 60;
+	return 1234;
+}
+
+/*
+ * The pairwise optimizer below is what reglib_optimize_regdom() used to
+ * be, it is kept to validate the sort and merge one against. The idea
+ * behind a rule key is that if two rule keys share the same key they can
+ * be merged together if their frequencies overlap, note the key folds
+ * its fields over each other and does not cover the bandwidth.
+ */
+static uint64_t reglib_rule_key(struct ieee80211_reg_rule *reg_rule)
+{
+	struct ieee80211_power_rule *power_rule;
+	struct ieee80211_freq_range *freq_range;
+	uint32_t band;
+	uint32_t key;
+
+	freq_range = &reg_rule->freq_range;
+	band = reglib_deduce_band(freq_range->start_freq_khz);
+
+	power_rule = &reg_rule->power_rule;
+
+	key = ((power_rule->max_eirp ^  0) <<  0) ^
+	      ((reg_rule->flags      ^  8) <<  8) ^
+	      ((band                 ^ 16) << 16);
+
+	return key;
+}
+
+struct reglib_optimize_map {
+	bool optimized;
+	uint32_t key;
+};
+
+/* Does the provided rule suffice both of the other two */
+static int reglib_opt_rule_fit(struct ieee80211_reg_rule *rule1,
+			       struct ieee80211_reg_rule *rule2,
+			       struct ieee80211_reg_rule *opt_rule)
+{
+	struct ieee80211_reg_rule interesected_rule;
+	struct ieee80211_reg_rule *int_rule;
+	int r;
+
+	memset(&interesected_rule, 0, sizeof(struct ieee80211_reg_rule));
+	int_rule = &interesected_rule;
+
+	r = reg_rules_intersect(rule1, opt_rule, int_rule);
+	if (r != 0)
+		return r;
+	r = reg_rules_intersect(rule2, opt_rule, int_rule);
+	if (r != 0)
+		return r;
+
+	return 0;
+}
+
+static int reg_rule_optimize(struct ieee80211_reg_rule *rule1,
+			     struct ieee80211_reg_rule *rule2,
+			     struct ieee80211_reg_rule *opt_rule)
+{
+	int r;
+
+	r = reg_rules_union(rule1, rule2, opt_rule);
+	if (r != 0)
+		return r;
+	r = reglib_opt_rule_fit(rule1, rule2, opt_rule);
+	if (r != 0)
+		return r;
+
+	return 0;
+}
+
+/*
+ * Here's the math explanation:
+ *
+ * This takes each pivot frequency on the regulatory domain, computes
+ * the union between it each regulatory rule on the regulatory domain
+ * sequentially, and after that it tries to verify that the pivot frequency
+ * fits on it by computing an intersection between it and the union, if
+ * a rule exist as a possible intersection then we know the rule can be
+ * subset of the combination of the two frequency ranges (union) computed.
+ */
+static unsigned int reg_rule_optimize_rd(struct ieee80211_regdomain *rd,
+					 unsigned int rule_idx,
+					 struct ieee80211_reg_rule *opt_rule,
+					 struct reglib_optimize_map *opt_map)
+{
+	unsigned int i;
+	struct ieee80211_reg_rule *rule1;
+	struct ieee80211_reg_rule *rule2;
+
+	struct ieee80211_reg_rule tmp_optimized_rule;
+	struct ieee80211_reg_rule *tmp_opt_rule;
+
+	struct ieee80211_reg_rule *target_rule;
+
+	unsigned int optimized = 0;
+	int r;
+
+	if (rule_idx > rd->n_reg_rules)
+		return 0;
+
+	rule1 = &rd->reg_rules[rule_idx];
+
+	memset(&tmp_optimized_rule, 0, sizeof(struct ieee80211_reg_rule));
+	tmp_opt_rule = &tmp_optimized_rule;
+
+	memset(opt_rule, 0, sizeof(*opt_rule));
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		if (rule_idx == i)
+			continue;
+		rule2 = &rd->reg_rules[i];
+		if (opt_map[rule_idx].key != opt_map[i].key)
+			continue;
+
+		target_rule = optimized ? opt_rule : rule1;
+		r = reg_rule_optimize(target_rule, rule2, tmp_opt_rule);
+		if (r != 0)
+			continue;
+		memcpy(opt_rule, tmp_opt_rule, sizeof(*tmp_opt_rule));
+
+		if (!opt_map[i].optimized) {
+			opt_map[i].optimized = true;
+			optimized++;
+		}
+		if (!opt_map[rule_idx].optimized) {
+			opt_map[rule_idx].optimized = true;
+			optimized++;
+		}
+	}
+	return optimized;
+}
+
+static struct ieee80211_regdomain *
+reglib_optimize_regdom_pairwise(struct ieee80211_regdomain *rd,
+				struct reglib_arena *arena)
+{
+	struct ieee80211_regdomain *opt_rd = NULL;
+	struct ieee80211_reg_rule *reg_rule;
+	struct ieee80211_reg_rule *reg_rule_dst;
+	struct ieee80211_reg_rule optimized_reg_rule;
+	struct ieee80211_reg_rule *opt_reg_rule;
+	struct reglib_optimize_map *opt_map;
+	unsigned int i, idx = 0, non_opt = 0, opt = 0;
+	size_t num_rules, size_of_regd, size_of_opt_map;
+	unsigned int num_opts = 0;
+
+	size_of_opt_map = (rd->n_reg_rules + 2) *
+		sizeof(struct reglib_optimize_map);
+	opt_map = reglib_zalloc(arena, size_of_opt_map);
+	if (!opt_map)
+		return NULL;
+
+	memset(&optimized_reg_rule, 0, sizeof(struct ieee80211_reg_rule));
+
+	opt_reg_rule = &optimized_reg_rule;
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		reg_rule = &rd->reg_rules[i];
+		opt_map[i].key = reglib_rule_key(reg_rule);
+	}
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		reg_rule = &rd->reg_rules[i];
+		if (opt_map[i].optimized)
+			continue;
+		num_opts = reg_rule_optimize_rd(rd, i, opt_reg_rule, opt_map);
+		if (!num_opts)
+			non_opt++;
+		else
+			opt += (num_opts ? 1 : 0);
+	}
+
+	num_rules = non_opt + opt;
+
+	if (num_rules > rd->n_reg_rules)
+		goto fail_opt_map;
+
+	size_of_regd = reglib_array_len(sizeof(struct ieee80211_regdomain),
+					num_rules + 1,
+					sizeof(struct ieee80211_reg_rule));
+
+	opt_rd = reglib_zalloc(arena, size_of_regd);
+	if (!opt_rd)
+		goto fail_opt_map;
+
+	opt_rd->n_reg_rules = num_rules;
+	opt_rd->alpha2[0] = rd->alpha2[0];
+	opt_rd->alpha2[1] = rd->alpha2[1];
+	opt_rd->dfs_region = rd->dfs_region;
+
+	memset(opt_map, 0, size_of_opt_map);
+	memset(&optimized_reg_rule, 0, sizeof(struct ieee80211_reg_rule));
+
+	opt_reg_rule = &optimized_reg_rule;
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		reg_rule = &rd->reg_rules[i];
+		opt_map[i].key = reglib_rule_key(reg_rule);
+	}
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		reg_rule = &rd->reg_rules[i];
+		reg_rule_dst = &opt_rd->reg_rules[idx];
+		if (opt_map[i].optimized)
+			continue;
+		num_opts = reg_rule_optimize_rd(rd, i, opt_reg_rule, opt_map);
+		if (!num_opts)
+			memcpy(reg_rule_dst, reg_rule, sizeof(struct ieee80211_reg_rule));
+		else
+			memcpy(reg_rule_dst, opt_reg_rule, sizeof(struct ieee80211_reg_rule));
+		idx++;
+	}
+
+	if (idx != num_rules)
+		goto fail;
+
+	for (i = 0; i < opt_rd->n_reg_rules; i++) {
+		reg_rule = &opt_rd->reg_rules[i];
+		if (!is_valid_reg_rule(reg_rule))
+			goto fail;
+	}
+
+	reglib_release(arena, opt_map);
+	return opt_rd;
+fail:
+	reglib_release(arena, opt_rd);
+fail_opt_map:
+	reglib_release(arena, opt_map);
+	return NULL;
+}
+
+/*
+ * Rules can be merged when everything but their frequency range matches,
+ * rules of a group sorted by start frequency then only need to be merged
+ * with the one before them while they overlap or touch. Each merged rule
+ * takes the place of the first of its rules in the domain, as the first
+ * rule was the pivot the pairwise optimizer merged others into.
+ */
+struct reglib_opt_rule {
+	const struct ieee80211_reg_rule *rule;
+	uint32_t band;
+	unsigned int idx;
+};
+
+static int reglib_opt_rule_cmp(const void *a, const void *b)
+{
+	const struct reglib_opt_rule *o1 = a, *o2 = b;
+	const struct ieee80211_reg_rule *r1 = o1->rule, *r2 = o2->rule;
+
+#define REGLIB_OPT_CMP(__a, __b)			\
+	do {						\
+		if ((__a) != (__b))			\
+			return (__a) < (__b) ? -1 : 1;	\
+	} while (0)
+
+	REGLIB_OPT_CMP(o1->band, o2->band);
+	REGLIB_OPT_CMP(r1->power_rule.max_eirp, r2->power_rule.max_eirp);
+	REGLIB_OPT_CMP(r1->power_rule.max_antenna_gain,
+		       r2->power_rule.max_antenna_gain);
+	REGLIB_OPT_CMP(r1->flags, r2->flags);
+	REGLIB_OPT_CMP(r1->freq_range.max_bandwidth_khz,
+		       r2->freq_range.max_bandwidth_khz);
+	REGLIB_OPT_CMP(r1->dfs_cac_ms, r2->dfs_cac_ms);
+	REGLIB_OPT_CMP(r1->freq_range.start_freq_khz,
+		       r2->freq_range.start_freq_khz);
+	REGLIB_OPT_CMP(r1->freq_range.end_freq_khz,
+		       r2->freq_range.end_freq_khz);
+	REGLIB_OPT_CMP(o1->idx, o2->idx);
+
+#undef REGLIB_OPT_CMP
+
+	return 0;
+}
+
+static bool reglib_opt_same_group(const struct reglib_opt_rule *o1,
+				  const struct reglib_opt_rule *o2)
+{
+	const struct ieee80211_reg_rule *r1 = o1->rule, *r2 = o2->rule;
+
+	return o1->band == o2->band &&
+	       r1->power_rule.max_eirp == r2->power_rule.max_eirp &&
+	       r1->power_rule.max_antenna_gain ==
+			r2->power_rule.max_antenna_gain &&
+	       r1->flags == r2->flags &&
+	       r1->freq_range.max_bandwidth_khz ==
+			r2->freq_range.max_bandwidth_khz &&
+	       r1->dfs_cac_ms == r2->dfs_cac_ms;
+}
+
+/* Merged rules, in the order of the first rule of each in the domain */
+static int reglib_opt_merged_cmp(const void *a, const void *b)
+{
+	const struct reglib_opt_rule *o1 = a, *o2 = b;
+
+	return o1->idx < o2->idx ? -1 : o1->idx > o2->idx;
+}
+
+static struct ieee80211_regdomain *
+__reglib_optimize_regdom(struct ieee80211_regdomain *rd,
+			 struct reglib_arena *arena)
+{
+	struct ieee80211_regdomain *opt_rd = NULL;
+	struct ieee80211_reg_rule *rules, *merged;
+	struct reglib_opt_rule *order;
+	const struct ieee80211_reg_rule *rule;
+	unsigned int i, num_rules = 0;
+	size_t size_of_regd;
+
+	order = reglib_zalloc(arena, reglib_array_len(0, rd->n_reg_rules + 1,
+						      sizeof(*order)));
+	rules = reglib_zalloc(arena, reglib_array_len(0, rd->n_reg_rules + 1,
+						      sizeof(*rules)));
+	if (!order || !rules)
+		goto out;
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		rule = &rd->reg_rules[i];
+		order[i].rule = rule;
+		order[i].band = reglib_deduce_band(rule->freq_range.start_freq_khz);
+		order[i].idx = i;
+	}
+
+	qsort(order, rd->n_reg_rules, sizeof(*order), reglib_opt_rule_cmp);
+
+	/*
+	 * One pass over the sorted rules, the first @num_rules entries of
+	 * @order become the merged rules, each with the lowest domain index
+	 * of the rules merged into it.
+	 */
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		rule = order[i].rule;
+
+		if (num_rules &&
+		    reglib_opt_same_group(&order[num_rules - 1], &order[i])) {
+			merged = &rules[num_rules - 1];
+			if (rule->freq_range.start_freq_khz <=
+			    merged->freq_range.end_freq_khz) {
+				merged->freq_range.end_freq_khz =
+					reglib_max(merged->freq_range.end_freq_khz,
+						   rule->freq_range.end_freq_khz);
+				order[num_rules - 1].idx =
+					reglib_min(order[num_rules - 1].idx,
+						   order[i].idx);
+				continue;
+			}
+		}
+
+		rules[num_rules] = *rule;
+		order[num_rules] = order[i];
+		order[num_rules].rule = &rules[num_rules];
+		num_rules++;
+	}
+
+	qsort(order, num_rules, sizeof(*order), reglib_opt_merged_cmp);
+
+	size_of_regd = reglib_array_len(sizeof(struct ieee80211_regdomain),
+					num_rules + 1,
+					sizeof(struct ieee80211_reg_rule));
+	opt_rd = reglib_zalloc(arena, size_of_regd);
+	if (!opt_rd)
+		goto out;
+
+	opt_rd->n_reg_rules = num_rules;
+	opt_rd->alpha2[0] = rd->alpha2[0];
+	opt_rd->alpha2[1] = rd->alpha2[1];
+	opt_rd->dfs_region = rd->dfs_region;
+
+	for (i = 0; i < num_rules; i++) {
+		opt_rd->reg_rules[i] = *order[i].rule;
+		if (!is_valid_reg_rule(&opt_rd->reg_rules[i])) {
+			reglib_release(arena, opt_rd);
+			opt_rd = NULL;
+			break;
+		}
+	}
+
+out:
+	reglib_release(arena, rules);
+	reglib_release(arena, order);
+	return opt_rd;
+}
+
+struct ieee80211_regdomain *
+reglib_optimize_regdom(struct ieee80211_regdomain *rd)
+{
+	return __reglib_optimize_regdom(rd, NULL);
+}
+
+struct ieee80211_regdomain *
+reglib_optimize_regdom_arena(struct ieee80211_regdomain *rd,
+			     struct reglib_arena *arena)
+{
+	return __reglib_optimize_regdom(rd, arena);
+}
+
+static int reglib_rule_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct ieee80211_reg_rule));
+}
+
+int reglib_optimize_regdom_validate(struct ieee80211_regdomain *rd)
+{
+	struct ieee80211_regdomain *opt_rd, *pairwise_rd;
+	int r = 1;
+
+	opt_rd = __reglib_optimize_regdom(rd, NULL);
+	pairwise_rd = reglib_optimize_regdom_pairwise(rd, NULL);
+
+	if (!opt_rd || !pairwise_rd) {
+		r = opt_rd == pairwise_rd ? 0 : 1;
+		goto out;
+	}
+
+	if (opt_rd->n_reg_rules != pairwise_rd->n_reg_rules)
+		goto out;
+
+	/* The order of the rules is no part of the domain */
+	qsort(opt_rd->reg_rules, opt_rd->n_reg_rules,
+	      sizeof(struct ieee80211_reg_rule), reglib_rule_cmp);
+	qsort(pairwise_rd->reg_rules, pairwise_rd->n_reg_rules,
+	      sizeof(struct ieee80211_reg_rule), reglib_rule_cmp);
+
+	if (memcmp(opt_rd->reg_rules, pairwise_rd->reg_rules,
+		   opt_rd->n_reg_rules * sizeof(struct ieee80211_reg_rule)) == 0)
+		r = 0;
+out:
+	free(pairwise_rd);
+	free(opt_rd);
+	return r;
+}
+
+/*
+ * Frequency index
+ *
+ * The boundaries of all rules split the spectrum of a domain into
+ * segments no rule starts or ends within. For each segment the index
+ * keeps the rules covering all of it, in the order of the domain, so a
+ * channel is looked up with a binary search for the segment its lower
+ * edge falls in and a check of the few rules of that segment, usually
+ * one. A channel fits a rule if it lies within the frequency range of
+ * the rule and is no wider than its maximum bandwidth, the first rule
+ * of the domain a channel fits is the one that applies, alike to how
+ * the kernel picks the rule for a channel.
+ */
+struct reglib_freq_segment {
+	uint32_t start_freq_khz;
+	uint32_t first;
+};
+
+struct reglib_freq_index {
+	unsigned int n_rules;
+	unsigned int n_segments;
+	struct ieee80211_reg_rule *rules;
+	/* n_segments + 1 entries, the last one ends the last segment */
+	struct reglib_freq_segment *segments;
+	/* rules of segment i are rule_idx[segments[i].first] on */
+	uint32_t *rule_idx;
+};
+
+static int reglib_u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Index of @val in the sorted array of distinct values @vals */
+static unsigned int reglib_bsearch_u32(const uint32_t *vals, unsigned int n,
+				       uint32_t val)
+{
+	unsigned int lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (vals[mid] < val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Index of the last segment starting at or below @freq, or -1 */
+static int reglib_freq_segment_find(const struct reglib_freq_index *index,
+				    uint32_t freq)
+{
+	int lo = 0, hi = index->n_segments, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->segments[mid].start_freq_khz <= freq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+/*
+ * The segments [@s, @e) a rule covers. A rule of no width covers none, it
+ * goes with the segment starting at its frequency, or ending there for
+ * the last one.
+ */
+static void reglib_freq_rule_segments(const struct reglib_freq_index *index,
+				      const uint32_t *bounds,
+				      unsigned int n_bounds,
+				      const struct ieee80211_reg_rule *rule,
+				      unsigned int *s, unsigned int *e)
+{
+	const struct ieee80211_freq_range *freq = &rule->freq_range;
+
+	*s = reglib_bsearch_u32(bounds, n_bounds, freq->start_freq_khz);
+	*e = reglib_bsearch_u32(bounds, n_bounds, freq->end_freq_khz);
+	if (*s == *e) {
+		if (*s == index->n_segments)
+			(*s)--;
+		*e = *s + 1;
+	}
+}
+
+struct reglib_freq_index *
+reglib_malloc_freq_index(const struct ieee80211_regdomain *rd)
+{
+	struct reglib_freq_index *index;
+	uint32_t *bounds = NULL, *count = NULL;
+	unsigned int n_bounds = 0, i, j, s, e;
+
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return NULL;
+
+	index->n_rules = rd->n_reg_rules;
+	index->rules = malloc(reglib_array_len(0, rd->n_reg_rules,
+					       sizeof(*index->rules)));
+	bounds = malloc(reglib_array_len(0, 2 * rd->n_reg_rules,
+					 sizeof(*bounds)));
+	if (!index->rules || !bounds)
+		goto err;
+	memcpy(index->rules, rd->reg_rules,
+	       rd->n_reg_rules * sizeof(*index->rules));
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		bounds[n_bounds++] = rd->reg_rules[i].freq_range.start_freq_khz;
+		bounds[n_bounds++] = rd->reg_rules[i].freq_range.end_freq_khz;
+	}
+	qsort(bounds, n_bounds, sizeof(*bounds), reglib_u32_cmp);
+	for (i = 0, j = 0; i < n_bounds; i++) {
+		if (!j || bounds[j - 1] != bounds[i])
+			bounds[j++] = bounds[i];
+	}
+	n_bounds = j;
+
+	/* A lone boundary still makes a segment, for rules of no width */
+	index->n_segments = n_bounds > 1 ? n_bounds - 1 : n_bounds;
+	index->segments = calloc(index->n_segments + 1,
+				 sizeof(*index->segments));
+	count = calloc(index->n_segments + 1, sizeof(*count));
+	if (!index->segments || !count)
+		goto err;
+
+	/* Count the rules of each segment, then lay them out in rule order */
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		reglib_freq_rule_segments(index, bounds, n_bounds,
+					  &rd->reg_rules[i], &s, &e);
+		for (j = s; j < e; j++)
+			count[j]++;
+	}
+
+	for (i = 0, j = 0; i <= index->n_segments; i++) {
+		index->segments[i].start_freq_khz =
+			n_bounds ? bounds[reglib_min(i, n_bounds - 1)] : 0;
+		index->segments[i].first = j;
+		j += count[i];
+		count[i] = index->segments[i].first;
+	}
+
+	index->rule_idx = malloc(reglib_array_len(0, j, sizeof(uint32_t)));
+	if (!index->rule_idx && j)
+		goto err;
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		reglib_freq_rule_segments(index, bounds, n_bounds,
+					  &rd->reg_rules[i], &s, &e);
+		for (j = s; j < e; j++)
+			index->rule_idx[count[j]++] = i;
+	}
+
+	free(count);
+	free(bounds);
+	return index;
+err:
+	free(count);
+	free(bounds);
+	reglib_free_freq_index(index);
+	return NULL;
+}
+
+void reglib_free_freq_index(struct reglib_freq_index *index)
+{
+	if (!index)
+		return;
+
+	free(index->rule_idx);
+	free(index->segments);
+	free(index->rules);
+	free(index);
+}
+
+static const struct ieee80211_reg_rule *
+reglib_freq_segment_rule(const struct reglib_freq_index *index, int seg,
+			 uint32_t start, uint32_t end, uint32_t bw_khz)
+{
+	const struct ieee80211_reg_rule *rule;
+	const struct ieee80211_freq_range *freq;
+	uint32_t i;
+
+	if (seg < 0 || seg >= (int) index->n_segments)
+		return NULL;
+
+	for (i = index->segments[seg].first;
+	     i < index->segments[seg + 1].first; i++) {
+		rule = &index->rules[index->rule_idx[i]];
+		freq = &rule->freq_range;
+		if (start >= freq->start_freq_khz &&
+		    end <= freq->end_freq_khz &&
+		    bw_khz <= freq->max_bandwidth_khz)
+			return rule;
+	}
+
+	return NULL;
+}
+
+static const struct ieee80211_reg_rule *
+__reglib_query_freq(const struct reglib_freq_index *index, int *seg_hint,
+		    uint32_t center_khz, uint32_t bw_khz)
+{
+	const struct ieee80211_reg_rule *rule, *prev;
+	uint64_t end;
+	uint32_t start;
+	int seg = *seg_hint;
 
-	r = reg_rules_intersect(rule1, opt_rule, int_rule);
-	if (r != 0)
-		return r;
-	r = reg_rules_intersect(rule2, opt_rule, int_rule);
-	if (r != 0)
-		return r;
+	if (center_khz < bw_khz / 2)
+		return NULL;
+	start = center_khz - bw_khz / 2;
+	end = (uint64_t) center_khz + bw_khz / 2;
+	if (end > UINT32_MAX)
+		return NULL;
 
-	return 0;
+	/* Channels of a list mostly fall in the segment of the one before */
+	if (seg < 0 || seg >= (int) index->n_segments ||
+	    index->segments[seg].start_freq_khz > start ||
+	    index->segments[seg + 1].start_freq_khz <= start)
+		seg = reglib_freq_segment_find(index, start);
+	*seg_hint = seg;
+
+	rule = reglib_freq_segment_rule(index, seg, start, end, bw_khz);
+
+	/*
+	 * Rule ranges include both of their ends, so rules ending right where
+	 * a channel of no width sits are ones of the previous segment.
+	 */
+	if (start == end && seg > 0 &&
+	    index->segments[seg].start_freq_khz == start) {
+		prev = reglib_freq_segment_rule(index, seg - 1, start, end,
+						bw_khz);
+		if (prev && (!rule || prev < rule))
+			rule = prev;
+	}
+
+	return rule;
 }
 
-static int reg_rule_optimize(struct ieee80211_reg_rule *rule1,
-			     struct ieee80211_reg_rule *rule2,
-			     struct ieee80211_reg_rule *opt_rule)
+int reglib_query_freq(const struct reglib_freq_index *index,
+		      uint32_t center_khz, uint32_t bw_khz,
+		      const struct ieee80211_reg_rule **rule)
 {
-	int r;
+	int seg = -1;
 
-	r = reg_rules_union(rule1, rule2, opt_rule);
-	if (r != 0)
-		return r;
-	r = reglib_opt_rule_fit(rule1, rule2, opt_rule);
-	if (r != 0)
-		return r;
+	*rule = __reglib_query_freq(index, &seg, center_khz, bw_khz);
 
-	return 0;
+	return *rule ? 0 : -ENOENT;
+}
+
+unsigned int reglib_query_freqs(const struct reglib_freq_index *index,
+				struct reglib_freq_query *queries,
+				unsigned int n)
+{
+	unsigned int i, allowed = 0;
+	int seg = -1;
+
+	for (i = 0; i < n; i++) {
+		queries[i].rule = __reglib_query_freq(index, &seg,
+						      queries[i].center_khz,
+						      queries[i].bw_khz);
+		if (queries[i].rule)
+			allowed++;
+	}
+
+	return allowed;
 }
 
 /*
- * Here's the math explanation:
- *
- * This takes each pivot frequency on the regulatory domain, computes
- * the union between it each regulatory rule on the regulatory domain
- * sequentially, and after that it tries to verify that the pivot frequency
- * fits on it by computing an intersection between it and the union, if
- * a rule exist as a possible intersection then we know the rule can be
- * subset of the combination of the two frequency ranges (union) computed.
+ * regdb writer. Power rules, frequency ranges, rules and rule collections
+ * are each interned on a hash table so identical records are written
+ * once. The file is laid out the way db2bin.py does: the header, power
+ * rules, frequency ranges, rules, collections and last the sorted country
+ * list, followed by room for the signature. The records are put in its
+ * order too, no matter the order the countries were added in: rules are
+ * sorted by frequency range, power rule and flags, each collection by its
+ * rules and the collections by their lists of rules. Power rules and
+ * frequency ranges are in the order the rules of the sorted countries
+ * first use them.
  */
-static unsigned int reg_rule_optimize_rd(struct ieee80211_regdomain *rd,
-					 unsigned int rule_idx,
-					 struct ieee80211_reg_rule *opt_rule,
-					 struct reglib_optimize_map *opt_map)
-{
-	unsigned int i;
-	struct ieee80211_reg_rule *rule1;
-	struct ieee80211_reg_rule *rule2;
+struct reglib_intern_slot {
+	uint32_t hash;
+	uint32_t idx;
+};
 
-	struct ieee80211_reg_rule tmp_optimized_rule;
-	struct ieee80211_reg_rule *tmp_opt_rule;
+struct reglib_intern {
+	uint8_t *data;
+	size_t len, size;
+	/* offset into @data and length of each record */
+	uint32_t *rec_off, *rec_len;
+	uint32_t n, max;
+	struct reglib_intern_slot *slots;
+	uint32_t n_slots;
+};
 
-	struct ieee80211_reg_rule *target_rule;
+struct reglib_writer_country {
+	char alpha2[2];
+	uint8_t dfs_region;
+	uint32_t collection;
+};
 
-	unsigned int optimized = 0;
-	int r;
+struct reglib_regdb_writer {
+	struct reglib_intern powers, freqs, rules, collections;
+	struct reglib_writer_country *countries;
+	unsigned int n_countries, max_countries;
+};
 
-	if (rule_idx > rd->n_reg_rules)
-		return 0;
+static void reglib_intern_release(struct reglib_intern *in)
+{
+	free(in->data);
+	free(in->rec_off);
+	free(in->rec_len);
+	free(in->slots);
+}
 
-	rule1 = &rd->reg_rules[rule_idx];
+static int reglib_intern_grow_slots(struct reglib_intern *in)
+{
+	struct reglib_intern_slot *slots;
+	uint32_t i, j, n_slots = in->n_slots ? 2 * in->n_slots : 64;
 
-	memset(&tmp_optimized_rule, 0, sizeof(struct ieee80211_reg_rule));
-	tmp_opt_rule = &tmp_optimized_rule;
+	if (n_slots < in->n_slots)
+		return -ENOMEM;
 
-	memset(opt_rule, 0, sizeof(*opt_rule));
+	slots = calloc(n_slots, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
 
-	for (i = 0; i < rd->n_reg_rules; i++) {
-		if (rule_idx == i)
-			continue;
-		rule2 = &rd->reg_rules[i];
-		if (opt_map[rule_idx].key != opt_map[i].key)
+	/* Slots hold the record index plus one, zero is free */
+	for (i = 0; i < in->n_slots; i++) {
+		if (!in->slots[i].idx)
 			continue;
+		for (j = in->slots[i].hash & (n_slots - 1); slots[j].idx;
+		     j = (j + 1) & (n_slots - 1))
+			;
+		slots[j] = in->slots[i];
+	}
 
-		target_rule = optimized ? opt_rule : rule1;
-		r = reg_rule_optimize(target_rule, rule2, tmp_opt_rule);
-		if (r != 0)
-			continue;
-		memcpy(opt_rule, tmp_opt_rule, sizeof(*tmp_opt_rule));
+	free(in->slots);
+	in->slots = slots;
+	in->n_slots = n_slots;
+	return 0;
+}
 
-		if (!opt_map[i].optimized) {
-			opt_map[i].optimized = true;
-			optimized++;
-		}
-		if (!opt_map[rule_idx].optimized) {
-			opt_map[rule_idx].optimized = true;
-			optimized++;
+/* Returns the index of the record with @len bytes at @rec, adding it */
+static int reglib_intern(struct reglib_intern *in, const void *rec,
+			 uint32_t len, uint32_t *idx)
+{
+	struct reglib_intern_slot *slot;
+	uint32_t hash, i, max;
+	uint32_t *rec_off, *rec_len;
+	uint8_t *data;
+	size_t size;
+
+	if (2 * (in->n + 1) > in->n_slots && reglib_intern_grow_slots(in))
+		return -ENOMEM;
+
+	hash = reglib_hash_bytes(rec, len);
+	for (i = hash & (in->n_slots - 1); in->slots[i].idx;
+	     i = (i + 1) & (in->n_slots - 1)) {
+		slot = &in->slots[i];
+		if (slot->hash == hash && in->rec_len[slot->idx - 1] == len &&
+		    memcmp(in->data + in->rec_off[slot->idx - 1], rec, len) == 0) {
+			*idx = slot->idx - 1;
+			return 0;
 		}
 	}
-	return optimized;
+
+	if (in->n == in->max) {
+		max = in->max ? 2 * in->max : 64;
+		if (max < in->max)
+			return -ENOMEM;
+		rec_off = realloc(in->rec_off,
+				  reglib_array_len(0, max, sizeof(*rec_off)));
+		if (!rec_off)
+			return -ENOMEM;
+		in->rec_off = rec_off;
+		rec_len = realloc(in->rec_len,
+				  reglib_array_len(0, max, sizeof(*rec_len)));
+		if (!rec_len)
+			return -ENOMEM;
+		in->rec_len = rec_len;
+		in->max = max;
+	}
+
+	if (in->len + len > in->size) {
+		size = in->size ? 2 * in->size : 1024;
+		while (size < in->len + len)
+			size *= 2;
+		data = realloc(in->data, size);
+		if (!data)
+			return -ENOMEM;
+		in->data = data;
+		in->size = size;
+	}
+
+	memcpy(in->data + in->len, rec, len);
+	in->rec_off[in->n] = in->len;
+	in->rec_len[in->n] = len;
+	in->len += len;
+
+	in->slots[i].hash = hash;
+	in->slots[i].idx = in->n + 1;
+	*idx = in->n++;
+	return 0;
 }
 
-struct ieee80211_regdomain *
-reglib_optimize_regdom(struct ieee80211_regdomain *rd)
+static const void *reglib_intern_rec(const struct reglib_intern *in,
+				     uint32_t idx)
 {
-	struct ieee80211_regdomain *opt_rd = NULL;
-	struct ieee80211_reg_rule *reg_rule;
-	struct ieee80211_reg_rule *reg_rule_dst;
-	struct ieee80211_reg_rule optimized_reg_rule;
-	struct ieee80211_reg_rule *opt_reg_rule;
-	struct reglib_optimize_map *opt_map;
-	unsigned int i, idx = 0, non_opt = 0, opt = 0;
-	size_t num_rules, size_of_regd, size_of_opt_map;
-	unsigned int num_opts = 0;
+	return in->data + in->rec_off[idx];
+}
 
-	size_of_opt_map = (rd->n_reg_rules + 2) *
-		sizeof(struct reglib_optimize_map);
-	opt_map = malloc(size_of_opt_map);
-	if (!opt_map)
-		return NULL;
+struct reglib_regdb_writer *reglib_malloc_regdb_writer(void)
+{
+	return calloc(1, sizeof(struct reglib_regdb_writer));
+}
 
-	memset(opt_map, 0, size_of_opt_map);
-	memset(&optimized_reg_rule, 0, sizeof(struct ieee80211_reg_rule));
+void reglib_free_regdb_writer(struct reglib_regdb_writer *writer)
+{
+	if (!writer)
+		return;
 
-	opt_reg_rule = &optimized_reg_rule;
+	reglib_intern_release(&writer->powers);
+	reglib_intern_release(&writer->freqs);
+	reglib_intern_release(&writer->rules);
+	reglib_intern_release(&writer->collections);
+	free(writer->countries);
+	free(writer);
+}
 
-	for (i = 0; i < rd->n_reg_rules; i++) {
-		reg_rule = &rd->reg_rules[i];
-		opt_map[i].key = reglib_rule_key(reg_rule);
+/* A canonical order of the rules of a collection, to intern it by */
+struct reglib_writer_rule_order {
+	uint32_t freq[3];
+	uint32_t idx;
+};
+
+static int reglib_writer_rule_cmp(const void *a, const void *b)
+{
+	const struct reglib_writer_rule_order *r1 = a, *r2 = b;
+	unsigned int i;
+
+	for (i = 0; i < 3; i++) {
+		if (r1->freq[i] != r2->freq[i])
+			return r1->freq[i] < r2->freq[i] ? -1 : 1;
+	}
+
+	return r1->idx < r2->idx ? -1 : r1->idx > r2->idx;
+}
+
+int reglib_regdb_writer_add(struct reglib_regdb_writer *writer,
+			    const struct ieee80211_regdomain *rd)
+{
+	struct reglib_writer_country *countries, *country;
+	struct reglib_writer_rule_order *order;
+	const struct ieee80211_reg_rule *rule;
+	uint32_t power[2], reg_rule[3];
+	uint32_t *coll;
+	unsigned int i, max;
+	int r = 0;
+
+	for (i = 0; i < writer->n_countries; i++) {
+		if (memcmp(writer->countries[i].alpha2, rd->alpha2, 2) == 0)
+			return -EEXIST;
 	}
+
+	if (writer->n_countries == writer->max_countries) {
+		max = writer->max_countries ? 2 * writer->max_countries : 64;
+		countries = realloc(writer->countries,
+				    reglib_array_len(0, max, sizeof(*countries)));
+		if (!countries)
+			return -ENOMEM;
+		writer->countries = countries;
+		writer->max_countries = max;
+	}
+
+	order = malloc(reglib_array_len(0, rd->n_reg_rules, sizeof(*order)));
+	/* The rule count followed by the rule indexes */
+	coll = malloc(reglib_array_len(sizeof(*coll), rd->n_reg_rules,
+				       sizeof(*coll)));
+	if (!order || !coll) {
+		r = -ENOMEM;
+		goto out;
+	}
+
 	for (i = 0; i < rd->n_reg_rules; i++) {
-		reg_rule = &rd->reg_rules[i];
-		if (opt_map[i].optimized)
-			continue;
-		num_opts = reg_rule_optimize_rd(rd, i, opt_reg_rule, opt_map);
-		if (!num_opts)
-			non_opt++;
-		else
-			opt += (num_opts ? 1 : 0);
+		rule = &rd->reg_rules[i];
+
+		order[i].freq[0] = rule->freq_range.start_freq_khz;
+		order[i].freq[1] = rule->freq_range.end_freq_khz;
+		order[i].freq[2] = rule->freq_range.max_bandwidth_khz;
+		power[0] = rule->power_rule.max_antenna_gain;
+		power[1] = rule->power_rule.max_eirp;
+		reg_rule[2] = rule->flags;
+
+		r = reglib_intern(&writer->freqs, order[i].freq,
+				  sizeof(order[i].freq), &reg_rule[0]);
+		if (!r)
+			r = reglib_intern(&writer->powers, power, sizeof(power),
+					  &reg_rule[1]);
+		if (!r)
+			r = reglib_intern(&writer->rules, reg_rule,
+					  sizeof(reg_rule), &order[i].idx);
+		if (r)
+			goto out;
 	}
 
-	num_rules = non_opt + opt;
+	qsort(order, rd->n_reg_rules, sizeof(*order), reglib_writer_rule_cmp);
+	coll[0] = rd->n_reg_rules;
+	for (i = 0; i < rd->n_reg_rules; i++)
+		coll[1 + i] = order[i].idx;
 
-	if (num_rules > rd->n_reg_rules)
-		goto fail_opt_map;
+	country = &writer->countries[writer->n_countries];
+	r = reglib_intern(&writer->collections, coll,
+			  (1 + rd->n_reg_rules) * sizeof(*coll),
+			  &country->collection);
+	if (r)
+		goto out;
 
-	size_of_regd = reglib_array_len(sizeof(struct ieee80211_regdomain),
-					num_rules + 1,
-					sizeof(struct ieee80211_reg_rule));
+	country->alpha2[0] = rd->alpha2[0];
+	country->alpha2[1] = rd->alpha2[1];
+	country->dfs_region = rd->dfs_region;
+	writer->n_countries++;
+out:
+	free(coll);
+	free(order);
+	return r;
+}
 
-	opt_rd = malloc(size_of_regd);
-	if (!opt_rd)
-		goto fail_opt_map;
-	memset(opt_rd, 0, size_of_regd);
+static int reglib_writer_country_cmp(const void *a, const void *b)
+{
+	const struct reglib_writer_country *c1 = a, *c2 = b;
 
-	opt_rd->n_reg_rules = num_rules;
-	opt_rd->alpha2[0] = rd->alpha2[0];
-	opt_rd->alpha2[1] = rd->alpha2[1];
-	opt_rd->dfs_region = rd->dfs_region;
+	return memcmp(c1->alpha2, c2->alpha2, 2);
+}
 
-	memset(opt_map, 0, size_of_opt_map);
-	memset(&optimized_reg_rule, 0, sizeof(struct ieee80211_reg_rule));
+static void reglib_put_be32(uint8_t **p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
 
-	opt_reg_rule = &optimized_reg_rule;
+/* A rule by what db2bin.py sorts it by, its freq range, power and flags */
+struct reglib_writer_rule_key {
+	uint32_t key[6];
+	uint32_t idx;
+};
 
-	for (i = 0; i < rd->n_reg_rules; i++) {
-		reg_rule = &rd->reg_rules[i];
-		opt_map[i].key = reglib_rule_key(reg_rule);
+static int reglib_writer_rule_key_cmp(const void *a, const void *b)
+{
+	const struct reglib_writer_rule_key *r1 = a, *r2 = b;
+	unsigned int i;
+
+	for (i = 0; i < 6; i++) {
+		if (r1->key[i] != r2->key[i])
+			return r1->key[i] < r2->key[i] ? -1 : 1;
 	}
 
-	for (i = 0; i < rd->n_reg_rules; i++) {
-		reg_rule = &rd->reg_rules[i];
-		reg_rule_dst = &opt_rd->reg_rules[idx];
-		if (opt_map[i].optimized)
-			continue;
-		num_opts = reg_rule_optimize_rd(rd, i, opt_reg_rule, opt_map);
-		if (!num_opts)
-			memcpy(reg_rule_dst, reg_rule, sizeof(struct ieee80211_reg_rule));
-		else
-			memcpy(reg_rule_dst, opt_reg_rule, sizeof(struct ieee80211_reg_rule));
-		idx++;
+	return 0;
+}
+
+static int reglib_writer_pos_cmp(const void *a, const void *b)
+{
+	const uint32_t *p1 = a, *p2 = b;
+
+	return *p1 < *p2 ? -1 : *p1 > *p2;
+}
+
+/* A collection as the sorted positions of its rules, compared as tuples */
+struct reglib_writer_coll_key {
+	const uint32_t *rules;
+	uint32_t n;
+	uint32_t idx;
+};
+
+static int reglib_writer_coll_key_cmp(const void *a, const void *b)
+{
+	const struct reglib_writer_coll_key *c1 = a, *c2 = b;
+	uint32_t i;
+
+	for (i = 0; i < c1->n && i < c2->n; i++) {
+		if (c1->rules[i] != c2->rules[i])
+			return c1->rules[i] < c2->rules[i] ? -1 : 1;
 	}
 
-	if (idx != num_rules)
-		goto fail;
+	return c1->n < c2->n ? -1 : c1->n > c2->n;
+}
 
-	for (i = 0; i < opt_rd->n_reg_rules; i++) {
-		reg_rule = &opt_rd->reg_rules[i];
-		if (!is_valid_reg_rule(reg_rule))
-			goto fail;
+/*
+ * Where the records go, by their interned index: the position of each in
+ * its section, and the collections sorted with the rule positions of each
+ * sorted. The order of the countries is settled before this.
+ */
+struct reglib_writer_layout {
+	struct reglib_writer_rule_key *rules;
+	uint32_t *rule_pos, *power_pos, *freq_pos, *coll_pos;
+	struct reglib_writer_coll_key *colls;
+	uint32_t *coll_rules;
+};
+
+static void reglib_writer_free_layout(struct reglib_writer_layout *layout)
+{
+	free(layout->rules);
+	free(layout->rule_pos);
+	free(layout->power_pos);
+	free(layout->freq_pos);
+	free(layout->coll_pos);
+	free(layout->colls);
+	free(layout->coll_rules);
+}
+
+/* Hands out positions in the order of first use */
+static void reglib_writer_use(uint32_t *pos, uint32_t idx, uint32_t *next)
+{
+	if (pos[idx] == UINT32_MAX)
+		pos[idx] = (*next)++;
+}
+
+static int reglib_writer_lay_out(const struct reglib_regdb_writer *writer,
+				 struct reglib_writer_layout *layout)
+{
+	const struct reglib_writer_coll_key *coll;
+	const uint32_t *rec, *power, *freq;
+	uint32_t i, j, n_powers, n_freqs;
+	uint32_t *coll_rules;
+
+	memset(layout, 0, sizeof(*layout));
+
+	layout->rules = malloc(reglib_array_len(0, writer->rules.n + 1,
+						sizeof(*layout->rules)));
+	layout->rule_pos = malloc(reglib_array_len(0, writer->rules.n + 1,
+						   sizeof(uint32_t)));
+	layout->power_pos = malloc(reglib_array_len(0, writer->powers.n + 1,
+						    sizeof(uint32_t)));
+	layout->freq_pos = malloc(reglib_array_len(0, writer->freqs.n + 1,
+						   sizeof(uint32_t)));
+	layout->coll_pos = malloc(reglib_array_len(0,
+						   writer->collections.n + 1,
+						   sizeof(uint32_t)));
+	layout->colls = malloc(reglib_array_len(0, writer->collections.n + 1,
+						sizeof(*layout->colls)));
+	/* No more than the collections take with their rule counts */
+	layout->coll_rules = malloc(writer->collections.len + 1);
+	if (!layout->rules || !layout->rule_pos || !layout->power_pos ||
+	    !layout->freq_pos || !layout->coll_pos || !layout->colls ||
+	    !layout->coll_rules) {
+		reglib_writer_free_layout(layout);
+		return -ENOMEM;
 	}
 
-	free(opt_map);
-	return opt_rd;
-fail:
-	free(opt_rd);
-fail_opt_map:
-	free(opt_map);
-	return NULL;
+	for (i = 0; i < writer->rules.n; i++) {
+		rec = reglib_intern_rec(&writer->rules, i);
+		freq = reglib_intern_rec(&writer->freqs, rec[0]);
+		power = reglib_intern_rec(&writer->powers, rec[1]);
+		layout->rules[i].key[0] = freq[0];
+		layout->rules[i].key[1] = freq[1];
+		layout->rules[i].key[2] = freq[2];
+		layout->rules[i].key[3] = power[0];
+		layout->rules[i].key[4] = power[1];
+		layout->rules[i].key[5] = rec[2];
+		layout->rules[i].idx = i;
+	}
+	/* Interned rules all differ in their keys, so the order is total */
+	qsort(layout->rules, writer->rules.n, sizeof(*layout->rules),
+	      reglib_writer_rule_key_cmp);
+	for (i = 0; i < writer->rules.n; i++)
+		layout->rule_pos[layout->rules[i].idx] = i;
+
+	coll_rules = layout->coll_rules;
+	for (i = 0; i < writer->collections.n; i++) {
+		rec = reglib_intern_rec(&writer->collections, i);
+		for (j = 0; j < rec[0]; j++)
+			coll_rules[j] = layout->rule_pos[rec[1 + j]];
+		qsort(coll_rules, rec[0], sizeof(*coll_rules),
+		      reglib_writer_pos_cmp);
+		layout->colls[i].rules = coll_rules;
+		layout->colls[i].n = rec[0];
+		layout->colls[i].idx = i;
+		coll_rules += rec[0];
+	}
+	qsort(layout->colls, writer->collections.n, sizeof(*layout->colls),
+	      reglib_writer_coll_key_cmp);
+	for (i = 0; i < writer->collections.n; i++)
+		layout->coll_pos[layout->colls[i].idx] = i;
+
+	memset(layout->power_pos, 0xff, writer->powers.n * sizeof(uint32_t));
+	memset(layout->freq_pos, 0xff, writer->freqs.n * sizeof(uint32_t));
+	n_powers = n_freqs = 0;
+
+	for (i = 0; i < writer->n_countries; i++) {
+		coll = &layout->colls[
+			layout->coll_pos[writer->countries[i].collection]];
+		for (j = 0; j < coll->n; j++) {
+			rec = reglib_intern_rec(&writer->rules,
+						layout->rules[coll->rules[j]].idx);
+			reglib_writer_use(layout->freq_pos, rec[0], &n_freqs);
+			reglib_writer_use(layout->power_pos, rec[1], &n_powers);
+		}
+	}
+
+	/* Records of a country that failed to be added are not used */
+	for (i = 0; i < writer->freqs.n; i++)
+		reglib_writer_use(layout->freq_pos, i, &n_freqs);
+	for (i = 0; i < writer->powers.n; i++)
+		reglib_writer_use(layout->power_pos, i, &n_powers);
+
+	return 0;
+}
+
+uint8_t *reglib_regdb_writer_build(struct reglib_regdb_writer *writer,
+				   uint32_t siglen, size_t *len)
+{
+	uint32_t power_ptr, freq_ptr, rule_ptr, coll_ptr, country_ptr;
+	struct reglib_writer_layout layout;
+	const struct reglib_writer_coll_key *coll;
+	uint32_t *coll_offs = NULL;
+	const uint32_t *rec;
+	uint64_t size;
+	uint8_t *db, *p;
+	unsigned int i, j;
+
+	power_ptr = sizeof(struct regdb_file_header);
+	freq_ptr = power_ptr + writer->powers.n *
+		   sizeof(struct regdb_file_power_rule);
+	rule_ptr = freq_ptr + writer->freqs.n *
+		   sizeof(struct regdb_file_freq_range);
+	coll_ptr = rule_ptr + writer->rules.n *
+		   sizeof(struct regdb_file_reg_rule);
+
+	/* Collections are stored as the rule count and indexes already */
+	size = (uint64_t) coll_ptr + writer->collections.len;
+	country_ptr = size;
+	size += (uint64_t) writer->n_countries *
+		sizeof(struct regdb_file_reg_country);
+	size += siglen;
+	if (size > UINT32_MAX)
+		return NULL;
+
+	qsort(writer->countries, writer->n_countries,
+	      sizeof(*writer->countries), reglib_writer_country_cmp);
+
+	if (reglib_writer_lay_out(writer, &layout))
+		return NULL;
+
+	db = calloc(1, size);
+	coll_offs = malloc(reglib_array_len(0, writer->collections.n + 1,
+					    sizeof(*coll_offs)));
+	if (!db || !coll_offs) {
+		free(db);
+		db = NULL;
+		goto out;
+	}
+
+	p = db;
+	reglib_put_be32(&p, REGDB_MAGIC);
+	reglib_put_be32(&p, REGDB_VERSION);
+	reglib_put_be32(&p, country_ptr);
+	reglib_put_be32(&p, writer->n_countries);
+	reglib_put_be32(&p, siglen);
+
+	for (i = 0; i < writer->powers.n; i++) {
+		rec = reglib_intern_rec(&writer->powers, i);
+		p = db + power_ptr + layout.power_pos[i] *
+		    sizeof(struct regdb_file_power_rule);
+		reglib_put_be32(&p, rec[0]);
+		reglib_put_be32(&p, rec[1]);
+	}
+
+	for (i = 0; i < writer->freqs.n; i++) {
+		rec = reglib_intern_rec(&writer->freqs, i);
+		p = db + freq_ptr + layout.freq_pos[i] *
+		    sizeof(struct regdb_file_freq_range);
+		reglib_put_be32(&p, rec[0]);
+		reglib_put_be32(&p, rec[1]);
+		reglib_put_be32(&p, rec[2]);
+	}
+
+	p = db + rule_ptr;
+	for (i = 0; i < writer->rules.n; i++) {
+		rec = reglib_intern_rec(&writer->rules, layout.rules[i].idx);
+		reglib_put_be32(&p, freq_ptr + layout.freq_pos[rec[0]] *
+				sizeof(struct regdb_file_freq_range));
+		reglib_put_be32(&p, power_ptr + layout.power_pos[rec[1]] *
+				sizeof(struct regdb_file_power_rule));
+		reglib_put_be32(&p, rec[2]);
+	}
+
+	for (i = 0; i < writer->collections.n; i++) {
+		coll = &layout.colls[i];
+		coll_offs[coll->idx] = p - db;
+		reglib_put_be32(&p, coll->n);
+		for (j = 0; j < coll->n; j++)
+			reglib_put_be32(&p, rule_ptr + coll->rules[j] *
+					sizeof(struct regdb_file_reg_rule));
+	}
+
+	for (i = 0; i < writer->n_countries; i++) {
+		*p++ = writer->countries[i].alpha2[0];
+		*p++ = writer->countries[i].alpha2[1];
+		*p++ = 0;
+		*p++ = writer->countries[i].dfs_region;
+		reglib_put_be32(&p, coll_offs[writer->countries[i].collection]);
+	}
+
+	*len = size;
+out:
+	free(coll_offs);
+	reglib_writer_free_layout(&layout);
+	return db;
 }
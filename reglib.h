@@ -48,6 +48,12 @@ struct ieee80211_regdomain {
 #define REGLIB_MW_TO_DBM(gain) (10 * log10(gain))
 #define REGLIB_MW_TO_MBM(gain) (REGLIB_DBM_TO_MBM(REGLIB_MW_TO_DBM(gain)))
 
+/* Length of the SHA1 sum used to sign regulatory databases */
+#define REGLIB_DIGEST_LEN 20
+
+struct reglib_intersect_cache;
+struct reglib_regdb_compiled;
+
 /**
  * struct reglib_regdb_ctx - reglib regdb context
  *
@@ -71,6 +77,23 @@ struct ieee80211_regdomain {
  * 	sum of the regulatory database at the end of the
  * 	regulatory database can be verified with the one of
  * 	the trusted public keys.
+ * @digest: SHA1 sum of the first @dblen bytes of @db, computed once
+ * 	when the context is created, see reglib_regdb_digest().
+ * @header: the db file header
+ * @num_countries: number of countries in @countries
+ * @countries: the country list of the db
+ * @alpha2_idx: direct index from an uppercase alpha2 into @countries,
+ * 	see REGLIB_ALPHA2_IDX(). Entries hold the country index plus one,
+ * 	zero meaning the alpha2 is not in the db.
+ * @world_idx: as @alpha2_idx, for the world regulatory domain "00"
+ * @isect_cache: cache of reglib_intersect_alpha2_set_cached(), created on
+ * 	first use
+ * @refcount: references on the context, see reglib_get_regdb_ctx()
+ * @compiled: compiled form of the db once reglib_regdb_compile() built it
+ * @builtin: @db and @compiled are part of the program, see
+ * 	reglib_malloc_regdb_ctx_builtin()
+ * @trusted: every offset and count of @db was found to be within it when
+ * 	the context was created, so they are followed without checks
  */
 struct reglib_regdb_ctx {
 	int fd;
@@ -80,12 +103,25 @@ struct reglib_regdb_ctx {
 	uint32_t siglen;
 	uint32_t dblen;
 	bool verified;
+	uint8_t digest[REGLIB_DIGEST_LEN];
 
 	struct regdb_file_header *header;
 	uint32_t num_countries;
 	struct regdb_file_reg_country *countries;
+
+	uint32_t alpha2_idx[26 * 26];
+	uint32_t world_idx;
+
+	struct reglib_intersect_cache *isect_cache;
+	unsigned int refcount;
+	struct reglib_regdb_compiled *compiled;
+	bool builtin;
+	bool trusted;
 };
 
+#define REGLIB_ALPHA2_IDX(alpha2) \
+	(((alpha2)[0] - 'A') * 26 + ((alpha2)[1] - 'A'))
+
 static inline int reglib_is_world_regdom(const char *alpha2)
 {
 	if (alpha2[0] == '0' && alpha2[1] == '0')
@@ -129,6 +165,50 @@ void *
 reglib_get_file_ptr(uint8_t *db, size_t dblen, size_t structlen, uint32_t ptr);
 int reglib_verify_db_signature(uint8_t *db, size_t dblen, size_t siglen);
 
+/**
+ * struct reglib_arena - bump allocator for reglib operations
+ *
+ * The _arena variants of reglib operations take all of the regulatory
+ * domains and other intermediate data they need from an arena instead
+ * of the heap, including the result they return. Nothing allocated from
+ * an arena is free()'d individually, it all goes away at once with
+ * reglib_arena_reset() or reglib_free_arena(). This avoids the churn of
+ * malloc() / free() for every intermediate domain when doing many such
+ * operations in a row, resetting the arena in between.
+ */
+struct reglib_arena;
+
+/**
+ * reglib_malloc_arena - create an arena
+ *
+ * @chunk_size: size in bytes of the chunks the arena allocates from the
+ * 	heap as it grows, 0 for a default suitable for a few domains
+ */
+struct reglib_arena *reglib_malloc_arena(size_t chunk_size);
+
+/**
+ * reglib_arena_zalloc - allocate zeroed memory from an arena
+ *
+ * @arena: the arena
+ * @size: size in bytes
+ *
+ * The memory remains valid until the arena is reset or freed.
+ */
+void *reglib_arena_zalloc(struct reglib_arena *arena, size_t size);
+
+/**
+ * reglib_arena_reset - release everything allocated from an arena
+ *
+ * @arena: the arena
+ *
+ * If the arena had to grow its chunks get merged into one, so repeating
+ * a similar operation on it does not have to go to the heap again.
+ */
+void reglib_arena_reset(struct reglib_arena *arena);
+
+/* reglib_free_arena - release an arena and everything allocated from it */
+void reglib_free_arena(struct reglib_arena *arena);
+
 /**
  * reglib_malloc_regdb_ctx - create a regdb context for usage with reglib
  *
@@ -138,20 +218,213 @@ int reglib_verify_db_signature(uint8_t *db, size_t dblen, size_t siglen);
  * to iterating over it it must check the signature. Use this context helper
  * to let you query the db within different contexts in your program and
  * just be sure to call reglib_free_regdb_ctx() when done. This helper will
- * open the file passed and mmap() it.
+ * open the file passed and mmap() it. All of the offsets and counts of the
+ * db are checked once here, a malformed db gets NULL rather than exiting
+ * the program, and lookups on the context do not check them again.
  */
 const struct reglib_regdb_ctx *reglib_malloc_regdb_ctx(const char *regdb_file);
 
+/* Do not check the signature of the db, the context is not verified */
+#define REGLIB_CTX_NO_VERIFY	(1 << 0)
+
+/**
+ * reglib_malloc_regdb_ctx_flags - reglib_malloc_regdb_ctx() with flags
+ *
+ * @regdb_file: file name
+ * @flags: REGLIB_CTX_* flags
+ *
+ * Only meant for handling databases that are known to be good or are
+ * not going to be trusted anyway, such as the ones of tests and
+ * benchmarks, with %REGLIB_CTX_NO_VERIFY.
+ */
+const struct reglib_regdb_ctx *
+reglib_malloc_regdb_ctx_flags(const char *regdb_file, unsigned int flags);
+
+/**
+ * reglib_regdb_digest - get the SHA1 sum of the db of a regdb context
+ *
+ * @ctx: the regdb context
+ *
+ * Returns the REGLIB_DIGEST_LEN bytes SHA1 sum of the db without its
+ * signature. The sum is taken once when @ctx is created, whether or not
+ * signature verification was compiled in, so caches of data derived from
+ * a db can key on it instead of hashing the db again.
+ */
+const uint8_t *reglib_regdb_digest(const struct reglib_regdb_ctx *ctx);
+
+/**
+ * reglib_malloc_regdb_ctx_fd - create a regdb context from an open file
+ *
+ * @fd: file descriptor of the regdb, open for reading
+ *
+ * Same as reglib_malloc_regdb_ctx() for a file you already have open. On
+ * success the context owns @fd and reglib_free_regdb_ctx() closes it, on
+ * failure @fd is left open.
+ */
+const struct reglib_regdb_ctx *reglib_malloc_regdb_ctx_fd(int fd);
+
+/* reglib_malloc_regdb_ctx_fd() with REGLIB_CTX_* flags */
+const struct reglib_regdb_ctx *
+reglib_malloc_regdb_ctx_fd_flags(int fd, unsigned int flags);
+
+/**
+ * reglib_malloc_regdb_ctx_search - create a regdb context from a search path
+ *
+ * @paths: NULL terminated list of regdb files in order of preference
+ * @path: if not NULL set to the entry of @paths used
+ *
+ * Creates a context for the first file of @paths that can be opened, the
+ * file is opened only once. Later entries are not tried if that file is
+ * not a valid regdb. Returns NULL with errno set to the error opening the
+ * last entry if none could be opened, or to EINVAL if the file found is
+ * not a valid regdb.
+ */
+const struct reglib_regdb_ctx *
+reglib_malloc_regdb_ctx_search(const char *const *paths, const char **path);
+
+/**
+ * struct reglib_regdb_builtin - a regdb compiled into the program
+ *
+ * What regdb2c writes out for a verified regulatory.bin: the file itself,
+ * along with everything a context otherwise works out when it is created
+ * or compiled, so a context for it is ready to use as is.
+ *
+ * @db: the regulatory.bin, signature included
+ * @real_dblen: size in bytes of @db
+ * @siglen: size in bytes of the signature at the end of @db
+ * @digest: SHA1 sum of @db without its signature
+ * @alpha2_idx: as the one of struct reglib_regdb_ctx
+ * @world_idx: as the one of struct reglib_regdb_ctx
+ * @compiled: compiled form of @db
+ */
+struct reglib_regdb_builtin {
+	const uint8_t *db;
+	uint32_t real_dblen;
+	uint32_t siglen;
+	uint8_t digest[REGLIB_DIGEST_LEN];
+	uint32_t alpha2_idx[26 * 26];
+	uint32_t world_idx;
+	const struct reglib_regdb_compiled *compiled;
+};
+
+/*
+ * The regdb built into libreg with make BUILTIN_REGDB=<regulatory.bin>,
+ * only there when CONFIG_REGDB_BUILTIN is set.
+ */
+extern const struct reglib_regdb_builtin reglib_builtin_regdb;
+
+/**
+ * reglib_malloc_regdb_ctx_builtin - create a regdb context for a builtin db
+ *
+ * @builtin: the db, usually &reglib_builtin_regdb
+ *
+ * Nothing is opened, mapped, hashed or decoded, the context uses the
+ * tables of @builtin as they are and is verified as the db was when it
+ * was built in. Its compiled form is there from the start.
+ */
+const struct reglib_regdb_ctx *
+reglib_malloc_regdb_ctx_builtin(const struct reglib_regdb_builtin *builtin);
+
 /**
  * reglib_free_regdb_ctx - free a regdb context used with reglib
  *
  * @regdb_ctx: the reglib regdb context created with reglib_malloc_regdb_ctx()
  *
  * This will do all the handy work to close up, munmap, and free the
- * reglib regdb context passed.
+ * reglib regdb context passed. If references were taken on it with
+ * reglib_get_regdb_ctx() this only drops one of them, the context goes
+ * away with the last.
  */
 void reglib_free_regdb_ctx(const struct reglib_regdb_ctx *regdb_ctx);
 
+/**
+ * reglib_get_regdb_ctx - take a reference on a regdb context
+ *
+ * @regdb_ctx: the regdb context
+ *
+ * Returns @regdb_ctx, which stays valid until reglib_free_regdb_ctx() is
+ * called once more than this was.
+ */
+const struct reglib_regdb_ctx *
+reglib_get_regdb_ctx(const struct reglib_regdb_ctx *regdb_ctx);
+
+/**
+ * struct reglib_regdb_watch - a regdb context that follows its file
+ *
+ * Keeps a context for a regdb file and replaces it with a new one when
+ * the file gets rewritten or replaced, as a package update does. Readers
+ * get the current context with reglib_regdb_watch_get() without ever
+ * waiting on a reload in progress and keep using the context they got as
+ * long as they like, it goes away once the last of them lets go of it.
+ * The file must be replaced by renaming a new one over it, as package
+ * managers do: like for any context the db is mapped, rewriting it in
+ * place pulls it from under the readers of the old context.
+ */
+struct reglib_regdb_watch;
+
+/**
+ * reglib_malloc_regdb_watch - start watching a regdb file
+ *
+ * @regdb_file: the regdb file to watch
+ * @ctx: context for @regdb_file you already have, whose reference the
+ *	watch takes over, or NULL to have the watch create it
+ *
+ * Returns NULL if the file can not be watched or is not a valid regdb,
+ * @ctx is then still yours.
+ */
+struct reglib_regdb_watch *
+reglib_malloc_regdb_watch(const char *regdb_file,
+			  const struct reglib_regdb_ctx *ctx);
+
+/* reglib_free_regdb_watch - stop watching and drop the watch's context */
+void reglib_free_regdb_watch(struct reglib_regdb_watch *watch);
+
+/**
+ * reglib_regdb_watch_fd - file descriptor to poll a regdb watch on
+ *
+ * @watch: the regdb watch
+ *
+ * The descriptor becomes readable when the regdb file may have changed,
+ * call reglib_regdb_watch_process() then.
+ */
+int reglib_regdb_watch_fd(const struct reglib_regdb_watch *watch);
+
+/**
+ * reglib_regdb_watch_process - reload the regdb of a watch if it changed
+ *
+ * @watch: the regdb watch
+ *
+ * Consumes the pending notifications of the watch and reloads the regdb
+ * if they were about its file, see reglib_regdb_watch_reload(). Returns 0
+ * if there was nothing to do.
+ */
+int reglib_regdb_watch_process(struct reglib_regdb_watch *watch);
+
+/**
+ * reglib_regdb_watch_reload - reload the regdb of a watch
+ *
+ * @watch: the regdb watch
+ *
+ * Opens and verifies the regdb file again and, if its contents changed,
+ * makes the new context the current one. The old one is released when
+ * the readers still using it are done. Returns 1 if the context changed,
+ * 0 if the file is the same as before and -EINVAL if it is not a valid
+ * regdb, in which case the watch keeps the context it had. Only one
+ * thread may reload a watch at a time, any number may read it meanwhile.
+ */
+int reglib_regdb_watch_reload(struct reglib_regdb_watch *watch);
+
+/**
+ * reglib_regdb_watch_get - get the current context of a regdb watch
+ *
+ * @watch: the regdb watch
+ *
+ * Returns a reference on the current context, release it with
+ * reglib_free_regdb_ctx().
+ */
+const struct reglib_regdb_ctx *
+reglib_regdb_watch_get(struct reglib_regdb_watch *watch);
+
 const struct ieee80211_regdomain *
 reglib_get_rd_idx(unsigned int idx, const struct reglib_regdb_ctx *ctx);
 
@@ -160,9 +433,161 @@ reglib_get_rd_idx(unsigned int idx, const struct reglib_regdb_ctx *ctx);
 	     __rd != NULL;					\
 	     __rd = reglib_get_rd_idx(++__idx, __ctx))		\
 
+/**
+ * struct reglib_rd_view - read-only view of a regulatory domain in a regdb
+ *
+ * A view refers to the rules of a country directly in the mmap() of the
+ * db of its reglib regdb context, rules are only decoded one at a time
+ * as you ask for them with reglib_rd_view_rule(). This lets you scan the
+ * entire database without any heap allocation. A view is only valid for
+ * as long as its context is.
+ *
+ * @ctx: the reglib regdb context the view refers to
+ * @reg_rule_ptrs: the country's array of rule pointers in the db, these
+ * 	are still in network byte order
+ * @n_reg_rules: number of rules of the country
+ * @alpha2: the country's alpha2
+ * @dfs_region: the country's DFS region
+ */
+struct reglib_rd_view {
+	const struct reglib_regdb_ctx *ctx;
+	const uint32_t *reg_rule_ptrs;
+	uint32_t n_reg_rules;
+	char alpha2[2];
+	uint8_t dfs_region;
+};
+
+/**
+ * reglib_get_rd_view_idx - get a view of the country at an index
+ *
+ * @idx: index of the country in the db
+ * @ctx: the reglib regdb context
+ * @view: the view to fill in
+ *
+ * Returns 0 on success or -ENOENT once @idx is past the last country.
+ */
+int reglib_get_rd_view_idx(unsigned int idx,
+			   const struct reglib_regdb_ctx *ctx,
+			   struct reglib_rd_view *view);
+
+/**
+ * reglib_rd_view_rule - decode a rule of a regulatory domain view
+ *
+ * @view: the regulatory domain view
+ * @i: index of the rule, must be below @view->n_reg_rules
+ * @rule: host byte order copy of the rule to fill in
+ */
+void reglib_rd_view_rule(const struct reglib_rd_view *view, unsigned int i,
+			 struct ieee80211_reg_rule *rule);
+
+/**
+ * reglib_rd_view2rd - build a regulatory domain from a view
+ *
+ * @view: the regulatory domain view
+ *
+ * Returns a regulatory domain you must free(), this is what the
+ * allocating reglib_get_rd_idx() and reglib_get_rd_alpha2_ctx() use.
+ */
+struct ieee80211_regdomain *
+reglib_rd_view2rd(const struct reglib_rd_view *view);
+
+/* reglib_is_valid_rd() for a regulatory domain view */
+int reglib_is_valid_rd_view(const struct reglib_rd_view *view);
+
+#define reglib_for_each_country_view(__view, __idx, __ctx)		\
+	for (; reglib_get_rd_view_idx(__idx, __ctx, __view) == 0;	\
+	     __idx++)							\
+
+#define reglib_for_each_rd_view_rule(__rule, __i, __view)		\
+	for (__i = 0;							\
+	     __i < (__view)->n_reg_rules &&				\
+	     (reglib_rd_view_rule(__view, __i, __rule), 1);		\
+	     __i++)							\
+
+/**
+ * struct reglib_regdb_compiled - compiled form of a regdb
+ *
+ * The rules of the db in host byte order as arrays of each of their
+ * members, each distinct rule of the file stored once, and the countries
+ * as spans of indexes into them. Going through all countries goes through
+ * a few contiguous arrays instead of following the offsets of the file
+ * with a bounds check and byte swap each.
+ *
+ * @n_rules: number of distinct rules
+ * @start_freq_khz: start frequency of each rule
+ * @end_freq_khz: end frequency of each rule
+ * @max_bandwidth_khz: maximum bandwidth of each rule
+ * @max_antenna_gain: maximum antenna gain of each rule
+ * @max_eirp: maximum EIRP of each rule
+ * @flags: flags of each rule
+ * @n_countries: number of countries, same as the db's
+ * @alpha2: alpha2 of each country
+ * @dfs_region: DFS region of each country
+ * @rules_first: the rules of country i are @rule_idx[@rules_first[i]] up
+ * 	to @rule_idx[@rules_first[i + 1]], there are @n_countries + 1
+ * @rule_idx: indexes into the rule arrays
+ */
+struct reglib_regdb_compiled {
+	uint32_t n_rules;
+	uint32_t *start_freq_khz;
+	uint32_t *end_freq_khz;
+	uint32_t *max_bandwidth_khz;
+	uint32_t *max_antenna_gain;
+	uint32_t *max_eirp;
+	uint32_t *flags;
+
+	uint32_t n_countries;
+	char (*alpha2)[2];
+	uint8_t *dfs_region;
+	uint32_t *rules_first;
+	uint32_t *rule_idx;
+};
+
+/**
+ * reglib_regdb_compile - get the compiled form of a regdb
+ *
+ * @ctx: the regdb context
+ *
+ * Builds the compiled form of the db of @ctx on first use, it goes away
+ * with @ctx. Once there, reglib_get_rd_idx(), the intersections and
+ * everything built on them decode countries from it. Returns NULL if
+ * there is not enough memory for it, everything works off the file then.
+ */
+const struct reglib_regdb_compiled *
+reglib_regdb_compile(const struct reglib_regdb_ctx *ctx);
+
+/* Copies rule @r of a compiled regdb */
+static inline void
+reglib_compiled_rule(const struct reglib_regdb_compiled *compiled,
+		     uint32_t r, struct ieee80211_reg_rule *rule)
+{
+	rule->freq_range.start_freq_khz = compiled->start_freq_khz[r];
+	rule->freq_range.end_freq_khz = compiled->end_freq_khz[r];
+	rule->freq_range.max_bandwidth_khz = compiled->max_bandwidth_khz[r];
+	rule->power_rule.max_antenna_gain = compiled->max_antenna_gain[r];
+	rule->power_rule.max_eirp = compiled->max_eirp[r];
+	rule->flags = compiled->flags[r];
+	rule->dfs_cac_ms = 0;
+}
+
 const struct ieee80211_regdomain *
 reglib_get_rd_alpha2(const char *alpha2, const char *file);
 
+/**
+ * reglib_get_rd_alpha2_ctx - get the regulatory domain for an alpha2
+ *
+ * @ctx: a reglib regdb context created with reglib_malloc_regdb_ctx()
+ * @alpha2: the ISO / IEC 3166 alpha2, or "00" for the world domain
+ *
+ * Looks up @alpha2 in the direct index built when @ctx was created, so
+ * this takes constant time and requires no access to the db file other
+ * than decoding the country found. Returns a regulatory domain you must
+ * free() or NULL if @alpha2 is not in the db.
+ */
+const struct ieee80211_regdomain *
+reglib_get_rd_alpha2_ctx(const struct reglib_regdb_ctx *ctx,
+			 const char *alpha2);
+
 /**
  * reglib_is_valid_rd - validate regulatory domain data structure
  *
@@ -175,9 +600,108 @@ int reglib_is_valid_rd(const struct ieee80211_regdomain *rd);
 
 /* reg helpers */
 void reglib_print_regdom(const struct ieee80211_regdomain *rd);
+void reglib_print_rd_view(const struct reglib_rd_view *view);
+void reglib_fprint_regdom(FILE *fp, const struct ieee80211_regdomain *rd);
+void reglib_fprint_rd_view(FILE *fp, const struct reglib_rd_view *view);
+
+/**
+ * reglib_format_regdom - render a regulatory domain as text into a buffer
+ *
+ * @rd: regulatory domain to render
+ * @buf: buffer to render into
+ * @len: size of @buf
+ *
+ * Renders the same text reglib_print_regdom() prints, without allocating.
+ * Like snprintf() at most @len - 1 characters are stored followed by a
+ * NUL and the length of the whole text is returned, if that is @len or
+ * more the text was truncated.
+ */
+size_t reglib_format_regdom(const struct ieee80211_regdomain *rd,
+			    char *buf, size_t len);
+
+/**
+ * reglib_format_rd_view - reglib_format_regdom() for a country view
+ *
+ * @view: country view to render
+ * @buf: buffer to render into
+ * @len: size of @buf
+ */
+size_t reglib_format_rd_view(const struct reglib_rd_view *view,
+			     char *buf, size_t len);
+
+#define REGLIB_RULE_BLOCK	16
+
+/**
+ * struct reglib_rule_block - a block of rules as arrays of their members
+ *
+ * @start_freq_khz: start frequency of each rule
+ * @end_freq_khz: end frequency of each rule
+ * @max_bandwidth_khz: maximum bandwidth of each rule
+ * @max_antenna_gain: maximum antenna gain of each rule
+ * @max_eirp: maximum EIRP of each rule
+ * @flags: flags of each rule
+ */
+struct reglib_rule_block {
+	uint32_t start_freq_khz[REGLIB_RULE_BLOCK];
+	uint32_t end_freq_khz[REGLIB_RULE_BLOCK];
+	uint32_t max_bandwidth_khz[REGLIB_RULE_BLOCK];
+	uint32_t max_antenna_gain[REGLIB_RULE_BLOCK];
+	uint32_t max_eirp[REGLIB_RULE_BLOCK];
+	uint32_t flags[REGLIB_RULE_BLOCK];
+};
+
+/* Copies rule @i of a block */
+static inline void
+reglib_rule_block_get(const struct reglib_rule_block *block, unsigned int i,
+		      struct ieee80211_reg_rule *rule)
+{
+	rule->freq_range.start_freq_khz = block->start_freq_khz[i];
+	rule->freq_range.end_freq_khz = block->end_freq_khz[i];
+	rule->freq_range.max_bandwidth_khz = block->max_bandwidth_khz[i];
+	rule->power_rule.max_antenna_gain = block->max_antenna_gain[i];
+	rule->power_rule.max_eirp = block->max_eirp[i];
+	rule->flags = block->flags[i];
+	rule->dfs_cac_ms = 0;
+}
+
+/* Stores @rule as rule @i of a block */
+static inline void
+reglib_rule_block_set(struct reglib_rule_block *block, unsigned int i,
+		      const struct ieee80211_reg_rule *rule)
+{
+	block->start_freq_khz[i] = rule->freq_range.start_freq_khz;
+	block->end_freq_khz[i] = rule->freq_range.end_freq_khz;
+	block->max_bandwidth_khz[i] = rule->freq_range.max_bandwidth_khz;
+	block->max_antenna_gain[i] = rule->power_rule.max_antenna_gain;
+	block->max_eirp[i] = rule->power_rule.max_eirp;
+	block->flags[i] = rule->flags;
+}
+
+/**
+ * reglib_intersect_rule_block - intersect a rule with a block of rules
+ *
+ * @rule: the rule to intersect
+ * @block: the rules to intersect @rule with
+ * @n: number of rules in @block, up to %REGLIB_RULE_BLOCK
+ * @out: the intersections, rule i of @out is that of rule i of @block
+ *
+ * Computes what reglib_intersect_rds() does for a pair of rules for
+ * the first @n rules of @block at once, with SSE4.1, AVX2 or NEON where
+ * the CPU has them. Returns a mask with bit i set if rule i of @out is a
+ * valid rule, the others are undefined.
+ */
+uint32_t reglib_intersect_rule_block(const struct ieee80211_reg_rule *rule,
+				     const struct reglib_rule_block *block,
+				     unsigned int n,
+				     struct reglib_rule_block *out);
+
 struct ieee80211_regdomain *
 reglib_intersect_rds(const struct ieee80211_regdomain *rd1,
 		     const struct ieee80211_regdomain *rd2);
+struct ieee80211_regdomain *
+reglib_intersect_rds_arena(const struct ieee80211_regdomain *rd1,
+			   const struct ieee80211_regdomain *rd2,
+			   struct reglib_arena *arena);
 
 /**
  * reglib_intersect_regdb - intersects a regulatory database
@@ -193,6 +717,334 @@ reglib_intersect_rds(const struct ieee80211_regdomain *rd1,
 const struct ieee80211_regdomain *
 reglib_intersect_regdb(const struct reglib_regdb_ctx *ctx);
 
+/**
+ * reglib_intersect_regdb_parallel - intersects a regulatory database in parallel
+ *
+ * @ctx: the regdb context to intersect
+ * @nthreads: number of threads to use, 0 to use one per online CPU
+ *
+ * Same as reglib_intersect_regdb() but the intersection is done as a
+ * pairwise tree reduction over the countries with the levels of the tree
+ * spread over @nthreads threads. The result is identical to the one of
+ * reglib_intersect_regdb().
+ */
+const struct ieee80211_regdomain *
+reglib_intersect_regdb_parallel(const struct reglib_regdb_ctx *ctx,
+				unsigned int nthreads);
+
+#define REGLIB_MAX_THREADS	1024
+
+/**
+ * reglib_parse_nthreads - parses a number of threads given on the command line
+ *
+ * @arg: the argument, a decimal number from 0 to REGLIB_MAX_THREADS
+ * @nthreads: set to the number parsed
+ *
+ * For the -j options of the tools, 0 means one thread per online CPU as
+ * it does for the functions taking @nthreads. Returns 0 or -EINVAL if
+ * @arg is not such a number, with @nthreads left as it was.
+ */
+int reglib_parse_nthreads(const char *arg, unsigned int *nthreads);
+
+struct reglib_ordered_pool;
+
+/**
+ * reglib_malloc_ordered_pool - start a pool of workers with ordered output
+ *
+ * @nthreads: number of workers, 0 to use one per online CPU
+ * @out: stream all output ends up on
+ * @process: called on a worker for each item submitted, writing to @out
+ *	the stream it is passed. A non zero return fails the pool.
+ * @data: passed on to @process
+ *
+ * Each item is processed into a buffer of its own and the buffers get
+ * written to @out in the order the items were submitted, so the output is
+ * the same as it would be processing the items one after another on @out.
+ * Returns NULL if the pool could not be started.
+ */
+struct reglib_ordered_pool *
+reglib_malloc_ordered_pool(unsigned int nthreads, FILE *out,
+			   int (*process)(void *item, FILE *out, void *data),
+			   void *data);
+
+/**
+ * reglib_ordered_pool_submit - queue an item on an ordered pool
+ *
+ * @pool: the pool to queue @item on
+ * @item: the item to pass to the pool's process routine
+ *
+ * Waits for room if the pool already has a few items per worker in flight.
+ * The item is owned by the pool's process routine from here on, even if
+ * this fails. Returns the first error of the pool's process routine so far,
+ * if any, so producers can stop early, or 0.
+ */
+int reglib_ordered_pool_submit(struct reglib_ordered_pool *pool, void *item);
+
+/**
+ * reglib_free_ordered_pool - finish all items of an ordered pool and free it
+ *
+ * @pool: the pool to free
+ *
+ * Waits for all items submitted to be processed and written out. Returns
+ * the first error of the pool's process routine, -EIO if writing the output
+ * failed or 0.
+ */
+int reglib_free_ordered_pool(struct reglib_ordered_pool *pool);
+
+/**
+ * struct reglib_band - a frequency band for reglib_intersect_matrix()
+ *
+ * @start_freq_khz: start of the band
+ * @end_freq_khz: end of the band
+ */
+struct reglib_band {
+	uint32_t start_freq_khz;
+	uint32_t end_freq_khz;
+};
+
+/**
+ * struct reglib_matrix_cell - what two countries have in common in a band
+ *
+ * @spectrum_khz: how much of the band the rules of the intersection of
+ * 	both countries cover
+ * @max_eirp: the largest maximum EIRP of those rules, 0 if there are none
+ */
+struct reglib_matrix_cell {
+	uint32_t spectrum_khz;
+	uint32_t max_eirp;
+};
+
+/**
+ * reglib_intersect_matrix - intersects all pairs of countries of a regdb
+ *
+ * @ctx: the regdb context
+ * @bands: the bands to account the intersections to
+ * @n_bands: number of @bands
+ * @cells: the matrix, room for @n_bands cells for each pair of countries
+ * @nthreads: threads to use, 0 to use one per online CPU
+ *
+ * For each pair of countries i and j of @ctx, in order of the db,
+ * @cells[(i * n + j) * @n_bands + b] gets what the intersection of
+ * both has in band b, for n countries. The countries get decoded once
+ * and are intersected rule block by rule block without allocating any
+ * domains. Returns 0 or a negative error.
+ */
+int reglib_intersect_matrix(const struct reglib_regdb_ctx *ctx,
+			    const struct reglib_band *bands,
+			    unsigned int n_bands,
+			    struct reglib_matrix_cell *cells,
+			    unsigned int nthreads);
+
+/**
+ * reglib_rd_hash - hash of the canonical rule set of a regulatory domain
+ *
+ * @rd: the regulatory domain, its rules get sorted
+ *
+ * Sorts the rules of @rd into their canonical order and returns a 64 bit
+ * hash of its DFS region and of its distinct rules, so two domains with
+ * the same rules in a different order or written more than once hash the
+ * same. The alpha2 is not hashed. Equal hashes do not prove equal rule
+ * sets, this is for callers that keep nothing but the hash of a domain,
+ * reglib_diff_ctx() compares the rules themselves.
+ */
+uint64_t reglib_rd_hash(struct ieee80211_regdomain *rd);
+
+enum reglib_diff_type {
+	REGLIB_DIFF_ADDED,
+	REGLIB_DIFF_REMOVED,
+	REGLIB_DIFF_CHANGED,
+};
+
+/**
+ * struct reglib_diff - a country that differs between two regdbs
+ *
+ * @type: whether the country was added, removed or changed
+ * @alpha2: the alpha2 of the country, NUL terminated
+ * @old_rd: the country in the old db, NULL if it was added
+ * @new_rd: the country in the new db, NULL if it was removed
+ *
+ * The rules of @old_rd and @new_rd are in canonical order, see
+ * reglib_rd_hash(), and are only valid while the callback runs.
+ */
+struct reglib_diff {
+	enum reglib_diff_type type;
+	char alpha2[3];
+	const struct ieee80211_regdomain *old_rd;
+	const struct ieee80211_regdomain *new_rd;
+};
+
+/**
+ * reglib_diff_ctx - compares two regdbs country by country
+ *
+ * @old_ctx: the old regdb context
+ * @new_ctx: the new regdb context
+ * @fn: called for each country that differs, a non zero return stops
+ * @data: passed to @fn
+ *
+ * Goes through the alpha2s of both dbs once, world regulatory domain
+ * first and then in alphabetical order, and calls @fn for the countries
+ * only one of them has and for the ones whose DFS region or distinct
+ * rules, compared in canonical order, differ. Returns 0 once done, what
+ * @fn returned if it stopped early or -ENOMEM.
+ */
+int reglib_diff_ctx(const struct reglib_regdb_ctx *old_ctx,
+		    const struct reglib_regdb_ctx *new_ctx,
+		    int (*fn)(const struct reglib_diff *diff, void *data),
+		    void *data);
+
+/**
+ * reglib_intersect_regdb_arena - reglib_intersect_regdb() using an arena
+ *
+ * @ctx: the regdb context to intersect
+ * @arena: the arena to take all domains from, including the result
+ */
+const struct ieee80211_regdomain *
+reglib_intersect_regdb_arena(const struct reglib_regdb_ctx *ctx,
+			     struct reglib_arena *arena);
+
+/**
+ * reglib_intersect_alpha2_set - intersects a set of countries of a regdb
+ *
+ * @ctx: the regdb context to take the countries from
+ * @codes: the alpha2 of each country to intersect, "00" for the world
+ * @n: number of entries in @codes
+ *
+ * Looks up each of @codes in @ctx and intersects them, only the countries
+ * asked for are decoded. A single code gets you that country's domain.
+ * Returns a regulatory domain you must free() or NULL if any of @codes is
+ * not in the db or the countries have no common rules.
+ */
+const struct ieee80211_regdomain *
+reglib_intersect_alpha2_set(const struct reglib_regdb_ctx *ctx,
+			    const char *const *codes, unsigned int n);
+
+/**
+ * reglib_intersect_alpha2_set_arena - reglib_intersect_alpha2_set() using an arena
+ *
+ * @ctx: the regdb context to take the countries from
+ * @codes: the alpha2 of each country to intersect
+ * @n: number of entries in @codes
+ * @arena: the arena to take all domains from, including the result
+ */
+const struct ieee80211_regdomain *
+reglib_intersect_alpha2_set_arena(const struct reglib_regdb_ctx *ctx,
+				  const char *const *codes, unsigned int n,
+				  struct reglib_arena *arena);
+
+/**
+ * reglib_intersect_alpha2_set_cached - reglib_intersect_alpha2_set() through a cache
+ *
+ * @ctx: the regdb context to take the countries from
+ * @codes: the alpha2 of each country to intersect, "00" for the world
+ * @n: number of entries in @codes
+ *
+ * Same as reglib_intersect_alpha2_set() but results are kept on an LRU
+ * cache of @ctx keyed by the set of @codes, so asking again for the same
+ * set, in any order, gets you the same shared domain without intersecting
+ * anything. The countries are intersected in sorted order with duplicates
+ * dropped. As the cache lives with @ctx, reloading the db gets you a new
+ * one. The result must not be modified and must be released with
+ * reglib_put_cached_rd(), this may be done after freeing @ctx.
+ */
+const struct ieee80211_regdomain *
+reglib_intersect_alpha2_set_cached(const struct reglib_regdb_ctx *ctx,
+				   const char *const *codes, unsigned int n);
+
+/**
+ * reglib_put_cached_rd - release a domain from reglib_intersect_alpha2_set_cached()
+ *
+ * @rd: the domain to release, may be NULL
+ */
+void reglib_put_cached_rd(const struct ieee80211_regdomain *rd);
+
+/**
+ * struct reglib_parser - single pass parser for the db.txt format
+ *
+ * A parser reads its input exactly once, in order, so it works on pipes
+ * without copying them to a temporary file first. Lines with comments are
+ * skipped as reglib_create_parse_stream() would have removed them.
+ */
+struct reglib_parser;
+
+/**
+ * reglib_malloc_parser - create a parser reading from a stream
+ *
+ * @fp: FILE stream to read from, such as stdin, it is not closed on
+ * 	reglib_free_parser()
+ */
+struct reglib_parser *reglib_malloc_parser(FILE *fp);
+
+/**
+ * reglib_malloc_parser_buf - create a parser reading from a buffer
+ *
+ * @buf: the db.txt contents, which must stay around while parsing
+ * @len: length of @buf
+ */
+struct reglib_parser *reglib_malloc_parser_buf(const char *buf, size_t len);
+
+void reglib_free_parser(struct reglib_parser *parser);
+
+/**
+ * reglib_parser_next_country - parse the next country of a parser
+ *
+ * @parser: the parser to read from
+ *
+ * Returns the next regulatory domain you must free() or NULL once no
+ * more could be built, same as reglib_parse_country().
+ */
+struct ieee80211_regdomain *
+reglib_parser_next_country(struct reglib_parser *parser);
+
+/* reglib_parser_next_country() allocating the domain from @arena */
+struct ieee80211_regdomain *
+reglib_parser_next_country_arena(struct reglib_parser *parser,
+				 struct reglib_arena *arena);
+
+/**
+ * reglib_parse_buffer - parse all countries of a db.txt buffer
+ *
+ * @buf: the db.txt contents, need not be NUL terminated
+ * @len: length of @buf
+ * @cb: called for each country parsed, a non zero return stops parsing
+ * @data: passed to @cb
+ *
+ * Parses @buf in place without copying its lines or allocating for each
+ * country, numbers are read as fixed point decimals so frequencies come
+ * out exact in kHz. The domain handed to @cb is scratch space of the
+ * parser which is only valid during the call, copy it to keep it.
+ * Returns 0 once no more countries could be built, the non zero return of
+ * @cb if it stopped parsing or a negative error.
+ */
+int reglib_parse_buffer(const char *buf, size_t len,
+			int (*cb)(struct ieee80211_regdomain *rd, void *data),
+			void *data);
+
+/**
+ * reglib_dup_regdom - copy a regulatory domain
+ *
+ * @rd: the domain to copy, such as the scratch one of a parse callback
+ *
+ * Returns a copy of @rd with its rules to be freed by the caller, or NULL
+ * if out of memory.
+ */
+struct ieee80211_regdomain *
+reglib_dup_regdom(const struct ieee80211_regdomain *rd);
+
+/**
+ * reglib_parse_stream - parse all countries of a db.txt stream
+ *
+ * @fp: FILE stream to read from, such as stdin
+ * @cb: as for reglib_parse_buffer()
+ * @data: passed to @cb
+ *
+ * Same as reglib_parse_buffer() for a stream. If @fp is a regular file it
+ * gets mapped and parsed in place from its current position, @fp itself is
+ * not moved then. Anything else, like a pipe, is read line by line.
+ */
+int reglib_parse_stream(FILE *fp,
+			int (*cb)(struct ieee80211_regdomain *rd, void *data),
+			void *data);
+
 /**
  * @reglib_create_parse_stream - provide a clean new stream for processing
  *
@@ -203,7 +1055,8 @@ reglib_intersect_regdb(const struct reglib_regdb_ctx *ctx);
  * with stdin, as otherwise we cannot rewind() and move around
  * the stream. This helper will create new stream using tmpfile()
  * and also remove all comments. It will be closed and the file
- * deleted when the process terminates.
+ * deleted when the process terminates. A reglib_parser does not need
+ * this and reads the input only once, which you should prefer.
  */
 FILE *reglib_create_parse_stream(FILE *fp);
 
@@ -217,6 +1070,10 @@ FILE *reglib_create_parse_stream(FILE *fp);
  */
 struct ieee80211_regdomain *reglib_parse_country(FILE *fp);
 
+/* reglib_parse_country() allocating the domain from @arena */
+struct ieee80211_regdomain *
+reglib_parse_country_arena(FILE *fp, struct reglib_arena *arena);
+
 /**
  * @reglib_optimize_regdom - optimize a regulatory domain
  *
@@ -228,14 +1085,196 @@ struct ieee80211_regdomain *reglib_parse_country(FILE *fp);
  * domain and its expression.
  *
  * Regulatory rules will be combined if their max allowed
- * bandwidth, max EIRP, and flags all match.
+ * bandwidth, max EIRP, and flags all match. Rules are grouped on all
+ * those and sorted by frequency, so this takes O(n log n) and the
+ * result does not depend on the order of the rules. Each combined rule
+ * takes the place of the first of its rules.
  */
 struct ieee80211_regdomain *
 reglib_optimize_regdom(struct ieee80211_regdomain *rd);
 
+/* reglib_optimize_regdom() taking its result and scratch space from @arena */
+struct ieee80211_regdomain *
+reglib_optimize_regdom_arena(struct ieee80211_regdomain *rd,
+			     struct reglib_arena *arena);
+
+/**
+ * reglib_optimize_regdom_validate - check the optimizer against the old one
+ *
+ * @rd: a regulatory domain to be optimized
+ *
+ * Optimizes @rd with reglib_optimize_regdom() and with the pairwise
+ * algorithm it replaced and compares the rules of both, regardless of
+ * their order. Returns 0 if they match and 1 otherwise. The pairwise
+ * algorithm does not look at the bandwidth of rules and depends on their
+ * order, so expect differences where that made it merge rules it should
+ * not have or miss ones it should have.
+ */
+int reglib_optimize_regdom_validate(struct ieee80211_regdomain *rd);
+
+/**
+ * struct reglib_freq_index - frequency index of a regulatory domain
+ *
+ * Answers which rule of a domain applies to a channel in O(log n) of the
+ * rules. Build one per domain with reglib_malloc_freq_index() and query
+ * it with reglib_query_freq() or reglib_query_freqs(). The index keeps a
+ * copy of the rules so it does not depend on the domain it was built of.
+ */
+struct reglib_freq_index;
+
+struct reglib_freq_index *
+reglib_malloc_freq_index(const struct ieee80211_regdomain *rd);
+void reglib_free_freq_index(struct reglib_freq_index *index);
+
+/**
+ * reglib_query_freq - find the rule that applies to a channel
+ *
+ * @index: frequency index of the domain
+ * @center_khz: center frequency of the channel
+ * @bw_khz: width of the channel, 0 to only look at the center frequency
+ * @rule: set to the rule that applies, which lives as long as @index
+ *
+ * A channel fits a rule if it lies within the frequency range of the rule
+ * and is no wider than its maximum bandwidth, the first rule of the domain
+ * the channel fits applies. Returns 0 or -ENOENT if the channel fits no
+ * rule, setting @rule to NULL, which means it is not allowed.
+ */
+int reglib_query_freq(const struct reglib_freq_index *index,
+		      uint32_t center_khz, uint32_t bw_khz,
+		      const struct ieee80211_reg_rule **rule);
+
+/**
+ * struct reglib_freq_query - a channel to look up with reglib_query_freqs()
+ *
+ * @center_khz: center frequency of the channel
+ * @bw_khz: width of the channel
+ * @rule: set to the rule that applies or NULL as with reglib_query_freq()
+ */
+struct reglib_freq_query {
+	uint32_t center_khz;
+	uint32_t bw_khz;
+	const struct ieee80211_reg_rule *rule;
+};
+
+/**
+ * reglib_query_freqs - reglib_query_freq() for a list of channels
+ *
+ * @index: frequency index of the domain
+ * @queries: the channels to look up
+ * @n: number of entries in @queries
+ *
+ * Sets the rule of each of @queries and returns the number of them that
+ * are allowed. Channels in order of frequency, as channel plans come, are
+ * mostly looked up without a search.
+ */
+unsigned int reglib_query_freqs(const struct reglib_freq_index *index,
+				struct reglib_freq_query *queries,
+				unsigned int n);
+
+/**
+ * struct reglib_regdb_writer - builds a binary regulatory database
+ *
+ * Collects regulatory domains, such as the ones parsed off a db.txt, and
+ * lays them out the way db2bin.py does, with the records sorted as it
+ * sorts them, whatever order the domains are added in. Identical power
+ * rules, frequency ranges, rules and rule collections are only stored
+ * once.
+ */
+struct reglib_regdb_writer;
+
+struct reglib_regdb_writer *reglib_malloc_regdb_writer(void);
+void reglib_free_regdb_writer(struct reglib_regdb_writer *writer);
+
+/**
+ * reglib_regdb_writer_add - add a country to a regdb writer
+ *
+ * @writer: the writer to add to
+ * @rd: the regulatory domain of the country, it is copied
+ *
+ * Returns 0, -EEXIST if the writer already has the alpha2 of @rd or
+ * -ENOMEM. The DFS CAC time of rules has no place in the file format and
+ * is dropped.
+ */
+int reglib_regdb_writer_add(struct reglib_regdb_writer *writer,
+			    const struct ieee80211_regdomain *rd);
+
+/**
+ * reglib_regdb_writer_build - lay out the binary regulatory database
+ *
+ * @writer: the writer to build from
+ * @siglen: length of the signature that is to follow the db, 0 for none
+ * @len: set to the length of the file built, including the signature
+ *
+ * Returns a buffer you must free() holding the file, with its last
+ * @siglen bytes zeroed for you to put the signature of the bytes before
+ * it in, or NULL on failure.
+ */
+uint8_t *reglib_regdb_writer_build(struct reglib_regdb_writer *writer,
+				   uint32_t siglen, size_t *len);
+
+/**
+ * struct reglib_stats - what reglib did in this process
+ *
+ * Counters and times are only kept while reglib_enable_stats() has them
+ * on. Times are in nanoseconds of the monotonic clock.
+ *
+ * @ctx_opens: regdb contexts created or tried to
+ * @open_ns: time spent mapping regdbs and checking their header
+ * @verifies: signature verifications of regdbs
+ * @verify_ns: time spent hashing and verifying regdbs
+ * @bytes_hashed: bytes of regdbs hashed
+ * @keys_tried: trusted keys signatures were checked against
+ * @sigcache_hits: verifications skipped through REGDB_SIGCACHE
+ * @lookups: countries looked up by alpha2
+ * @lookup_misses: lookups of an alpha2 the regdb does not have
+ * @decodes: countries decoded into a regulatory domain
+ * @decode_ns: time spent decoding countries
+ * @allocs: regulatory domains and scratch space allocated off the heap
+ * @alloc_bytes: bytes of those
+ */
+struct reglib_stats {
+	uint64_t ctx_opens;
+	uint64_t open_ns;
+	uint64_t verifies;
+	uint64_t verify_ns;
+	uint64_t bytes_hashed;
+	uint64_t keys_tried;
+	uint64_t sigcache_hits;
+	uint64_t lookups;
+	uint64_t lookup_misses;
+	uint64_t decodes;
+	uint64_t decode_ns;
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+};
+
+/* reglib_enable_stats - start or stop keeping struct reglib_stats */
+void reglib_enable_stats(bool enable);
+
+/* reglib_get_stats - get a snapshot of the stats of the process */
+void reglib_get_stats(struct reglib_stats *stats);
+
+/* reglib_reset_stats - zero the stats of the process */
+void reglib_reset_stats(void);
+
+/**
+ * reglib_fprint_stats - print stats
+ *
+ * @fp: stream to print to
+ * @stats: the stats, such as the ones reglib_get_stats() got
+ *
+ * Prints a "name value" line for each member of @stats.
+ */
+void reglib_fprint_stats(FILE *fp, const struct reglib_stats *stats);
+
 #define reglib_for_each_country_stream(__fp, __rd)		\
 	for (__rd = reglib_parse_country(__fp);			\
 	     __rd != NULL;					\
 	     __rd = reglib_parse_country(__fp))			\
 
+#define reglib_for_each_country_parser(__parser, __rd)		\
+	for (__rd = reglib_parser_next_country(__parser);	\
+	     __rd != NULL;					\
+	     __rd = reglib_parser_next_country(__parser))		\
+
 #endif